@@ -10,31 +10,118 @@
 
 #include "modes.h"
 #include "obd2.h"
+#include "cantraffic.h"
+#include "cantxqueue.h"
 
 #define CAN_TX_THREAD_STACK_SIZE 512
 #define CAN_TX_THREAD_PRIORITY 2
-#define CAN_RX_THREAD_STACK_SIZE 512
+#define CAN_RX_THREAD_STACK_SIZE 1024
 #define CAN_RX_THREAD_PRIORITY 2
 #define CAN_STATE_POLL_THREAD_STACK_SIZE 512
 #define CAN_STATE_POLL_THREAD_PRIORITY 2
 #define CAN_SLEEP_TIME K_MSEC(250)
 
+// Frames land in these slots straight from the driver callback and are
+// handled in place, must be a power of two.
+#define CAN_RX_RING_SIZE 256
+
+// Define to keep cycle counts for the RX ISR and per-frame handling
+// #define CAN_RX_CYCLE_STATS
+
+// Where a received frame came from.  Everything that logs or forwards
+// frames tags them with this, so both buses can be recorded together.
+#define CAN_CHANNEL_CAN1 0
+#define CAN_CHANNEL_MCP2515 1
+
+#define SWCAN_NORMAL_BITRATE 33333
+#define SWCAN_HIGH_SPEED_BITRATE 83333
+#define SWCAN_WAKEUP_ID 0x100
+#define SWCAN_MODE_SETTLE_US 500
+
+// TH8056 mode pins, value is MODE1:MODE0
+typedef enum {
+    SWCAN_SLEEP = 0,
+    SWCAN_HIGH_SPEED = 1,
+    SWCAN_WAKEUP = 2,
+    SWCAN_NORMAL = 3,
+} swcan_mode_t;
+
+// Queued in a CANTxQueue slot until the TX thread takes it
+typedef struct {
+    struct zcan_frame frame;
+    uint32_t queued;    // obd_timestamp() when the frame entered the device
+    uint32_t key;       // CAN_ARBITRATION_KEY()
+} can_tx_entry_t;
+
+// Frames held back by their own ID's rate limit, so the rest of the queue
+// keeps moving.  Kept in arrival order, later frames of a held ID wait
+// behind the first.
+#define CAN_TX_DEFER_MAX 8
+#define CAN_TX_IDLE_US 100000
+
+typedef struct {
+    can_tx_entry_t entry;
+    uint32_t ready;     // obd_timestamp() to ask the rate limit again
+} can_tx_deferred_t;
+
+typedef struct {
+    struct zcan_frame frame;
+    uint32_t timestamp;     // obd_timestamp() in the RX ISR
+} can_rx_slot_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+} can_cycle_stats_t;
+
+// Time from a frame entering the device until can_send() completes
+typedef struct {
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint64_t total_us;
+} can_latency_stats_t;
+
 void canbus_state_change_work_handler(struct k_work *work);
 void canbus_state_change_isr(enum can_state state, struct can_bus_err_cnt err_cnt);
 void canbus_rx_thread(void *arg1, void *arg2, void *arg3);
+void canbus_rx_isr(struct zcan_frame *frame, void *arg);
 void canbus_tx_thread(void *arg1, void *arg2, void *arg3);
 void canbus_poll_state_thread(void *arg1, void *arg2, void *arg3);
 
 class CANBusPort : public OBDPort {
     public:
-        CANBusPort() : OBDPort(), _filter_id(-1) {};
+        CANBusPort() : OBDPort(), _rx_head(0), _rx_tail(0), _rx_overruns(0), _filter_id(-1), _std_filter_id(-1), _periodic_key(CANTRAFFIC_KEY_EMPTY), _bitrate(0), _swcan_mode(SWCAN_SLEEP), _tx_deferred(0) { k_mutex_init(&_tx_mutex); resetTxLatency(); };
         void begin(void);
         void setMode(operation_mode_t mode);
         bool send(obd_packet_t *packet);
+        bool sendFrame(const struct zcan_frame *frame, k_timeout_t timeout = K_FOREVER, uint32_t queued = 0);
+        void getTxLatency(can_latency_stats_t *stats);
+        void resetTxLatency(void);
+
+        operation_mode_t getMode(void) { return _mode; };
+
+        void setSWCANMode(swcan_mode_t mode);
+        swcan_mode_t getSWCANMode(void) { return _swcan_mode; };
+        bool wakeupSWCAN(void);
+
+        bool routePeriodic(uint32_t id, bool ext);
+        void unroutePeriodic(void);
+
+        void receive(uint8_t channel, operation_mode_t mode, const struct zcan_frame *frame, uint32_t timestamp);
+        static void dispatch(operation_mode_t mode, const struct zcan_frame *frame, uint32_t timestamp);
+
+        uint32_t getRxOverruns(void) { return _rx_overruns; };
+#ifdef CAN_RX_CYCLE_STATS
+        void getRxCycles(can_cycle_stats_t *isr, can_cycle_stats_t *thread);
+#endif
 
         friend void canbus_state_change_work_handler(struct k_work *work);
         friend void canbus_state_change_isr(enum can_state state, struct can_bus_err_cnt err_cnt);
         friend void canbus_rx_thread(void *arg1, void *arg2, void *arg3);
+        friend void canbus_rx_isr(struct zcan_frame *frame, void *arg);
         friend void canbus_tx_thread(void *arg1, void *arg2, void *arg3);
         friend void canbus_poll_state_thread(void *arg1, void *arg2, void *arg3);
         friend void canbus_state_change_work_handler(struct k_work *work);
@@ -50,17 +137,49 @@ class CANBusPort : public OBDPort {
         enum can_state _current_state;
         struct can_bus_err_cnt _current_err_cnt;
 
+        struct k_sem _rx_sem;
+        atomic_t _rx_head;      // written by the ISR only
+        atomic_t _rx_tail;      // written by the RX thread only
+        uint32_t _rx_overruns;
+#ifdef CAN_RX_CYCLE_STATS
+        can_cycle_stats_t _rx_isr_cycles;
+        can_cycle_stats_t _rx_thread_cycles;
+#endif
+
         int _filter_id;
+        int _std_filter_id;
+        volatile uint32_t _periodic_key;
+        uint32_t _bitrate;
+        swcan_mode_t _swcan_mode;
+        struct k_mutex _tx_mutex;
+        struct k_spinlock _tx_lock;
+        struct k_sem _tx_items;
+        struct k_sem _tx_space;
+        CANTxQueue _tx_queue;   // under _tx_lock
+        int _tx_deferred;       // TX thread only
+        struct k_spinlock _stats_lock;
+        can_latency_stats_t _tx_latency;
 
     	k_tid_t _rx_tid;
     	k_tid_t _tx_tid;
         k_tid_t _poll_state_tid;
 
         void rx_thread(void);
+        void rx_isr(const struct zcan_frame *frame);
         void tx_thread(void);
         void poll_state_thread(void);
         void state_change_work_handler(struct k_work *work);
         void state_change_isr(enum can_state state, struct can_bus_err_cnt err_cnt);
+        bool setBitrate(uint32_t bitrate);
+        void updateTxLatency(uint32_t latency);
+        void txPush(const can_tx_entry_t *entry);
+        void txPop(can_tx_entry_t *entry);
+        void txSchedule(const can_tx_entry_t *entry);
+        void txTransmit(const can_tx_entry_t *entry);
+        bool txDefer(const can_tx_entry_t *entry, uint32_t ready);
+        const can_tx_deferred_t *txDeferred(uint32_t key);
+        void txRetry(void);
+        uint32_t txRetryWait(void);
 
         static const char *state_to_str(enum can_state state);
 };
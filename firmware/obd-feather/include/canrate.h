@@ -0,0 +1,78 @@
+#ifndef __CANRATE_H_
+#define __CANRATE_H_
+
+#ifdef __cplusplus
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <drivers/can.h>
+
+// Token buckets in front of CAN TX, counted in bit times so the limits are
+// bus load rather than frame counts.  Tokens are kept in 1e-8 bit units so
+// a refill is just elapsed us * bitrate * percent.
+#define CANRATE_SCALE 100000000ULL
+#define CANRATE_MAX_LIMITS 16
+
+// How long a bucket may save up at its rate, bounded below by one frame
+#define CANRATE_BURST_US 10000
+
+// Worst case bits on the wire: stuffing over SOF through CRC, then CRC
+// delimiter, ACK, EOF and intermission.
+#define CANRATE_STD_STUFFED_BITS 34
+#define CANRATE_EXT_STUFFED_BITS 54
+#define CANRATE_TRAILER_BITS 13
+#define CANRATE_MAX_FRAME_BITS 160
+
+typedef struct {
+    uint64_t tokens;
+    uint32_t key;           // cantraffic key, or CANTRAFFIC_KEY_EMPTY
+    uint32_t updated;       // obd_timestamp() of the last refill
+    uint8_t percent;        // bus load allowed, 0 for no limit
+} canrate_bucket_t;
+
+typedef struct {
+    uint8_t percent;
+    uint32_t available;     // bit times that could go out right now
+    uint32_t capacity;
+} canrate_budget_t;
+
+static inline uint32_t canrate_frame_bits(const struct zcan_frame *frame)
+{
+    uint32_t data = frame->rtr == CAN_REMOTEREQUEST ? 0 : MIN(frame->dlc, 8) * 8;
+    uint32_t stuffed = data + (frame->id_type == CAN_EXTENDED_IDENTIFIER ?
+                               CANRATE_EXT_STUFFED_BITS : CANRATE_STD_STUFFED_BITS);
+
+    return stuffed + (stuffed - 1) / 4 + CANRATE_TRAILER_BITS;
+}
+
+class CANRateLimit {
+    public:
+        CANRateLimit() : _bitrate(0) { _global.percent = 0; reset(); };
+        void setGlobal(uint8_t percent);
+        bool setLimit(uint32_t id, bool ext, uint8_t percent);
+        void reset(void);
+
+        uint32_t acquire(const struct zcan_frame *frame, uint32_t bitrate, bool *shared = 0);
+
+        void getBudget(canrate_budget_t *budget);
+        bool getBudget(uint32_t id, bool ext, canrate_budget_t *budget);
+
+    protected:
+        struct k_spinlock _lock;
+        uint32_t _bitrate;
+        canrate_bucket_t _global;
+        canrate_bucket_t _limits[CANRATE_MAX_LIMITS];
+
+        canrate_bucket_t *find(uint32_t key);
+        uint64_t capacity(const canrate_bucket_t *bucket);
+        void fill(canrate_bucket_t *bucket, uint32_t now);
+        void refill(canrate_bucket_t *bucket, uint32_t now);
+        uint32_t deficit(const canrate_bucket_t *bucket, uint64_t cost);
+        void report(canrate_bucket_t *bucket, canrate_budget_t *budget);
+};
+
+extern CANRateLimit canrate;
+
+#endif
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef __CANTRAFFIC_H_
+#define __CANTRAFFIC_H_
+
+#ifdef __cplusplus
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <drivers/can.h>
+
+// Per-ID state for frames seen on the bus.  Open addressing in a power of
+// two table, sized for a busy powertrain bus with room to spare.
+#define CANTRAFFIC_TABLE_BITS 8
+#define CANTRAFFIC_TABLE_SIZE (1 << CANTRAFFIC_TABLE_BITS)
+#define CANTRAFFIC_MAX_PROBE 16
+
+#define CANTRAFFIC_KEY_EXT 0x80000000
+#define CANTRAFFIC_KEY_CHANNEL 0x40000000  // off the second controller, IDs are only 29 bits
+#define CANTRAFFIC_KEY_EMPTY 0xFFFFFFFF
+
+#define CANTRAFFIC_DEFAULT_HEARTBEAT_MS 1000
+
+// Cycle time tracking.  Period and jitter are running averages of the
+// inter-arrival time and its deviation, gains 1/8 and 1/4, kept scaled up
+// by 8 and 4 so the integer updates don't lose the small corrections.
+#define CANTRAFFIC_MIN_SAMPLES 8
+#define CANTRAFFIC_PERIODIC_MAX_JITTER 50       // % of period to call an ID periodic
+#define CANTRAFFIC_DEFAULT_JITTER_LIMIT 25      // % of period before flagging
+#define CANTRAFFIC_DEFAULT_MISSING_PERIODS 5
+#define CANTRAFFIC_CHECK_INTERVAL_US 100000
+
+#define CANTRAFFIC_PERIODIC 0x01
+#define CANTRAFFIC_MISSING 0x02
+#define CANTRAFFIC_JITTER 0x04
+
+typedef struct {
+    uint64_t payload;       // data bytes past the dlc are zeroed
+    uint32_t key;           // id | CANTRAFFIC_KEY_EXT | CANTRAFFIC_KEY_CHANNEL, or CANTRAFFIC_KEY_EMPTY
+    uint32_t last_forward;  // obd_timestamp() of the last copy passed on
+    uint32_t heartbeat;     // us, 0 to use the table default
+    uint32_t last_seen;     // obd_timestamp() of the last frame
+    uint32_t period8;       // us * 8
+    uint32_t jitter4;       // us * 4
+    uint8_t dlc;
+    uint8_t rtr;
+    uint8_t samples;        // inter-arrival times seen, saturates
+    uint8_t flags;
+} cantraffic_entry_t;
+
+typedef struct {
+    uint32_t period;        // us
+    uint32_t jitter;        // us
+    uint32_t age;           // us since the last frame
+    uint8_t samples;
+    uint8_t flags;
+} cantraffic_timing_t;
+
+static inline uint32_t cantraffic_key(const struct zcan_frame *frame)
+{
+    return frame->id | (frame->id_type == CAN_EXTENDED_IDENTIFIER ? CANTRAFFIC_KEY_EXT : 0);
+}
+
+class CANTraffic {
+    public:
+        CANTraffic() : _enabled(false), _tracking(true), _heartbeat(CANTRAFFIC_DEFAULT_HEARTBEAT_MS * 1000),
+            _jitter_limit(CANTRAFFIC_DEFAULT_JITTER_LIMIT), _missing_periods(CANTRAFFIC_DEFAULT_MISSING_PERIODS),
+            _last_check(0) { reset(); };
+        void enable(uint32_t heartbeat_ms);
+        void disable(void);
+        bool isEnabled(void) { return _enabled; };
+        bool setHeartbeat(uint32_t id, bool ext, uint32_t heartbeat_ms);
+        void reset(void);
+
+        bool forward(const struct zcan_frame *frame, uint32_t timestamp, uint8_t channel = 0);
+
+        void setTracking(bool tracking) { _tracking = tracking; };
+        void setJitterLimit(uint8_t percent) { _jitter_limit = percent; };
+        void setMissingPeriods(uint8_t periods) { _missing_periods = periods ? periods : 1; };
+        void check(uint32_t now);
+        bool getTiming(uint32_t id, bool ext, uint32_t now, cantraffic_timing_t *timing, uint8_t channel = 0);
+        uint8_t getJitterLimit(void) { return _jitter_limit; };
+        uint8_t getMissingPeriods(void) { return _missing_periods; };
+
+        uint32_t getForwarded(void) { return _forwarded; };
+        uint32_t getSuppressed(void) { return _suppressed; };
+        uint32_t getAnomalies(void) { return _anomalies; };
+
+    protected:
+        struct k_spinlock _lock;
+        bool _enabled;
+        bool _tracking;
+        uint32_t _heartbeat;
+        uint8_t _jitter_limit;
+        uint8_t _missing_periods;
+        uint32_t _last_check;
+        uint32_t _forwarded;
+        uint32_t _suppressed;
+        uint32_t _anomalies;
+
+        cantraffic_entry_t _table[CANTRAFFIC_TABLE_SIZE];
+
+        cantraffic_entry_t *lookup(uint32_t key);
+        uint8_t track(cantraffic_entry_t *entry, uint32_t timestamp);
+};
+
+extern CANTraffic cantraffic;
+
+#endif
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef __CANTXQUEUE_H_
+#define __CANTXQUEUE_H_
+
+#ifdef __cplusplus
+
+#include <stdint.h>
+
+// Pending frames are sent lowest arbitration key first, like the bus would
+#define CAN_TX_QUEUE_SIZE 32
+
+// The bits a frame puts on the bus up to the end of arbitration, so the
+// lower key wins: base ID, RTR (SRR for extended), IDE, ID extension, RTR.
+#define CAN_ARBITRATION_KEY(id, ext, rtr) \
+    ((ext) ? ((((id) >> 18) & 0x7FF) << 21) | (3 << 19) | (((id) & 0x3FFFF) << 1) | ((rtr) ? 1 : 0) \
+           : (((id) & 0x7FF) << 21) | ((rtr) ? (1 << 20) : 0))
+
+typedef struct {
+    uint32_t key;       // CAN_ARBITRATION_KEY()
+    uint32_t seq;       // keeps equal keys in arrival order
+    uint8_t slot;
+} can_tx_order_t;
+
+// Min-heap on arbitration key over CAN_TX_QUEUE_SIZE slots.  The frames
+// themselves live in the caller's array, indexed by slot, and the caller
+// does the locking.  Nothing in here knows about Zephyr, so it builds and
+// is tested on the host.
+class CANTxQueue {
+    public:
+        CANTxQueue() { reset(); };
+
+        int push(uint32_t key);     // slot to fill, -1 when full
+        int pop(void);              // lowest key's slot, -1 when empty.  It's
+                                    // free again, copy it out before the next push.
+        void reset(void);
+
+        int getCount(void) { return _count; };
+
+    protected:
+        can_tx_order_t _heap[CAN_TX_QUEUE_SIZE];
+        uint8_t _free[CAN_TX_QUEUE_SIZE];   // stack of CAN_TX_QUEUE_SIZE - _count slots
+        int _count;
+        uint32_t _seq;
+
+        bool before(const can_tx_order_t *a, const can_tx_order_t *b);
+        void swap(int a, int b);
+};
+
+#endif
+
+#endif
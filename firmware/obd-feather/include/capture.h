@@ -0,0 +1,173 @@
+#ifndef __CAPTURE_H_
+#define __CAPTURE_H_
+
+#ifdef __cplusplus
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <drivers/can.h>
+#include <fs/fs.h>
+
+// The player sits just below the CAN TX thread so a queued frame goes out
+// while it waits for the next one, and the card is only touched in the
+// player's idle time.
+#define CAPTURE_IO_THREAD_STACK_SIZE 1024
+#define CAPTURE_IO_THREAD_PRIORITY 5
+#define CAPTURE_PLAY_THREAD_STACK_SIZE 512
+#define CAPTURE_PLAY_THREAD_PRIORITY 3
+
+#define CAPTURE_MAGIC 0x5043464F    // "OFCP"
+#define CAPTURE_VERSION 4
+#define CAPTURE_VERSION_MIN 2       // before K-line records, 3 before channels
+
+// Records carry the cantraffic style key, plus RTR.  K-line records are one
+// byte each off the sniffer, with its KLINE_SNIFF_* flags in place of an ID.
+#define CAPTURE_ID_EXT 0x80000000
+#define CAPTURE_ID_RTR 0x40000000
+#define CAPTURE_ID_KLINE 0x20000000
+#define CAPTURE_ID_MASK 0x1FFFFFFF
+
+// The dlc only needs its low nibble, the controller a frame came in on
+// (CAN_CHANNEL_*) rides in the top one.  Older files read as can1.
+#define CAPTURE_DLC_MASK 0x0F
+#define CAPTURE_CHANNEL_SHIFT 4
+
+// Two blocks shared by recording and replay, one being filled or played
+// while the other is on its way to or from the card.  Blocks only ever hold
+// whole records.
+#define CAPTURE_BLOCK_SIZE 2048
+#define CAPTURE_BLOCK_COUNT 2
+
+#define CAPTURE_BLOCK_LAST 0x01     // end of the file, or of the recording
+#define CAPTURE_BLOCK_REWIND 0x02   // looped back to the start
+
+// Sleep until this close to a frame's send time, then spin the rest.  Long
+// gaps are slept in slices so stop() isn't held up by a quiet stretch.
+#define CAPTURE_SPIN_US 100
+#define CAPTURE_SLEEP_SLICE_US 50000
+
+#define CAPTURE_MAX_FILTERS 4
+#define CAPTURE_SPEED_REALTIME 100
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_header;     // fixed part of each record
+} __packed capture_header_t;
+
+// Records are back to back in the file, each only as long as its data
+typedef struct {
+    uint32_t timestamp;     // obd_timestamp() at reception
+    uint32_t id;            // id | CAPTURE_ID_EXT | CAPTURE_ID_RTR
+    uint8_t dlc;            // dlc | channel << CAPTURE_CHANNEL_SHIFT
+    uint8_t data[];         // dlc bytes, none for remote frames
+} __packed capture_record_t;
+
+#define CAPTURE_RECORD_MAX (sizeof(capture_record_t) + CAN_MAX_DLC)
+
+static inline uint8_t capture_data_len(uint32_t id, uint8_t dlc)
+{
+    return (id & CAPTURE_ID_RTR) ? 0 : MIN(dlc & CAPTURE_DLC_MASK, CAN_MAX_DLC);
+}
+
+static inline size_t capture_record_len(const capture_record_t *record)
+{
+    return sizeof(capture_record_t) + capture_data_len(record->id, record->dlc);
+}
+
+typedef struct {
+    uint8_t index;
+    uint8_t flags;
+    uint16_t len;
+} capture_block_t;
+
+// A record passes when (id & mask) == (filter id & mask), for the key with
+// CAPTURE_ID_EXT set on extended frames.  No filters passes everything.
+typedef struct {
+    uint32_t id;
+    uint32_t mask;
+} capture_filter_t;
+
+typedef struct {
+    uint16_t speed;         // percent of real time, 200 plays twice as fast
+    bool loop;
+    uint8_t filter_count;
+    capture_filter_t filters[CAPTURE_MAX_FILTERS];
+} capture_replay_opts_t;
+
+typedef enum {
+    CAPTURE_IDLE = 0,
+    CAPTURE_RECORDING,
+    CAPTURE_REPLAYING,
+} capture_state_t;
+
+void capture_io_thread(void *arg1, void *arg2, void *arg3);
+void capture_play_thread(void *arg1, void *arg2, void *arg3);
+
+class Capture {
+    public:
+        Capture() : _state(CAPTURE_IDLE), _active(-1), _dropped(0) {};
+        void begin(void);
+
+        bool startRecording(const char *path);
+        void record(const struct zcan_frame *frame, uint32_t timestamp, uint8_t channel);
+        void recordKLine(uint8_t byte, uint8_t flags, uint32_t timestamp);
+        bool startReplay(const char *path, const capture_replay_opts_t *opts);
+        void stop(void);
+
+        capture_state_t getState(void) { return _state; };
+        uint32_t getDropped(void) { return _dropped; };
+
+        friend void capture_io_thread(void *arg1, void *arg2, void *arg3);
+        friend void capture_play_thread(void *arg1, void *arg2, void *arg3);
+
+    protected:
+        struct k_thread _io_thread_data;
+        struct k_thread _play_thread_data;
+        k_tid_t _io_tid;
+        k_tid_t _play_tid;
+
+        struct k_mutex _mutex;
+        struct k_spinlock _lock;
+        struct k_sem _io_sem;
+        struct k_sem _play_sem;
+        struct k_sem _done_sem;
+
+        struct fs_file_t _file;
+        volatile capture_state_t _state;
+        capture_state_t _io_mode;
+        capture_replay_opts_t _opts;
+
+        int _active;            // block being filled by record(), -1 for none
+        uint16_t _active_len;
+        uint32_t _dropped;
+
+        uint8_t _carry[CAPTURE_RECORD_MAX];     // record split across reads
+        uint8_t _carry_len;
+
+        void io_thread(void);
+        void play_thread(void);
+        void writer(void);
+        void reader(void);
+
+        bool openFile(const char *path, bool write);
+        capture_record_t *reserve(void);
+        void commit(capture_record_t *record);
+        bool filter(uint32_t id);
+        void resetBlocks(void);
+        static int64_t now(void);
+        bool waitUntil(int64_t target);
+};
+
+extern Capture capture;
+
+extern "C" {
+#endif
+
+void capture_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
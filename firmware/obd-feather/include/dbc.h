@@ -0,0 +1,86 @@
+#ifndef __DBC_H_
+#define __DBC_H_
+
+#ifdef __cplusplus
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <drivers/can.h>
+
+#define DBC_FILE_PATH "/" CONFIG_SDMMC_VOLUME_NAME ":/vehicle.dbc"
+
+#define DBC_MAX_MESSAGES 128
+#define DBC_MAX_SIGNALS 256
+#define DBC_LINE_SIZE 256
+#define DBC_READ_SIZE 512
+
+// Scale and offset share one decimal exponent.  Text is read into a
+// mantissa of up to DBC_MANTISSA_LIMIT, and a signal is only taken if its
+// widest raw value times the scale, plus the offset, still fits an int64.
+#define DBC_MAX_DECIMALS 6
+#define DBC_MANTISSA_LIMIT 100000000000000000LL
+
+// DBC sets bit 31 of the message ID for extended frames, same as the
+// cantraffic key, so the two can be compared directly.
+#define DBC_ID_EXT 0x80000000
+
+#define DBC_SIGNAL_MOTOROLA 0x01
+#define DBC_SIGNAL_SIGNED 0x02
+
+typedef struct {
+    uint32_t key;           // id | DBC_ID_EXT
+    uint16_t first_signal;
+    uint8_t signal_count;
+    uint8_t dlc;
+} dbc_message_t;
+
+// Everything needed to pull one signal out of a frame without looking at the
+// DBC text again: raw = (word >> shift) & mask, where word is the payload
+// read little endian (Intel) or big endian (Motorola).
+typedef struct {
+    uint64_t mask;
+    int64_t scale;          // decimal mantissas, see valuestore decimals
+    int64_t offset;
+    uint16_t value_index;
+    uint8_t shift;
+    uint8_t length;
+    uint8_t flags;
+} dbc_signal_t;
+
+class DBC {
+    public:
+        DBC() : _ready(false), _collecting(false), _message_count(0), _signal_count(0) {};
+        bool load(const char *path);
+        void decode(const struct zcan_frame *frame, uint32_t timestamp);
+
+        uint16_t getMessageCount(void) { return _message_count; };
+        uint16_t getSignalCount(void) { return _signal_count; };
+
+    protected:
+        volatile bool _ready;
+        bool _collecting;       // signals belong to the last accepted message
+        uint16_t _message_count;
+        uint16_t _signal_count;
+        dbc_message_t _messages[DBC_MAX_MESSAGES];
+        dbc_signal_t _signals[DBC_MAX_SIGNALS];
+        char _message_name[DBC_LINE_SIZE / 4];     // for signal slot names
+
+        void parseLine(const char *line);
+        bool parseMessage(const char *p);
+        bool parseSignal(const char *p);
+        void sort(void);
+        const dbc_message_t *findMessage(uint32_t key);
+};
+
+extern DBC dbc;
+
+extern "C" {
+#endif
+
+void dbc_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
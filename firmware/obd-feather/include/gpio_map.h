@@ -16,6 +16,7 @@ extern const int gpio_output_count;
 
 typedef enum {
     GPIO_J1850_RX = 0,
+    GPIO_MCP2515_INT,
 } gpio_input_t;
 
 typedef enum {
@@ -30,6 +31,7 @@ typedef enum {
     GPIO_KLINE_EN,
     GPIO_ISO_K,
     GPIO_NEOPIXEL,
+    GPIO_MCP2515_CS,
 } gpio_output_t;
 
 void gpio_init(void);
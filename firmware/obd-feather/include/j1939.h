@@ -0,0 +1,178 @@
+#ifndef __J1939_H_
+#define __J1939_H_
+
+#ifdef __cplusplus
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <drivers/can.h>
+
+// Transport protocol reassembly buffers come from two fixed pools so that a
+// burst of short BAM sessions (DM1 etc) can't starve the few full-size ones.
+#define J1939_TP_MAX_SIZE 1785
+#define J1939_TP_SMALL_SIZE 256
+#define J1939_TP_SMALL_COUNT 8
+#define J1939_TP_LARGE_SIZE 1788	// J1939_TP_MAX_SIZE rounded up to a word
+#define J1939_TP_LARGE_COUNT 2
+#define J1939_TP_SESSION_COUNT (J1939_TP_SMALL_COUNT + J1939_TP_LARGE_COUNT)
+#define J1939_RX_QUEUE_SIZE 16
+
+#define J1939_PGN_REQUEST 0xEA00
+#define J1939_PGN_ADDRESS_CLAIMED 0xEE00
+#define J1939_PGN_TP_CM 0xEC00
+#define J1939_PGN_TP_DT 0xEB00
+
+#define J1939_TP_CM_RTS 16
+#define J1939_TP_CM_CTS 17
+#define J1939_TP_CM_EOM_ACK 19
+#define J1939_TP_CM_BAM 32
+#define J1939_TP_CM_ABORT 255
+
+#define J1939_ADDR_GLOBAL 0xFF
+#define J1939_ADDR_NULL 0xFE
+
+#define J1939_NAME_ARBITRARY_ADDRESS (1ULL << 63)
+
+// Self-configurable addresses, tried in turn after a lost claim
+#define J1939_ADDR_DYNAMIC_FIRST 128
+#define J1939_ADDR_DYNAMIC_LAST 247
+#define J1939_ADDR_DYNAMIC_COUNT (J1939_ADDR_DYNAMIC_LAST - J1939_ADDR_DYNAMIC_FIRST + 1)
+
+// Timeouts from J1939-21, in ms
+#define J1939_TIMEOUT_T1 750
+#define J1939_TIMEOUT_T2 1250
+#define J1939_CLAIM_TIMEOUT 250
+#define J1939_POLL_INTERVAL 50
+
+typedef enum {
+    J1939_CLAIM_IDLE = 0,
+    J1939_CLAIM_PENDING,
+    J1939_CLAIM_DONE,
+    J1939_CLAIM_FAILED,
+} j1939_claim_state_t;
+
+typedef struct {
+    uint32_t pgn;
+    uint8_t priority;
+    uint8_t src;
+    uint8_t dst;
+    uint16_t length;
+    uint8_t *buffer;    // pooled TP buffer, or NULL when the payload is in data
+    uint8_t data[8];
+} j1939_message_t;
+
+typedef struct {
+    bool active;
+    bool bam;
+    bool respond;       // RTS addressed to us, so we drive CTS/EOM_ACK
+    uint8_t src;
+    uint8_t dst;
+    uint32_t pgn;
+    uint16_t size;
+    uint8_t packets;
+    uint8_t next_seq;
+    uint8_t window_end;
+    uint8_t max_window;
+    int64_t deadline;
+    uint8_t *buffer;
+} j1939_session_t;
+
+static inline uint8_t j1939_priority(uint32_t id)
+{
+    return (id >> 26) & 0x07;
+}
+
+static inline uint8_t j1939_source(uint32_t id)
+{
+    return id & 0xFF;
+}
+
+static inline uint32_t j1939_pgn(uint32_t id)
+{
+    uint32_t pgn = (id >> 8) & 0x3FFFF;
+
+    // PDU1 format (PF < 240) carries the destination in PS, not the PGN
+    if (((pgn >> 8) & 0xFF) < 240) {
+        pgn &= 0x3FF00;
+    }
+    return pgn;
+}
+
+static inline uint8_t j1939_dest(uint32_t id)
+{
+    uint32_t pgn = (id >> 8) & 0x3FFFF;
+    return ((pgn >> 8) & 0xFF) < 240 ? (pgn & 0xFF) : J1939_ADDR_GLOBAL;
+}
+
+static inline uint32_t j1939_id(uint8_t priority, uint32_t pgn, uint8_t dst, uint8_t src)
+{
+    if (((pgn >> 8) & 0xFF) < 240) {
+        pgn = (pgn & 0x3FF00) | dst;
+    }
+    return ((uint32_t)(priority & 0x07) << 26) | (pgn << 8) | src;
+}
+
+static inline const uint8_t *j1939_payload(const j1939_message_t *msg)
+{
+    return msg->buffer ? msg->buffer : msg->data;
+}
+
+class J1939 {
+    public:
+        J1939() : _enabled(false), _address(J1939_ADDR_NULL), _claim_state(J1939_CLAIM_IDLE) { k_mutex_init(&_mutex); };
+        void begin(void);
+        void start(uint8_t address, uint64_t name);
+        void stop(void);
+        bool send(uint32_t pgn, uint8_t priority, uint8_t dst, const uint8_t *data, uint8_t len);
+
+        void receive(const struct zcan_frame *frame);
+        void poll(void);
+
+        bool read(j1939_message_t *msg, k_timeout_t timeout);
+        void release(j1939_message_t *msg);
+
+        uint8_t getAddress(void) { return _address; };
+        j1939_claim_state_t getClaimState(void) { return _claim_state; };
+
+    protected:
+        struct k_mutex _mutex;
+        bool _enabled;
+        uint8_t _address;
+        uint64_t _name;
+        j1939_claim_state_t _claim_state;
+        int64_t _claim_deadline;
+        int _claim_moves;       // addresses tried since start()
+        int64_t _last_poll;
+
+        j1939_session_t _sessions[J1939_TP_SESSION_COUNT];
+
+        void handleRequest(const struct zcan_frame *frame);
+        void handleAddressClaim(const struct zcan_frame *frame);
+        void handleConnection(const struct zcan_frame *frame);
+        void handleData(const struct zcan_frame *frame);
+        void deliver(uint32_t pgn, uint8_t priority, uint8_t src, uint8_t dst, uint16_t len, uint8_t *buffer, const uint8_t *data);
+
+        j1939_session_t *findSession(uint8_t src, uint8_t dst);
+        j1939_session_t *openSession(uint8_t src, uint8_t dst, uint16_t size);
+        void closeSession(j1939_session_t *session, bool free_buffer);
+        void sendConnection(uint8_t dst, const uint8_t *data);
+        void sendClearToSend(j1939_session_t *session);
+        void sendAbort(uint8_t dst, uint32_t pgn, uint8_t reason);
+        void sendAddressClaim(void);
+
+        static uint8_t *allocBuffer(uint16_t size);
+        static void freeBuffer(uint8_t *buffer, uint16_t size);
+};
+
+extern J1939 j1939;
+
+extern "C" {
+#endif
+
+void j1939_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
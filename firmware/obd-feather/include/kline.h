@@ -7,32 +7,233 @@
 #include <kernel.h>
 #include <device.h>
 #include <drivers/uart.h>
+#include <drivers/gpio.h>
 
 #include "modes.h"
 #include "obd2.h"
+#include "klineframer.h"
 
 #define KLINE_TX_THREAD_STACK_SIZE 256
 #define KLINE_TX_THREAD_PRIORITY 2
-#define KLINE_RX_THREAD_STACK_SIZE 256
+#define KLINE_RX_THREAD_STACK_SIZE 512
 #define KLINE_RX_THREAD_PRIORITY 2
 
-#define KLINE_BUFFER_SIZE 16
+// Frames come from a pool of KLINE_FRAME_SIZE buffers, the longest KWP2000
+// message.
+#define KLINE_POOL_COUNT 6
+#define KLINE_TX_QUEUE_SIZE 4
+#define KLINE_RESP_QUEUE_SIZE 2
+
+// RX runs continuously into a chain of DMA buffers, handed back to the
+// driver in turn, and the RX thread rebuilds frames from the byte stream.
+#define KLINE_DMA_BUFFER_SIZE 32
 #define KLINE_BUFFER_COUNT 4
+#define KLINE_RX_TIMEOUT_MS 15      // RX_RDY comes this long after the last byte
+
+// Byte times are worked back from RX_RDY, which can run late off the system
+// work queue.  Enough slack for that and still short of P2min (25ms).
+#define KLINE_GAP_SLACK_US 2000
+
+// The line is half duplex, everything we send comes back.  Each echo byte
+// is matched against what went out, a mismatch means someone else was
+// driving the line too.
+#define KLINE_TX_ATTEMPTS 2
+
+#define KLINE_TESTER_ADDRESS 0xF1
+#define KWP_FUNCTIONAL_ADDRESS 0x33
+
+#define KLINE_ERR_NOT_READY -1
+#define KLINE_ERR_NO_BUFFER -2
+#define KLINE_ERR_LENGTH -3
+#define KLINE_ERR_TIMEOUT -4
+
+// Fast init wakeup pattern, TiniL low then high to the end of TWuP, driven
+// on the TX pin (PC6) with the UART's pinmux set aside for the duration.
+// Taking the pin as a GPIO resets its output type and pull as well as the
+// mode, so those and the alternate function are saved and put back after.
+// The edges are placed by sleeping until just before and spinning on the
+// 1us system clock with interrupts off.
+#define KLINE_TX_PIN 6
+#define KLINE_TINIL_US 25000
+#define KLINE_TWUP_US 50000
+#define KLINE_SPIN_US 100
+
+// The 5-baud address byte goes out the same way, USART6 on PCLK2 can't go
+// anywhere near that slow.
+#define KLINE_5BAUD_ADDRESS 0x33
+#define KLINE_5BAUD_BIT_US 200000
+
+// The 0x55 sync byte after a 5-baud address is timed on the RX pin (PC7)
+// with an edge interrupt, the UART keeps the pin.  Start, data and the start
+// of the stop bit give ten edges nine bits apart.  Each gap has to be within
+// a quarter bit of the average, and a rate this close to a standard one is
+// taken to be that.
+#define KLINE_RX_PIN 7
+#define KLINE_SYNC_EDGES 10
+#define KLINE_SYNC_TIMEOUT_MS 500   // W1 is 300ms at most
+#define KLINE_BAUD_DEFAULT 10400
+#define KLINE_BAUD_MIN 2400            // slowest USART6 on an 84 MHz PCLK2 can do is ~1282
+#define KLINE_BAUD_MAX 20000
+#define KLINE_BAUD_SNAP_PERCENT 3
+
+// Listen-only.  Every byte is timestamped at its start bit, a falling edge
+// on the RX pin at least 9.5 bits after the last one, since data bits can
+// only fall up to 8 bits in.  Frames end on a gap over P1max, or early on a
+// KWP length with a good checksum, and the last byte of each is held back
+// until that is known.
+#define KLINE_SNIFF_STARTS 64
+
+#define KLINE_SNIFF_START 0x01      // first byte of a frame
+#define KLINE_SNIFF_END 0x02        // last byte of a frame
+#define KLINE_SNIFF_CHECKSUM 0x04   // on END, the byte is the sum of the rest
+#define KLINE_SNIFF_ESTIMATED 0x08  // no start bit to go by, timestamp guessed
+#define KLINE_SNIFF_BREAK 0x10      // RX stopped on a break or framing error, byte is 0
+
+// The last rate and key bytes from a 5-baud init, so the next one starts
+// out listening at the rate the ECU used.  One line, "<baud> <kb1> <kb2>",
+// key bytes in hex.
+#define KLINE_CACHE_PATH "/" CONFIG_SDMMC_VOLUME_NAME ":/kline.cache"
+#define KLINE_CACHE_SIZE 32
+
+// Minimum bus idle before a 5-baud or fast init (W5, also Tidle).  The line
+// is watched while the port is up, so a re-init only waits out the rest.
+#define KLINE_W5_MS 300
+
+// The ECU drops the session once it hasn't heard a request for P3max.  A
+// keep-alive goes out only when nothing else has been sent for a while
+// short of that.
+#define KLINE_KEEPALIVE_MARGIN_MS 1000
+#define KLINE_KEEPALIVE_RETRY_MS 50
+
+// Timing sets from ISO 14230-2, picked by the TP bits in key byte 1.  ISO
+// 9141-2 uses the normal set as well.
+#define KLINE_P2MAX_NORMAL_MS 50
+#define KLINE_P3MIN_NORMAL_US 55000
+#define KLINE_P4MIN_NORMAL_US 5000
+#define KLINE_P2MAX_EXTENDED_MS 1000
+#define KLINE_P3MAX_MS 5000
+
+#define KWP_KB2 0x8F
+#define KWP_KB1_AL0 0x01            // length in the format byte
+#define KWP_KB1_AL1 0x02            // separate length byte
+#define KWP_KB1_TP_MASK 0x30
+#define KWP_KB1_TP_EXTENDED 0x10
+
+#define KWP_SID_TESTER_PRESENT 0x3E
+#define KWP_SID_ACCESS_TIMING_PARAMETERS 0x83
+#define KWP_SID_NEGATIVE_RESPONSE 0x7F
+#define KWP_POSITIVE_RESPONSE 0x40
+#define KWP_NO_RESPONSE_REQUIRED 0x02
+#define KWP_NRC_RESPONSE_PENDING 0x78
+
+#define KWP_TPI_READ_LIMITS 0x00
+#define KWP_TPI_SET_VALUES 0x03
+
+// AccessTimingParameters values, as they go over the wire
+typedef struct {
+    uint8_t p2min;          // 0.5 ms
+    uint8_t p2max;          // 25 ms
+    uint8_t p3min;          // 0.5 ms
+    uint8_t p3max;          // 250 ms
+    uint8_t p4min;          // 0.5 ms
+} kwp_timing_t;
+
+#define KLINE_BUF_NOTIFY 0x01      // from OBD2, tell it when the answers are in
+#define KLINE_BUF_KEEPALIVE 0x02   // our own, answers are of no interest
+
+typedef struct {
+    uint16_t length;                // header and payload, not the checksum
+    uint8_t header;                 // bytes before the payload
+    uint8_t flags;
+    uint8_t data[KLINE_FRAME_SIZE];
+} kline_buf_t;
+
+typedef struct {
+    uint32_t otype;
+    uint32_t pull;
+    uint32_t speed;
+    uint32_t af;
+} kline_pin_t;
+
+typedef struct {
+    uint32_t timestamp;     // obd_timestamp() at the start bit
+    uint8_t byte;
+    uint8_t flags;          // KLINE_SNIFF_*
+} kline_sniff_t;
+
+typedef struct {
+    uint32_t timestamp;             // obd_timestamp() at RX_RDY
+    uint32_t end;                   // when the last byte's stop bit ended, worked out from that
+    uint8_t length;
+    uint8_t data[KLINE_DMA_BUFFER_SIZE];
+} kline_chunk_t;
 
 void kline_rx_thread(void *arg1, void *arg2, void *arg3);
 void kline_tx_thread(void *arg1, void *arg2, void *arg3);
 void kline_uart_callback(const struct device *dev, struct uart_event *evt, void *user_data);
+void kline_keepalive_handler(struct k_work *work);
+void kline_cache_handler(struct k_work *work);
+void kline_edge_callback(const struct device *port, struct gpio_callback *cb, gpio_port_pins_t pins);
+void kline_frame_callback(const uint8_t *data, int length, int header, void *user_data);
 
 class KLinePort : public OBDPort {
     public:
-        KLinePort() : OBDPort(), _initialized(false) {};
+        KLinePort() : OBDPort(), _initialized(false), _listening(false), _last_activity(0),
+            _tx_flags(0), _responses(0), _resp_pending(false), _keepalives(0), _reinits(0), _kb1(0), _kb2(0),
+            _rx_stopped(false), _rx_relisten(false), _byte_us(10 * 1000000 / KLINE_BAUD_DEFAULT), _chunk_pos(0),
+            _framer(kline_frame_callback, this), _rx_dropped(0), _echo(NULL), _echo_len(0), _echo_pos(0), _echo_collision(false),
+            _collisions(0), _requesting(false), _baud(KLINE_BAUD_DEFAULT), _sync_edges(KLINE_SYNC_EDGES),
+            _sniffing(false), _sniff_head(0), _sniff_tail(0), _sniff_count(0), _sniff_bytes(0), _sniff_frames(0),
+            _sniff_unmatched(0), _cache_baud(0), _cache_kb1(0), _cache_kb2(0) {
+            k_mutex_init(&_request_mutex);
+            defaultTiming();
+            _chunk.length = 0;
+        };
         void begin(void);
         void setMode(operation_mode_t mode);
         bool send(obd_packet_t *packet);
 
+        // One request of up to KLINE_MAX_PAYLOAD bytes, header picked to
+        // suit the length and the key bytes.  The answer goes to the caller
+        // instead of OBD2.  Returns its payload length or KLINE_ERR_*.
+        int request(uint8_t target, const uint8_t *req, int len, uint8_t *resp, int size);
+
+        // Each keep-alive sent is a session that would otherwise have timed
+        // out and needed a full init.
+        uint32_t getKeepalives(void) { return _keepalives; };
+        uint32_t getReinits(void) { return _reinits; };
+
+        uint8_t getKeyByte1(void) { return _kb1; };
+        uint8_t getKeyByte2(void) { return _kb2; };
+        uint32_t getP2Max(void) { return _p2max_ms; };
+        uint32_t getP3Min(void) { return _p3min_us; };
+        uint32_t getP3Max(void) { return _p3max_ms; };
+        bool isInitialized(void) { return _initialized; };
+        uint32_t getBaud(void) { return _baud; };
+
+        uint32_t getRxFrames(void) { return _framer.getFrames(); };
+        uint32_t getRxErrors(void) { return _framer.getErrors(); };    // bad checksum, short or overlong
+        uint32_t getRxDropped(void) { return _rx_dropped; };   // chunks lost to a full queue
+        uint32_t getCollisions(void) { return _collisions; };
+
+        // Listen-only at the given rate, with no init and nothing sent.
+        // Bytes go to the capture file and the SLCAN port, where either is
+        // taking them.  Not while a session is up, and taking the port for
+        // one ends it.
+        bool startSniffing(uint32_t baud);
+        void stopSniffing(void);
+        bool isSniffing(void) { return _sniffing; };
+        uint32_t getSniffBytes(void) { return _sniff_bytes; };
+        uint32_t getSniffFrames(void) { return _sniff_frames; };
+        uint32_t getSniffUnmatched(void) { return _sniff_unmatched; };   // no start bit seen
+
         friend void kline_rx_thread(void *arg1, void *arg2, void *arg3);
         friend void kline_tx_thread(void *arg1, void *arg2, void *arg3);
         friend void kline_uart_callback(const struct device *dev, struct uart_event *evt, void *user_data);
+        friend void kline_keepalive_handler(struct k_work *work);
+        friend void kline_cache_handler(struct k_work *work);
+        friend void kline_edge_callback(const struct device *port, struct gpio_callback *cb, gpio_port_pins_t pins);
+        friend void kline_frame_callback(const uint8_t *data, int length, int header, void *user_data);
 
     protected:
         const struct device *_dev;
@@ -44,12 +245,84 @@ class KLinePort : public OBDPort {
     	k_tid_t _tx_tid;
 
         bool _initialized;
+        volatile bool _listening;
+        volatile uint32_t _last_activity;   // obd_timestamp() of the last byte seen or sent
         struct k_sem _tx_done_sem;
         int _tx_sent;
 
-        uint8_t _rx_buffers[KLINE_BUFFER_COUNT][KLINE_BUFFER_SIZE];
+        struct k_work_delayable _keepalive_work;
+        volatile uint8_t _tx_flags;         // of the request whose answers are coming in
+        int _responses;
+        volatile bool _resp_pending;        // the last answer was a response pending, more to come
+        uint32_t _keepalives;
+        uint32_t _reinits;
+
+        uint8_t _kb1;
+        uint8_t _kb2;
+        uint32_t _p2max_ms;
+        uint32_t _p3min_us;
+        uint32_t _p3max_ms;
+        uint32_t _p4min_us;
+        kwp_timing_t _timing_request;     // last SET_VALUES sent, applied once confirmed
+        struct k_sem _resp_sem;
+
+        uint8_t _rx_buffers[KLINE_BUFFER_COUNT][KLINE_DMA_BUFFER_SIZE];
         int _rx_index;
-        struct k_sem _rx_rdy_sem;
+        volatile bool _rx_stopped;
+        volatile bool _rx_relisten;     // stopped during waitIdle(), turn it back on
+        uint32_t _byte_us;              // at the rate the UART is set to
+
+        // Bytes handed out one by one during init
+        kline_chunk_t _chunk;
+        int _chunk_pos;
+
+        KLineFramer _framer;
+        uint32_t _rx_dropped;           // chunks or frames with nowhere to go
+
+        // Frame in flight, until its echo is back
+        kline_buf_t *_echo;
+        volatile int _echo_len;         // 0 when nothing is expected
+        volatile int _echo_pos;
+        volatile bool _echo_collision;
+        uint32_t _echo_start;
+        struct k_sem _echo_sem;
+        uint32_t _collisions;
+
+        struct k_mutex _request_mutex;
+        volatile bool _requesting;
+
+        // Rate the session runs at, measured from the sync byte on 5-baud
+        uint32_t _baud;
+        const struct device *_rx_port;
+        struct gpio_callback _edge_cb;
+        struct k_sem _sync_sem;
+        uint32_t _sync_times[KLINE_SYNC_EDGES];
+        volatile int _sync_edges;       // KLINE_SYNC_EDGES when not armed
+
+        // Sniffer.  Start bit times from the edge interrupt, taken in order
+        // by the RX thread, one per byte.
+        volatile bool _sniffing;
+        uint32_t _sniff_starts[KLINE_SNIFF_STARTS];
+        volatile int _sniff_head;
+        volatile int _sniff_tail;
+        uint32_t _sniff_last_start;
+        uint32_t _sniff_min_start_us;
+        uint32_t _sniff_byte_us;
+        kline_sniff_t _sniff_held;      // last byte in, until the frame is known to go on
+        int _sniff_count;               // bytes in the frame so far, 0 between frames
+        int _sniff_header;              // KWP header length, 0 if it has none
+        int _sniff_expected;            // from a KWP header, 0 until known
+        uint8_t _sniff_sum;             // of the frame before the held byte
+        uint32_t _sniff_bytes;
+        uint32_t _sniff_frames;
+        uint32_t _sniff_unmatched;
+
+        struct k_work _cache_work;
+        uint32_t _cache_baud;           // as on the card, 0 if nothing there
+        uint8_t _cache_kb1;
+        uint8_t _cache_kb2;
+
+        kline_pin_t _tx_pin;            // UART pin setup while it's driven by hand
 
         void rx_thread(void);
         void tx_thread(void);
@@ -63,12 +336,47 @@ class KLinePort : public OBDPort {
 
         bool configure(uint32_t baud);
         void init(void);
-        void init_5baud(void);
-        void init_fast(void);
+        void waitIdle(void);
+        void waitQuiet(uint32_t quiet_us);
+        void defaultTiming(void);
+        bool requestTiming(uint8_t tpi, const kwp_timing_t *timing);
+        bool timingResponse(uint8_t *data, int length);
+        uint32_t keepaliveDelay(void);
+        bool init_5baud(void);
+        bool init_fast(void);
+        bool armSync(void);
+        uint32_t measureSync(void);
+        void edge_callback(void);
+        void loadCache(void);
+        void saveCache(void);
+        bool wakeup(void);
+        bool sendAddress(uint8_t address);
+        const struct device *takeTxPin(void);
+        void returnTxPin(void);
+        void edgeAt(const struct device *port, uint32_t target, int value);
+        bool readBytes(uint8_t *buf, int count, k_timeout_t timeout);
+        void flushRx(void);
+
+        void sniff(void);
+        void sniffByte(uint8_t byte, uint32_t timestamp, uint8_t flags);
+        void sniffBreak(void);
+        void sniffEnd(void);
+        void sniffOut(const kline_sniff_t *sniffed);
+
+        bool cancelEcho(uint8_t byte, uint32_t timestamp);
+        void resetFrame(void);
+        uint32_t frameWait(void);
+        void rxFrame(const uint8_t *data, int length, int header);
+        void processFrame(kline_buf_t *buffer);
+
+        bool build(kline_buf_t *buffer, uint8_t target, const uint8_t *payload, int len);
+        void release(kline_buf_t *buffer);
+        bool queue(obd_packet_t *packet, k_timeout_t timeout, uint8_t flags);
+        void keepalive(void);
 
         void enable(void);
         void disable(void);
-        uint8_t checksum(uint8_t *buffer, uint8_t len);
+        uint8_t checksum(uint8_t *buffer, int len);
 };
 
 extern KLinePort kline;
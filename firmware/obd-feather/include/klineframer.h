@@ -0,0 +1,75 @@
+#ifndef __KLINEFRAMER_H_
+#define __KLINEFRAMER_H_
+
+#ifdef __cplusplus
+
+#include <stdint.h>
+
+// Big enough for the longest KWP2000 message: format, target, source and
+// length bytes, 255 bytes of payload and the checksum.
+#define KLINE_MAX_HEADER 4
+#define KLINE_MAX_PAYLOAD 255
+#define KLINE_FRAME_SIZE (KLINE_MAX_HEADER + KLINE_MAX_PAYLOAD + 1)
+
+#define KLINE_P1MAX_MS 20           // longest gap between bytes of one frame
+
+// KWP2000 format byte
+#define KWP_FMT_ADDRESS_MASK 0xC0
+#define KWP_FMT_PHYSICAL 0x80
+#define KWP_FMT_FUNCTIONAL 0xC0
+#define KWP_FMT_CARB 0x40           // ISO 9141 style header, no length
+#define KWP_FMT_LENGTH_MASK 0x3F
+
+// Whole frames, checksum checked and dropped.  header is how many of the
+// length bytes come before the payload.
+typedef void (*kline_frame_cb_t)(const uint8_t *data, int length, int header, void *user_data);
+
+// Rebuilds frames from the received byte stream.  Nothing in here knows
+// about Zephyr, so it builds and is tested on the host.  Each byte comes
+// with the time (us) its stop bit ended; a gap is that less the byte time
+// of the next one.
+class KLineFramer {
+    public:
+        KLineFramer(kline_frame_cb_t callback, void *user_data) : _callback(callback),
+            _user_data(user_data), _headerless(false), _byte_us(0), _gap_us(KLINE_P1MAX_MS * 1000),
+            _last(0), _frames(0), _errors(0) {
+            reset();
+        };
+
+        // ISO 9141 frames carry no length, and only end on a gap
+        void setHeaderless(bool headerless) { _headerless = headerless; };
+        void setTiming(uint32_t byte_us, uint32_t gap_us);
+
+        void feed(uint8_t byte, uint32_t end);
+        void close(void);       // the gap is known to be over
+        void skip(void);        // drop the rest, up to the next gap
+        void reset(void);
+
+        bool isOpen(void) { return _pos || _skip; };
+        uint32_t getLast(void) { return _last; };
+
+        uint32_t getFrames(void) { return _frames; };
+        uint32_t getErrors(void) { return _errors; };  // bad checksum, short or overlong
+
+    protected:
+        kline_frame_cb_t _callback;
+        void *_user_data;
+        bool _headerless;
+        uint32_t _byte_us;
+        uint32_t _gap_us;
+
+        uint8_t _data[KLINE_FRAME_SIZE];
+        int _pos;
+        int _header;
+        int _expected;          // bytes including the checksum, 0 until known
+        uint8_t _sum;
+        bool _skip;             // overlong or garbled, drop bytes until the next gap
+        uint32_t _last;
+
+        uint32_t _frames;
+        uint32_t _errors;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef __MCP2515_H_
+#define __MCP2515_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <drivers/gpio.h>
+
+void mcp2515_init(void);
+void mcp2515_int_callback(const struct device *port, struct gpio_callback *cb, gpio_port_pins_t pins);
+
+#ifdef __cplusplus
+}
+
+#include <drivers/spi.h>
+#include <drivers/can.h>
+
+#include "modes.h"
+#include "obd2.h"
+
+#define MCP2515_TX_THREAD_STACK_SIZE 512
+#define MCP2515_TX_THREAD_PRIORITY 2
+#define MCP2515_RX_THREAD_STACK_SIZE 1024
+#define MCP2515_RX_THREAD_PRIORITY 1
+
+#define MCP2515_OSC_FREQ CONFIG_OBD_MCP2515_OSC_FREQ
+#define MCP2515_SPI_FREQ 8000000
+
+// Bit timing, TQ per bit from the most down to the least that still
+// divides the crystal evenly
+#define MCP2515_MAX_TQ 16
+#define MCP2515_MIN_TQ 8
+
+// SPI instructions
+#define MCP2515_RESET 0xC0
+#define MCP2515_READ 0x03
+#define MCP2515_READ_RX0 0x90
+#define MCP2515_READ_RX1 0x94
+#define MCP2515_WRITE 0x02
+#define MCP2515_LOAD_TX0 0x40
+#define MCP2515_RTS_TX0 0x81
+#define MCP2515_READ_STATUS 0xA0
+#define MCP2515_BIT_MODIFY 0x05
+
+// Registers
+#define MCP2515_CANSTAT 0x0E
+#define MCP2515_CANCTRL 0x0F
+#define MCP2515_CNF3 0x28
+#define MCP2515_CNF2 0x29
+#define MCP2515_CNF1 0x2A
+#define MCP2515_CANINTE 0x2B
+#define MCP2515_CANINTF 0x2C
+#define MCP2515_EFLG 0x2D
+#define MCP2515_TXB0CTRL 0x30
+#define MCP2515_RXB0CTRL 0x60
+#define MCP2515_RXB0SIDH 0x61
+#define MCP2515_RXB1CTRL 0x70
+
+#define MCP2515_MODE_NORMAL 0x00
+#define MCP2515_MODE_SLEEP 0x20
+#define MCP2515_MODE_LISTEN 0x60
+#define MCP2515_MODE_CONFIG 0x80
+#define MCP2515_MODE_MASK 0xE0
+
+#define MCP2515_INT_RX0 0x01
+#define MCP2515_INT_RX1 0x02
+#define MCP2515_INT_ERR 0x20
+
+#define MCP2515_STATUS_RX0 0x01
+#define MCP2515_STATUS_RX1 0x02
+#define MCP2515_STATUS_TX0REQ 0x04
+
+// SIDH..D7 of one receive buffer
+#define MCP2515_RXB_SIZE 13
+// RXB0SIDH through the end of RXB1 (includes CANSTAT, CANCTRL and RXB1CTRL)
+#define MCP2515_RXB_BURST_SIZE (MCP2515_RXB1CTRL + 1 + MCP2515_RXB_SIZE - MCP2515_RXB0SIDH)
+
+void mcp2515_rx_thread(void *arg1, void *arg2, void *arg3);
+void mcp2515_tx_thread(void *arg1, void *arg2, void *arg3);
+
+class MCP2515Port : public OBDPort {
+    public:
+        MCP2515Port() : OBDPort(), _initialized(false) {};
+        void begin(void);
+        void setMode(operation_mode_t mode);
+        bool send(obd_packet_t *packet);
+        bool sendFrame(const struct zcan_frame *frame, k_timeout_t timeout = K_FOREVER);
+        operation_mode_t getMode(void) { return _mode; };
+        bool isReady(void) { return _initialized; };
+
+        friend void mcp2515_rx_thread(void *arg1, void *arg2, void *arg3);
+        friend void mcp2515_tx_thread(void *arg1, void *arg2, void *arg3);
+        friend void mcp2515_int_callback(const struct device *port, struct gpio_callback *cb, gpio_port_pins_t pins);
+
+    protected:
+        const struct device *_dev;
+        struct spi_config _spi_cfg;
+        struct k_mutex _spi_mutex;
+
+        struct k_thread _rx_thread_data;
+        struct k_thread _tx_thread_data;
+
+    	k_tid_t _rx_tid;
+    	k_tid_t _tx_tid;
+
+        bool _initialized;
+        struct k_sem _int_sem;
+        volatile uint32_t _int_timestamp;
+
+        void rx_thread(void);
+        void tx_thread(void);
+        void int_callback(void);
+
+        int transfer(const uint8_t *tx, uint8_t *rx, size_t len);
+        int reset(void);
+        int readRegisters(uint8_t addr, uint8_t *data, size_t len);
+        int writeRegisters(uint8_t addr, const uint8_t *data, size_t len);
+        int modifyRegister(uint8_t addr, uint8_t mask, uint8_t value);
+        int readStatus(uint8_t *status);
+        bool setOpMode(uint8_t mode);
+        bool setBitrate(uint32_t bitrate);
+        void drain(uint32_t timestamp);
+
+        static void decode(const uint8_t *regs, struct zcan_frame *frame);
+        static void encode(const struct zcan_frame *frame, uint8_t *regs);
+};
+
+extern MCP2515Port mcp2515;
+
+#endif
+
+#endif
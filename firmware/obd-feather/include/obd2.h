@@ -16,6 +16,16 @@ extern "C" {
 #define OBD2_RX_THREAD_STACK_SIZE 256
 #define OBD2_RX_THREAD_PRIORITY 2
 
+#define OBD_PACKET_EXT 0x01     // 29 bit CAN identifier
+#define OBD_PACKET_RTR 0x02     // CAN remote frame, no data
+#define OBD_PACKET_DONE 0x04    // no data, every answer to the last request is in and count says how many
+
+// The eight bytes from count through unused are the raw payload, of which
+// the first dlc are valid.  A CAN data frame sent with dlc 0 is a request:
+// count is its single frame PCI, and it goes out as 8 bytes with the rest
+// padded, as ISO 15765-4 requires.
+#define OBD_CAN_DLC 8
+#define OBD_CAN_PADDING 0x00
 typedef struct {
     operation_mode_t mode;
     uint32_t id;
@@ -27,8 +37,18 @@ typedef struct {
     uint8_t c;
     uint8_t d;
     uint8_t unused;
+    uint8_t dlc;
+    uint8_t flags;
+    uint32_t timestamp;
 } obd_packet_t;
 
+// Microseconds since boot (the system tick is 1us), shared by every port so
+// packets from different buses can be lined up against each other.
+static inline uint32_t obd_timestamp(void)
+{
+    return (uint32_t)k_ticks_to_us_floor64(k_uptime_ticks());
+}
+
 class OBDPort {
     public:
         OBDPort() : _mode(MODE_IDLE) {};
@@ -44,12 +64,21 @@ void obd2_tx_thread(void *arg1, void *arg2, void *arg3);
 
 class OBD2 {
     public:
-        OBD2() : _port(0), _mode(MODE_IDLE) { k_mutex_init(&_mutex); };
+        OBD2() : _port(0), _mode(MODE_IDLE), _responses(0) {
+            k_mutex_init(&_mutex);
+            k_sem_init(&_complete_sem, 0, 1);
+        };
         void begin(void);
         void setMode(operation_mode_t mode);
         operation_mode_t getMode(void);
         bool send(obd_packet_t *packet); 
         bool receive(obd_packet_t *packet);
+
+        // Ports that can tell when the answers to a request have stopped
+        // (several ECUs may answer one functional request) report it here,
+        // so waiting on a request ends as soon as it's really over.
+        void complete(int responses);
+        int waitComplete(k_timeout_t timeout);
         operation_mode_t scan(int delay_ms);
 
         friend void obd2_rx_thread(void *arg1, void *arg2, void *arg3);
@@ -59,6 +88,8 @@ class OBD2 {
         OBDPort *_port;
         operation_mode_t _mode;
         struct k_mutex _mutex;
+        struct k_sem _complete_sem;
+        int _responses;
 
         struct k_thread _rx_thread_data;
         struct k_thread _tx_thread_data;
@@ -0,0 +1,120 @@
+#ifndef __SLCAN_H_
+#define __SLCAN_H_
+
+#ifdef __cplusplus
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <device.h>
+#include <drivers/can.h>
+#include <drivers/uart.h>
+
+#include "modes.h"
+
+#define SLCAN_THREAD_STACK_SIZE 1024
+#define SLCAN_THREAD_PRIORITY 2
+
+// Host -> device bytes waiting to be parsed, and encoded frames waiting for
+// the USB endpoint.  The TX side is sized for a few ms of a saturated 500k
+// bus in ASCII mode so a late host poll doesn't drop frames.
+#define SLCAN_RX_BUFFER_SIZE 1024
+#define SLCAN_TX_BUFFER_SIZE 4096
+
+// "T" + 8 id + dlc + 16 data + 4 timestamp + CR
+#define SLCAN_LINE_SIZE 32
+
+// Extension, one line per sniffed K-line byte: "k" + 2 flags + 2 data + 8
+// timestamp in us + CR
+#define SLCAN_KLINE_TYPE 'k'
+
+#define SLCAN_BELL '\a'
+#define SLCAN_CR '\r'
+
+// Binary mode record, both directions:
+//   sync, flags (EXT | RTR | dlc), id (LE32), timestamp in us (LE32), data
+// Frames off (or for) the MCP2515 carry the channel flag.  ASCII lines have
+// nowhere to say which bus they're from, so they only carry can1.
+#define SLCAN_BINARY_SYNC 0xAA
+#define SLCAN_BINARY_FLAG_EXT 0x80
+#define SLCAN_BINARY_FLAG_RTR 0x40
+#define SLCAN_BINARY_FLAG_KLINE 0x20  // device -> host only, id is the sniff flags
+#define SLCAN_BINARY_FLAG_CHANNEL 0x10
+#define SLCAN_BINARY_DLC_MASK 0x0F
+#define SLCAN_BINARY_HEADER_SIZE 10
+
+void slcan_thread(void *arg1, void *arg2, void *arg3);
+void slcan_uart_isr(const struct device *dev, void *user_data);
+
+class SLCAN {
+    public:
+        SLCAN() : _open(false), _listen_only(false), _binary(false),
+                  _timestamps(false), _kline(false), _mode(MODE_IDLE), _rx_dropped(0),
+                  _line_len(0), _overflow(false), _record_len(0), _overruns(0),
+                  _rx_lost(0) {};
+        void begin(void);
+        void forward(const struct zcan_frame *frame, uint32_t timestamp, uint8_t channel);
+        void forwardKLine(uint8_t byte, uint8_t flags, uint32_t timestamp);
+
+        uint32_t getOverruns(void) { return _overruns; };
+
+        friend void slcan_thread(void *arg1, void *arg2, void *arg3);
+        friend void slcan_uart_isr(const struct device *dev, void *user_data);
+
+    protected:
+        const struct device *_dev;
+
+        struct k_thread _thread_data;
+        k_tid_t _tid;
+
+        struct k_sem _rx_sem;
+        struct k_spinlock _tx_lock;
+
+        bool _open;
+        bool _listen_only;
+        bool _binary;
+        bool _timestamps;
+        volatile bool _kline;       // K-line sniffer running for us
+        operation_mode_t _mode;
+
+        atomic_t _rx_dropped;       // bytes discarded on a full RX ring
+        volatile uint32_t _rx_timestamp;
+
+        uint8_t _line[SLCAN_LINE_SIZE];
+        uint8_t _line_len;
+        bool _overflow;
+        uint8_t _record_len;
+        uint32_t _overruns;
+        uint32_t _rx_lost;
+
+        void thread(void);
+        void uart_isr(void);
+
+        void process(uint8_t c);
+        void command(const uint8_t *line, int len);
+        bool transmit(const struct zcan_frame *frame, uint8_t channel);
+        bool parseFrame(const uint8_t *line, int len, bool ext, bool rtr, struct zcan_frame *frame);
+        bool parseRecord(const uint8_t *record, struct zcan_frame *frame, uint8_t *channel);
+        bool setBitrate(uint8_t code);
+        void open(bool listen_only);
+        void close(void);
+
+        bool write(const uint8_t *data, int len);
+        void reply(const char *str);
+
+        int encodeASCII(const struct zcan_frame *frame, uint32_t timestamp, uint8_t *buf);
+        static int encodeBinary(const struct zcan_frame *frame, uint32_t timestamp, uint8_t channel, uint8_t *buf);
+        static int encodeKLine(uint8_t byte, uint8_t flags, uint32_t timestamp, bool binary, uint8_t *buf);
+};
+
+extern SLCAN slcan;
+
+extern "C" {
+#endif
+
+void slcan_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
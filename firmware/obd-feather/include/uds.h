@@ -0,0 +1,192 @@
+#ifndef __UDS_H_
+#define __UDS_H_
+
+#ifdef __cplusplus
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <device.h>
+#include <drivers/can.h>
+#include <canbus/isotp.h>
+#include <string.h>
+
+#define UDS_BUFFER_SIZE 512
+#define UDS_DEFAULT_TX_ID 0x7E0
+#define UDS_DEFAULT_RX_ID 0x7E8
+
+// ISO 14229-2 defaults until DiagnosticSessionControl tells us otherwise, ms
+#define UDS_P2_DEFAULT 50
+#define UDS_P2_STAR_DEFAULT 5000
+#define UDS_P2_MARGIN 50            // our side of the transport on top of P2
+#define UDS_TESTER_PRESENT_INTERVAL 2000
+#define UDS_BUSY_RETRIES 3
+
+// Starting guess for how many DIDs an ECU takes in one 0x22 request.  Halved
+// whenever the ECU rejects a batch for length.
+#define UDS_MAX_DIDS_PER_REQUEST 8
+
+#define UDS_SID_DIAGNOSTIC_SESSION_CONTROL 0x10
+#define UDS_SID_READ_DATA_BY_IDENTIFIER 0x22
+#define UDS_SID_READ_DATA_BY_PERIODIC_IDENTIFIER 0x2A
+#define UDS_SID_DYNAMICALLY_DEFINE_DATA_IDENTIFIER 0x2C
+#define UDS_SID_TESTER_PRESENT 0x3E
+#define UDS_SID_NEGATIVE_RESPONSE 0x7F
+#define UDS_POSITIVE_RESPONSE 0x40
+#define UDS_SUPPRESS_POSITIVE_RESPONSE 0x80
+
+#define UDS_SESSION_DEFAULT 0x01
+#define UDS_SESSION_PROGRAMMING 0x02
+#define UDS_SESSION_EXTENDED 0x03
+
+// Periodic identifiers are the low byte of DIDs 0xF200-0xF2FF
+#define UDS_PERIODIC_DID_BASE 0xF200
+#define UDS_PERIODIC_MAX 8
+#define UDS_DYN_MAX_ELEMENTS 8
+#define UDS_PERIODIC_UNUSED 0xFF
+
+// Periodic single frames on the response ID only ever reach ISO-TP, they're
+// fetched from there this often between requests
+#define UDS_PERIODIC_POLL_MS 10
+
+#define UDS_DDDI_DEFINE_BY_IDENTIFIER 0x01
+#define UDS_DDDI_CLEAR 0x03
+
+#define UDS_RATE_SLOW 0x01
+#define UDS_RATE_MEDIUM 0x02
+#define UDS_RATE_FAST 0x03
+#define UDS_RATE_STOP 0x04
+
+#define UDS_NRC_BUSY_REPEAT_REQUEST 0x21
+#define UDS_NRC_INCORRECT_LENGTH 0x13
+#define UDS_NRC_RESPONSE_TOO_LONG 0x14
+#define UDS_NRC_REQUEST_OUT_OF_RANGE 0x31
+#define UDS_NRC_RESPONSE_PENDING 0x78
+
+#define UDS_ERR_NOT_OPEN -1
+#define UDS_ERR_SEND -2
+#define UDS_ERR_TIMEOUT -3
+#define UDS_ERR_NEGATIVE -4         // see getLastNRC()
+#define UDS_ERR_INVALID -5
+
+// Shell reads, one row per DID
+#define UDS_SHELL_MAX_DIDS 8
+#define UDS_SHELL_MAX_DID_LENGTH 32
+
+typedef struct {
+    uint16_t did;
+    uint8_t length;         // data bytes the ECU returns for this DID
+    uint16_t value_index;   // valuestore slot (big endian unsigned), or VALUESTORE_INVALID
+    uint8_t *data;          // optional copy of the raw bytes, NULL to skip
+    bool read;              // set once the ECU has answered for it
+} uds_did_t;
+
+// One piece of a dynamically defined DID: size bytes starting at position
+// (1-based) of the source DID's record.
+typedef struct {
+    uint16_t source_did;
+    uint8_t position;
+    uint8_t size;
+    uint16_t value_index;   // valuestore slot (big endian unsigned), or VALUESTORE_INVALID
+} uds_dyn_element_t;
+
+typedef struct {
+    uint8_t pdid;
+    uint8_t count;          // 0 while the slot is unused or being rewritten
+    uds_dyn_element_t elements[UDS_DYN_MAX_ELEMENTS];
+} uds_periodic_t;
+
+// How the ECU frames periodic data: single frames echoing the response SID
+// (PCI, 0x6A, pDID, data) or bare UUDT frames (pDID, data).  UUDT can't
+// share the response ID, ISO-TP would throw it away.
+typedef enum {
+    UDS_PERIODIC_SINGLE_FRAME = 0,
+    UDS_PERIODIC_UUDT,
+} uds_periodic_format_t;
+
+void uds_tester_present_handler(struct k_work *work);
+void uds_periodic_poll_handler(struct k_work *work);
+
+class UDSClient {
+    public:
+        UDSClient() : _open(false), _max_dids(UDS_MAX_DIDS_PER_REQUEST), _periodic_format(UDS_PERIODIC_SINGLE_FRAME), _periodic_isotp(false) {
+            k_mutex_init(&_mutex);
+            memset(_periodic_map, UDS_PERIODIC_UNUSED, sizeof(_periodic_map));
+            memset(_periodic, 0, sizeof(_periodic));
+        };
+        void begin(void);
+        bool open(uint32_t tx_id = UDS_DEFAULT_TX_ID, uint32_t rx_id = UDS_DEFAULT_RX_ID, bool ext = false);
+        void close(void);
+
+        int request(const uint8_t *req, size_t len, uint8_t *resp, size_t size);
+        bool startSession(uint8_t session);
+        int readDataByIdentifier(uds_did_t *dids, int count);
+
+        bool defineDynamic(uint8_t pdid, const uds_dyn_element_t *elements, int count);
+        bool clearDynamic(uint8_t pdid);
+        int readDynamic(uint8_t pdid);
+        bool startPeriodic(const uint8_t *pdids, int count, uint8_t rate);
+        bool stopPeriodic(const uint8_t *pdids, int count);
+        bool routePeriodic(uint32_t id, bool ext, uds_periodic_format_t format);
+        void unroutePeriodic(void);
+        void periodic(const struct zcan_frame *frame, uint32_t timestamp);
+        bool getDynamic(uint8_t pdid, uds_periodic_t *entry);
+
+        void setMaxDIDs(uint8_t max_dids) { _max_dids = max_dids ? max_dids : 1; };
+        uint8_t getMaxDIDs(void) { return _max_dids; };
+        uint8_t getLastNRC(void) { return _last_nrc; };
+        uint8_t getSession(void) { return _session; };
+        bool isOpen(void) { return _open; };
+        uint16_t getP2(void) { return _p2; };
+        uint16_t getP2Star(void) { return _p2_star; };
+
+        friend void uds_tester_present_handler(struct k_work *work);
+        friend void uds_periodic_poll_handler(struct k_work *work);
+
+    protected:
+        const struct device *_dev;
+        struct k_mutex _mutex;
+        struct k_spinlock _periodic_lock;   // map and entries, against the RX thread
+        struct k_work_delayable _tester_present_work;
+        struct k_work_delayable _periodic_work;
+
+        struct isotp_recv_ctx _recv_ctx;
+        struct isotp_send_ctx _send_ctx;
+        struct isotp_msg_id _tx_addr;
+        struct isotp_msg_id _rx_addr;
+
+        bool _open;
+        uint8_t _session;
+        uint8_t _last_nrc;
+        uint8_t _max_dids;
+        uint16_t _p2;
+        uint16_t _p2_star;
+
+        uds_periodic_format_t _periodic_format;
+        volatile bool _periodic_isotp;  // periodic data comes in on the response ID
+        uds_periodic_t _periodic[UDS_PERIODIC_MAX];
+        uint8_t _periodic_map[256];     // pDID to _periodic slot
+
+        uint8_t _request[UDS_BUFFER_SIZE];
+        uint8_t _response[UDS_BUFFER_SIZE];
+
+        int transfer(const uint8_t *req, size_t len, uint8_t *resp, size_t size);
+        int readBatch(uds_did_t *dids, int count);
+        void testerPresent(void);
+        void pollPeriodic(void);
+        bool periodicMessage(const uint8_t *data, int len, uint32_t timestamp);
+        void deliver(uint8_t pdid, const uint8_t *data, int len, uint32_t timestamp);
+        void unpack(const uds_periodic_t *entry, const uint8_t *data, int len, uint32_t timestamp);
+};
+
+extern UDSClient uds;
+
+extern "C" {
+#endif
+
+void uds_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
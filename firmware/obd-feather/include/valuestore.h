@@ -0,0 +1,48 @@
+#ifndef __VALUESTORE_H_
+#define __VALUESTORE_H_
+
+#ifdef __cplusplus
+
+#include <zephyr.h>
+#include <kernel.h>
+
+#define VALUESTORE_SIZE 256
+#define VALUESTORE_NAME_POOL_SIZE 6144
+#define VALUESTORE_NAME_MAX 96
+#define VALUESTORE_INVALID 0xFFFF
+
+// Latest value of one named signal, named "group.signal" (DBC message or
+// XCP) so the same signal name from two sources gets two slots.  Values are decimal fixed point,
+// physical = value / 10^decimals, so DBC factors like 0.1 are exact.
+typedef struct {
+    const char *name;       // in the store's name pool
+    int64_t value;
+    uint32_t timestamp;     // obd_timestamp() of the last update, 0 if never
+    uint8_t decimals;
+} value_t;
+
+class ValueStore {
+    public:
+        ValueStore() : _count(0), _pool_used(0) { k_mutex_init(&_mutex); };
+        uint16_t allocate(const char *name, uint8_t decimals);
+        uint16_t allocate(const char *group, const char *name, uint8_t decimals);
+        uint16_t find(const char *name);
+        uint16_t getCount(void) { return _count; };
+
+        void set(uint16_t index, int64_t value, uint32_t timestamp);
+        bool get(uint16_t index, value_t *value);
+
+    protected:
+        struct k_mutex _mutex;      // allocation
+        struct k_spinlock _lock;    // values
+        uint16_t _count;
+        uint16_t _pool_used;
+        value_t _values[VALUESTORE_SIZE];
+        char _pool[VALUESTORE_NAME_POOL_SIZE];
+};
+
+extern ValueStore valuestore;
+
+#endif
+
+#endif
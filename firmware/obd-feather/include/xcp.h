@@ -0,0 +1,158 @@
+#ifndef __XCP_H_
+#define __XCP_H_
+
+#ifdef __cplusplus
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <drivers/can.h>
+
+#include "cantraffic.h"
+
+// DAQ table on the card, made from the ECU's A2L.  One item per line, IDs
+// and addresses in hex:
+//   can <master id> <slave id> [x]         x for 29 bit identifiers
+//   daq <list> <event channel> <prescaler>
+//   entry <list> <odt> <address extension> <address> <size> <u|s> <name>
+// Lists, and ODTs within a list, are numbered from 0 and given in order.
+// On the slave they follow its predefined lists, from MIN_DAQ up.
+#define XCP_FILE_PATH "/" CONFIG_SDMMC_VOLUME_NAME ":/xcp.cfg"
+#define XCP_LINE_SIZE 128
+#define XCP_READ_SIZE 256
+
+#define XCP_MAX_DAQ 8
+#define XCP_MAX_ODT 32
+#define XCP_MAX_ENTRIES 128
+
+// XCP on CAN: CTOs and DTOs are single frames, PID first
+#define XCP_MAX_CTO 8
+#define XCP_MAX_DTO 8
+#define XCP_TIMEOUT_MS 50           // T1, plus some slack for the TX queue
+
+#define XCP_PID_RES 0xFF
+#define XCP_PID_ERR 0xFE
+#define XCP_PID_EV 0xFD
+#define XCP_PID_SERV 0xFC
+#define XCP_PID_UNUSED 0xFF
+
+#define XCP_CMD_CONNECT 0xFF
+#define XCP_CMD_DISCONNECT 0xFE
+#define XCP_CMD_WRITE_DAQ 0xE1
+#define XCP_CMD_SET_DAQ_PTR 0xE2
+#define XCP_CMD_SET_DAQ_LIST_MODE 0xE0
+#define XCP_CMD_START_STOP_DAQ_LIST 0xDE
+#define XCP_CMD_START_STOP_SYNCH 0xDD
+#define XCP_CMD_GET_DAQ_PROCESSOR_INFO 0xDA
+#define XCP_CMD_FREE_DAQ 0xD6
+#define XCP_CMD_ALLOC_DAQ 0xD5
+#define XCP_CMD_ALLOC_ODT 0xD4
+#define XCP_CMD_ALLOC_ODT_ENTRY 0xD3
+
+#define XCP_COMM_MODE_MOTOROLA 0x01
+#define XCP_DAQ_CONFIG_DYNAMIC 0x01
+#define XCP_DAQ_LIST_SELECT 0x02
+
+// DAQ_KEY_BYTE identification field type, how DTOs say which ODT they carry
+#define XCP_DAQ_KEY_ID_FIELD_MASK 0xC0
+#define XCP_DAQ_KEY_ID_ABSOLUTE 0x00    // PID alone, the only one _pid_map handles
+#define XCP_SYNCH_STOP_ALL 0x00
+#define XCP_SYNCH_START_SELECTED 0x01
+
+#define XCP_ENTRY_SIGNED 0x01
+
+#define XCP_ERR_NOT_CONNECTED -1
+#define XCP_ERR_SEND -2
+#define XCP_ERR_TIMEOUT -3
+#define XCP_ERR_NEGATIVE -4         // see getLastError()
+
+typedef struct {
+    uint16_t event;
+    uint8_t prescaler;
+    uint8_t first_odt;
+    uint8_t odt_count;
+} xcp_daq_t;
+
+typedef struct {
+    uint8_t daq;
+    uint8_t entry_count;
+    uint16_t first_entry;
+} xcp_odt_t;
+
+// Where each entry lands in its DTO is worked out when the table is loaded,
+// so decoding a DTO is a PID lookup and a walk over fixed offsets.
+typedef struct {
+    uint32_t address;
+    uint16_t value_index;
+    uint8_t ext;
+    uint8_t size;           // 1, 2 or 4
+    uint8_t offset;         // in the DTO, past the PID
+    uint8_t flags;
+} xcp_entry_t;
+
+class XCPMaster {
+    public:
+        XCPMaster() : _ready(false), _connected(false), _running(false), _motorola(false),
+            _slave_key(CANTRAFFIC_KEY_EMPTY), _dto_count(0), _daq_count(0), _min_daq(0), _odt_count(0), _entry_count(0) {
+            k_mutex_init(&_mutex);
+            clearPIDs();
+        };
+        bool load(const char *path);
+
+        bool connect(void);
+        void disconnect(void);
+        bool start(void);
+        void stop(void);
+
+        bool receive(const struct zcan_frame *frame, uint32_t timestamp);
+
+        bool isRunning(void) { return _running; };
+        uint8_t getLastError(void) { return _last_error; };
+        uint32_t getDTOCount(void) { return _dto_count; };
+
+    protected:
+        struct k_mutex _mutex;
+
+        volatile bool _ready;
+        volatile bool _connected;
+        volatile bool _running;
+        bool _motorola;
+        bool _ext;
+        uint32_t _master_id;
+        volatile uint32_t _slave_key;   // cantraffic key, CANTRAFFIC_KEY_EMPTY until loaded
+        uint8_t _last_error;
+        uint32_t _dto_count;
+
+        uint8_t _daq_count;
+        uint8_t _min_daq;               // first dynamic list on the slave
+        uint8_t _odt_count;
+        uint16_t _entry_count;
+        xcp_daq_t _daqs[XCP_MAX_DAQ];
+        xcp_odt_t _odts[XCP_MAX_ODT];
+        xcp_entry_t _entries[XCP_MAX_ENTRIES];
+        uint8_t _pid_map[256];          // absolute ODT number to _odts index
+
+        uint8_t _cmd[XCP_MAX_CTO];
+        uint8_t _resp[XCP_MAX_CTO];
+
+        bool parseLine(char *line);
+        void clearPIDs(void);
+        int command(int len);
+        bool configure(void);
+        void decode(const struct zcan_frame *frame, uint32_t timestamp);
+        void putWord(uint8_t *p, uint16_t value);
+        uint16_t getWord(const uint8_t *p);
+        void putLong(uint8_t *p, uint32_t value);
+};
+
+extern XCPMaster xcp;
+
+extern "C" {
+#endif
+
+void xcp_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -10,10 +10,20 @@
 #include <sys/printk.h>
 #include <device.h>
 #include <drivers/can.h>
+#include <shell/shell.h>
+#include <string.h>
 
 #include "gpio_map.h"
 #include "modes.h"
 #include "canbus.h"
+#include "j1939.h"
+#include "slcan.h"
+#include "cantraffic.h"
+#include "canrate.h"
+#include "dbc.h"
+#include "uds.h"
+#include "capture.h"
+#include "xcp.h"
 
 #include <logging/log.h>
 LOG_MODULE_REGISTER(canbus, 3);
@@ -24,8 +34,9 @@ K_THREAD_STACK_DEFINE(canbus_rx_thread_stack, CAN_RX_THREAD_STACK_SIZE);
 K_THREAD_STACK_DEFINE(canbus_tx_thread_stack, CAN_TX_THREAD_STACK_SIZE);
 K_THREAD_STACK_DEFINE(canbus_poll_state_stack, CAN_STATE_POLL_THREAD_STACK_SIZE);
 
-CAN_DEFINE_MSGQ(canbus_rx_msgq, 256);
-CAN_DEFINE_MSGQ(canbus_tx_msgq, 32);
+static can_rx_slot_t canbus_rx_ring[CAN_RX_RING_SIZE];
+static can_tx_entry_t canbus_tx_slots[CAN_TX_QUEUE_SIZE];
+static can_tx_deferred_t canbus_tx_deferred[CAN_TX_DEFER_MAX];
 
 void CANBusPort::begin(void)
 {
@@ -36,6 +47,10 @@ void CANBusPort::begin(void)
 		return;
 	}
 
+	k_sem_init(&_rx_sem, 0, 1);
+	k_sem_init(&_tx_items, 0, CAN_TX_QUEUE_SIZE);
+	k_sem_init(&_tx_space, CAN_TX_QUEUE_SIZE, CAN_TX_QUEUE_SIZE);
+
 	setMode(MODE_IDLE);
 
     k_work_init(&_state_change_work, canbus_state_change_work_handler);
@@ -72,8 +87,7 @@ void CANBusPort::begin(void)
 
 void CANBusPort::setMode(operation_mode_t mode)
 {
-	int status;
-	struct can_timing timing;
+	bool status;
 
 	if (mode == _mode && mode != MODE_IDLE) {
 		return;
@@ -81,126 +95,606 @@ void CANBusPort::setMode(operation_mode_t mode)
 
 	_mode = mode;
 
+	if (_mode != MODE_SW_CAN) {
+		setSWCANMode(SWCAN_SLEEP);
+	}
+
 	switch (_mode) {
 		case MODE_HS_CAN:
 			gpio_output_set(GPIO_CAN_SEL0, false);
             gpio_output_set(GPIO_CAN_SEL1, true);
             gpio_output_set(GPIO_CAN_EN, true);
-			status = can_calc_timing(_dev, &timing, 500000, 875);
+			status = setBitrate(500000);
 			break;
 
 		case MODE_MS_CAN:
 			gpio_output_set(GPIO_CAN_SEL0, true);
             gpio_output_set(GPIO_CAN_SEL1, false);
             gpio_output_set(GPIO_CAN_EN, true);
-			status = can_calc_timing(_dev, &timing, 125000, 875);
+			status = setBitrate(125000);
 			break;
 
 		case MODE_SW_CAN:
             gpio_output_set(GPIO_CAN_SEL0, true);
             gpio_output_set(GPIO_CAN_SEL1, true);
             gpio_output_set(GPIO_CAN_EN, false);
-			status = can_calc_timing(_dev, &timing, 83333, 875);
+			_bitrate = 0;
+			setSWCANMode(SWCAN_NORMAL);
+			status = _bitrate != 0;
 			break;
 
 		default:
 			// Not CAN, disable
-			status = -1;
+			status = false;
 			break;
 	}
 	
-	if (status == 0) {
-		can_set_timing(_dev, &timing, NULL);
-
-		const struct zcan_filter filter = {
+	if (status) {
+		// Everything, data and remote, both ID lengths.  bxCAN hands a frame
+		// to one filter only, and an exact match wins over these, so while
+		// UDS has ISO-TP bound its response ID never reaches receive(): it
+		// isn't captured, forwarded to SLCAN or decoded.  Close the UDS
+		// client to sniff that ID.
+		const struct zcan_filter ext_filter = {
 			.id = 0,
 			.rtr = CAN_DATAFRAME,
 			.id_type = CAN_EXTENDED_IDENTIFIER,
 			.id_mask = 0,
-			.rtr_mask = 1,
+			.rtr_mask = 0,
+		};
+		const struct zcan_filter std_filter = {
+			.id = 0,
+			.rtr = CAN_DATAFRAME,
+			.id_type = CAN_STANDARD_IDENTIFIER,
+			.id_mask = 0,
+			.rtr_mask = 0,
 		};
 
 		if (_filter_id == -1) {
-			_filter_id = can_attach_msgq(_dev, &canbus_rx_msgq, &filter);
+			_filter_id = can_attach_isr(_dev, canbus_rx_isr, this, &ext_filter);
 			printk("CAN filter id: %d\n", _filter_id);
 		}
+		if (_std_filter_id == -1) {
+			_std_filter_id = can_attach_isr(_dev, canbus_rx_isr, this, &std_filter);
+			printk("CAN standard filter id: %d\n", _std_filter_id);
+		}
+
+		if (_mode == MODE_SW_CAN && !wakeupSWCAN()) {
+			// Nodes that were asleep stay that way, the bus still works
+			LOG_WRN("SW-CAN wakeup not sent");
+		}
 	} else {
 		if (_filter_id != -1) {
 			can_detach(_dev, _filter_id);
 			_filter_id = -1;
 		}
+		if (_std_filter_id != -1) {
+			can_detach(_dev, _std_filter_id);
+			_std_filter_id = -1;
+		}
+
+		unroutePeriodic();
 
 		gpio_output_set(GPIO_CAN_EN, false);
 		gpio_output_set(GPIO_CAN_SEL0, false);
 		gpio_output_set(GPIO_CAN_SEL1, false); 
+		_bitrate = 0;
 	}
 }
 
-void CANBusPort::rx_thread(void)
+// The main filters already take every frame, this only picks which ID
+// skips the rest of the RX path.
+bool CANBusPort::routePeriodic(uint32_t id, bool ext)
 {
-	struct zcan_frame msg;
-	int status;
+	_periodic_key = id | (ext ? CANTRAFFIC_KEY_EXT : 0);
+	return true;
+}
+
+void CANBusPort::unroutePeriodic(void)
+{
+	_periodic_key = CANTRAFFIC_KEY_EMPTY;
+}
 
+bool CANBusPort::setBitrate(uint32_t bitrate)
+{
+	struct can_timing timing;
+
+	if (bitrate == _bitrate) {
+		return true;
+	}
+
+	if (can_calc_timing(_dev, &timing, bitrate, 875) < 0) {
+		return false;
+	}
+
+	if (can_set_timing(_dev, &timing, NULL) != 0) {
+		return false;
+	}
+
+	_bitrate = bitrate;
+	return true;
+}
+
+void CANBusPort::setSWCANMode(swcan_mode_t mode)
+{
+	bool mode0 = mode & 0x01;
+	bool mode1 = mode & 0x02;
+
+	k_mutex_lock(&_tx_mutex, K_FOREVER);
+
+	if (mode == _swcan_mode) {
+		k_mutex_unlock(&_tx_mutex);
+		return;
+	}
+
+	// Get the controller to the right rate before the transceiver starts
+	// driving the bus in the new mode.
+	if (mode != SWCAN_SLEEP && _mode == MODE_SW_CAN) {
+		setBitrate(mode == SWCAN_HIGH_SPEED ? SWCAN_HIGH_SPEED_BITRATE : SWCAN_NORMAL_BITRATE);
+	}
+
+	// The programming load only belongs on the bus in high-speed mode
+	if (mode != SWCAN_HIGH_SPEED) {
+		gpio_output_set(GPIO_SW_CAN_LOAD, false);
+	}
+
+	// The pins are set one at a time, so pick the order that never passes
+	// through high-voltage wakeup on the way somewhere else.
+	if (!mode0 && (_swcan_mode & 0x02)) {
+		gpio_output_set(GPIO_SW_CAN_MODE1, mode1);
+		gpio_output_set(GPIO_SW_CAN_MODE0, mode0);
+	} else {
+		gpio_output_set(GPIO_SW_CAN_MODE0, mode0);
+		gpio_output_set(GPIO_SW_CAN_MODE1, mode1);
+	}
+
+	if (mode == SWCAN_HIGH_SPEED) {
+		gpio_output_set(GPIO_SW_CAN_LOAD, true);
+	}
+
+	if (mode != SWCAN_SLEEP) {
+		// Transceiver mode change time before it's safe to transmit
+		k_busy_wait(SWCAN_MODE_SETTLE_US);
+	}
+
+	_swcan_mode = mode;
+
+	k_mutex_unlock(&_tx_mutex);
+}
+
+bool CANBusPort::wakeupSWCAN(void)
+{
+	if (_mode != MODE_SW_CAN) {
+		return false;
+	}
+
+	struct zcan_frame msg = {
+		.id = SWCAN_WAKEUP_ID,
+		.fd = 0,
+		.rtr = CAN_DATAFRAME,
+		.id_type = CAN_STANDARD_IDENTIFIER,
+		.dlc = 0,
+	};
+
+	// Hold off the TX thread so only the wakeup frame goes out at high voltage
+	k_mutex_lock(&_tx_mutex, K_FOREVER);
+
+	swcan_mode_t previous = _swcan_mode == SWCAN_SLEEP ? SWCAN_NORMAL : _swcan_mode;
+
+	setSWCANMode(SWCAN_WAKEUP);
+	int status = can_send(_dev, &msg, K_MSEC(100), NULL, NULL);
+	setSWCANMode(previous);
+
+	k_mutex_unlock(&_tx_mutex);
+
+	return status == 0;
+}
+
+#ifdef CAN_RX_CYCLE_STATS
+static inline void canbus_cycle_update(can_cycle_stats_t *stats, uint32_t cycles)
+{
+	stats->count++;
+	stats->total += cycles;
+	if (!stats->min || cycles < stats->min) {
+		stats->min = cycles;
+	}
+	if (cycles > stats->max) {
+		stats->max = cycles;
+	}
+}
+
+void CANBusPort::getRxCycles(can_cycle_stats_t *isr, can_cycle_stats_t *thread)
+{
+	unsigned int key = irq_lock();
+	*isr = _rx_isr_cycles;
+	*thread = _rx_thread_cycles;
+	irq_unlock(key);
+}
+#endif
+
+// Driver callback, ISR context.  The only copy of the frame on the way in is
+// the one into its ring slot.
+void CANBusPort::rx_isr(const struct zcan_frame *frame)
+{
+#ifdef CAN_RX_CYCLE_STATS
+	uint32_t start = k_cycle_get_32();
+#endif
+	atomic_val_t head = atomic_get(&_rx_head);
+
+	if ((uint32_t)(head - atomic_get(&_rx_tail)) >= CAN_RX_RING_SIZE) {
+		_rx_overruns++;
+		return;
+	}
+
+	can_rx_slot_t *slot = &canbus_rx_ring[head & (CAN_RX_RING_SIZE - 1)];
+	slot->frame = *frame;
+	slot->timestamp = obd_timestamp();
+
+	// Publish the slot only once it's filled in
+	atomic_set(&_rx_head, head + 1);
+	k_sem_give(&_rx_sem);
+
+#ifdef CAN_RX_CYCLE_STATS
+	canbus_cycle_update(&_rx_isr_cycles, k_cycle_get_32() - start);
+#endif
+}
+
+void CANBusPort::rx_thread(void)
+{
 	while (1) {
-		status = k_msgq_get(&canbus_rx_msgq, &msg, K_MSEC(100));
-
-		if (status == 0 && MODE_IS_CAN(_mode) && msg.dlc == 8) {
-			obd_packet_t packet = {
-				.mode = _mode,
-				.id = msg.id,
-				.count = msg.data[0],
-				.service = msg.data[1],
-				.pid = msg.data[2],
-				.a = msg.data[3],
-				.b = msg.data[4],
-				.c = msg.data[5],
-				.d = msg.data[6],
-				.unused = msg.data[7],
-			};
-
-			obd2.receive(&packet);
+		k_sem_take(&_rx_sem, K_MSEC(100));
+		j1939.poll();
+		cantraffic.check(obd_timestamp());
+
+		atomic_val_t head = atomic_get(&_rx_head);
+		atomic_val_t tail = atomic_get(&_rx_tail);
+
+		while (tail != head) {
+			const can_rx_slot_t *slot = &canbus_rx_ring[tail & (CAN_RX_RING_SIZE - 1)];
+
+			if (MODE_IS_CAN(_mode)) {
+#ifdef CAN_RX_CYCLE_STATS
+				uint32_t start = k_cycle_get_32();
+				receive(CAN_CHANNEL_CAN1, _mode, &slot->frame, slot->timestamp);
+				uint32_t cycles = k_cycle_get_32() - start;
+
+				unsigned int key = irq_lock();
+				canbus_cycle_update(&_rx_thread_cycles, cycles);
+				irq_unlock(key);
+#else
+				receive(CAN_CHANNEL_CAN1, _mode, &slot->frame, slot->timestamp);
+#endif
+			}
+
+			// Hand the slot back to the ISR only after it's been used
+			atomic_set(&_rx_tail, ++tail);
 		}
 	}
 }
 
+// Every received frame, from either controller.  The MCP2515's come in from
+// its own RX thread.  UDS, XCP and J1939 hold sessions that answer on can1,
+// so only can1's frames go to them.
+void CANBusPort::receive(uint8_t channel, operation_mode_t mode, const struct zcan_frame *frame, uint32_t timestamp)
+{
+	// Only the host-facing taps and the capture are thinned, OBD2 sees
+	// every frame
+	if (cantraffic.forward(frame, timestamp, channel)) {
+		capture.record(frame, timestamp, channel);
+		slcan.forward(frame, timestamp, channel);
+	}
+
+	if (channel != CAN_CHANNEL_CAN1) {
+		dbc.decode(frame, timestamp);
+		dispatch(mode, frame, timestamp);
+		return;
+	}
+
+	// UDS periodic data goes straight to the value store
+	if (cantraffic_key(frame) == _periodic_key) {
+		uds.periodic(frame, timestamp);
+		return;
+	}
+
+	// As is everything from an XCP slave
+	if (xcp.receive(frame, timestamp)) {
+		return;
+	}
+
+	if (frame->id_type == CAN_EXTENDED_IDENTIFIER) {
+		j1939.receive(frame);
+	}
+
+	dbc.decode(frame, timestamp);
+	dispatch(mode, frame, timestamp);
+}
+
+void CANBusPort::dispatch(operation_mode_t mode, const struct zcan_frame *frame, uint32_t timestamp)
+{
+	uint8_t dlc = MIN(frame->dlc, CAN_MAX_DLC);
+	uint8_t data[CAN_MAX_DLC] = {};
+
+	// Bytes past the dlc are whatever the driver left there
+	if (frame->rtr != CAN_REMOTEREQUEST) {
+		memcpy(data, frame->data, dlc);
+	}
+
+	obd_packet_t packet = {
+		.mode = mode,
+		.id = frame->id,
+		.count = data[0],
+		.service = data[1],
+		.pid = data[2],
+		.a = data[3],
+		.b = data[4],
+		.c = data[5],
+		.d = data[6],
+		.unused = data[7],
+		.dlc = dlc,
+		.flags = (uint8_t)((frame->id_type == CAN_EXTENDED_IDENTIFIER ? OBD_PACKET_EXT : 0) |
+				   (frame->rtr == CAN_REMOTEREQUEST ? OBD_PACKET_RTR : 0)),
+		.timestamp = timestamp,
+	};
+
+	obd2.receive(&packet);
+}
+
+// The caller has made room via _tx_space, so there's always a slot
+void CANBusPort::txPush(const can_tx_entry_t *entry)
+{
+	k_spinlock_key_t key = k_spin_lock(&_tx_lock);
+
+	int slot = _tx_queue.push(entry->key);
+	if (slot >= 0) {
+		canbus_tx_slots[slot] = *entry;
+	}
+
+	k_spin_unlock(&_tx_lock, key);
+}
+
+// The caller holds one of _tx_items, so the queue isn't empty
+void CANBusPort::txPop(can_tx_entry_t *entry)
+{
+	k_spinlock_key_t key = k_spin_lock(&_tx_lock);
+
+	int slot = _tx_queue.pop();
+	if (slot >= 0) {
+		*entry = canbus_tx_slots[slot];
+	}
+
+	k_spin_unlock(&_tx_lock, key);
+}
+
 void CANBusPort::tx_thread(void)
 {
 	int status;
-	struct zcan_frame msg;
+	can_tx_entry_t entry;
 
 	while (1) {
-		status = k_msgq_get(&canbus_tx_msgq, &msg, K_MSEC(100));
+		status = k_sem_take(&_tx_items, K_USEC(txRetryWait()));
+		if (status == 0) {
+			txPop(&entry);
+			k_sem_give(&_tx_space);
+		}
+
+		if (!MODE_IS_CAN(_mode)) {
+			_tx_deferred = 0;
+			continue;
+		}
+
+		txRetry();
 
-		if (status == 0 && MODE_IS_CAN(_mode)) {
-			/* This sending call is blocking until the message is sent. */
-			can_send(_dev, &msg, K_MSEC(100), NULL, NULL);
+		if (status == 0) {
+			txSchedule(&entry);
 		}
 	}
 }
 
+void CANBusPort::txTransmit(const can_tx_entry_t *entry)
+{
+	/* This sending call is blocking until the message is sent. */
+	k_mutex_lock(&_tx_mutex, K_FOREVER);
+	int status = can_send(_dev, &entry->frame, K_MSEC(100), NULL, NULL);
+	k_mutex_unlock(&_tx_mutex);
+
+	if (status == 0) {
+		updateTxLatency(obd_timestamp() - entry->queued);
+	}
+}
+
+// A frame over its own ID's limit is parked and the queue carries on.  Only
+// a frame over the bus-wide limit, or with nowhere to park, holds up the
+// rest; every frame draws on that budget, so nothing else could go anyway.
+void CANBusPort::txSchedule(const can_tx_entry_t *entry)
+{
+	uint32_t key = cantraffic_key(&entry->frame);
+
+	while (MODE_IS_CAN(_mode)) {
+		const can_tx_deferred_t *ahead = txDeferred(key);
+		uint32_t wait = txRetryWait();
+
+		if (ahead) {
+			if (txDefer(entry, ahead->ready)) {
+				return;
+			}
+		} else {
+			bool shared;
+			uint32_t delay = canrate.acquire(&entry->frame, _bitrate, &shared);
+
+			if (!delay) {
+				txTransmit(entry);
+				return;
+			}
+			if (!shared && txDefer(entry, obd_timestamp() + delay)) {
+				return;
+			}
+			wait = MIN(wait, delay);
+		}
+
+		k_sleep(K_USEC(wait));
+		txRetry();
+	}
+}
+
+bool CANBusPort::txDefer(const can_tx_entry_t *entry, uint32_t ready)
+{
+	if (_tx_deferred >= CAN_TX_DEFER_MAX) {
+		return false;
+	}
+
+	canbus_tx_deferred[_tx_deferred].entry = *entry;
+	canbus_tx_deferred[_tx_deferred].ready = ready;
+	_tx_deferred++;
+	return true;
+}
+
+// The oldest parked frame for this ID, if any
+const can_tx_deferred_t *CANBusPort::txDeferred(uint32_t key)
+{
+	for (int i = 0; i < _tx_deferred; i++) {
+		if (cantraffic_key(&canbus_tx_deferred[i].entry.frame) == key) {
+			return &canbus_tx_deferred[i];
+		}
+	}
+
+	return 0;
+}
+
+// Sends whatever the rate limit now allows, oldest first, and compacts the
+// rest.  A frame still behind an earlier one of its ID takes that one's
+// retry time, so it isn't polled on its own.
+void CANBusPort::txRetry(void)
+{
+	int kept = 0;
+
+	for (int i = 0; i < _tx_deferred; i++) {
+		can_tx_deferred_t held = canbus_tx_deferred[i];
+		uint32_t key = cantraffic_key(&held.entry.frame);
+		const can_tx_deferred_t *ahead = 0;
+
+		for (int j = 0; j < kept; j++) {
+			if (cantraffic_key(&canbus_tx_deferred[j].entry.frame) == key) {
+				ahead = &canbus_tx_deferred[j];
+				break;
+			}
+		}
+
+		if (ahead) {
+			held.ready = ahead->ready;
+		} else if ((int32_t)(obd_timestamp() - held.ready) >= 0) {
+			uint32_t delay = canrate.acquire(&held.entry.frame, _bitrate);
+
+			if (!delay) {
+				txTransmit(&held.entry);
+				continue;
+			}
+			held.ready = obd_timestamp() + delay;
+		}
+
+		canbus_tx_deferred[kept++] = held;
+	}
+
+	_tx_deferred = kept;
+}
+
+// us until the first parked frame is due, or the idle poll with none
+uint32_t CANBusPort::txRetryWait(void)
+{
+	uint32_t now = obd_timestamp();
+	uint32_t wait = CAN_TX_IDLE_US;
+
+	for (int i = 0; i < _tx_deferred; i++) {
+		int32_t due = (int32_t)(canbus_tx_deferred[i].ready - now);
+		wait = MIN(wait, (uint32_t)MAX(due, 0));
+	}
+
+	return wait;
+}
+
 bool CANBusPort::send(obd_packet_t *packet)
 {
 	if (!packet) {
 		return false;
 	}
 
-	if (packet->count > 7) {
+	if (packet->dlc > CAN_MAX_DLC) {
 		return false;
 	}
 
 	uint32_t id = packet->id;
+	bool ext = (packet->flags & OBD_PACKET_EXT) || id >= (1 << 11);
 
 	struct zcan_frame msg = {
 		.id = id,
 		.fd = 0,
-		.rtr = CAN_DATAFRAME,
-		.id_type = id < (1 << 11) ? CAN_STANDARD_IDENTIFIER : CAN_EXTENDED_IDENTIFIER,
-		.dlc = 8,
+		.rtr = (uint8_t)((packet->flags & OBD_PACKET_RTR) ? CAN_REMOTEREQUEST : CAN_DATAFRAME),
+		.id_type = (uint8_t)(ext ? CAN_EXTENDED_IDENTIFIER : CAN_STANDARD_IDENTIFIER),
+		.dlc = packet->dlc,
 		.data = {packet->count, packet->service, packet->pid, packet->a, packet->b, packet->c, packet->d, packet->unused},
 	};
 
-	int status = k_msgq_put(&canbus_tx_msgq, &msg, K_FOREVER);
-	return status == 0;
+	if (!msg.dlc && msg.rtr == CAN_DATAFRAME) {
+		msg.dlc = OBD_CAN_DLC;
+		if (packet->count < OBD_CAN_DLC - 1) {
+			memset(&msg.data[1 + packet->count], OBD_CAN_PADDING, OBD_CAN_DLC - 1 - packet->count);
+		}
+	}
+
+	return sendFrame(&msg);
+}
+
+bool CANBusPort::sendFrame(const struct zcan_frame *frame, k_timeout_t timeout, uint32_t queued)
+{
+	if (!frame || frame->dlc > 8) {
+		return false;
+	}
+
+	can_tx_entry_t entry;
+	entry.frame = *frame;
+	entry.queued = queued ? queued : obd_timestamp();
+	entry.key = CAN_ARBITRATION_KEY(frame->id, frame->id_type == CAN_EXTENDED_IDENTIFIER,
+					frame->rtr == CAN_REMOTEREQUEST);
+
+	if (k_sem_take(&_tx_space, timeout) != 0) {
+		return false;
+	}
+
+	txPush(&entry);
+	k_sem_give(&_tx_items);
+	return true;
+}
+
+void CANBusPort::updateTxLatency(uint32_t latency)
+{
+	k_spinlock_key_t key = k_spin_lock(&_stats_lock);
+
+	_tx_latency.count++;
+	_tx_latency.total_us += latency;
+	if (latency < _tx_latency.min_us) {
+		_tx_latency.min_us = latency;
+	}
+	if (latency > _tx_latency.max_us) {
+		_tx_latency.max_us = latency;
+	}
+
+	k_spin_unlock(&_stats_lock, key);
+}
+
+void CANBusPort::getTxLatency(can_latency_stats_t *stats)
+{
+	k_spinlock_key_t key = k_spin_lock(&_stats_lock);
+	*stats = _tx_latency;
+	k_spin_unlock(&_stats_lock, key);
+}
+
+void CANBusPort::resetTxLatency(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&_stats_lock);
+	_tx_latency.count = 0;
+	_tx_latency.min_us = UINT32_MAX;
+	_tx_latency.max_us = 0;
+	_tx_latency.total_us = 0;
+	k_spin_unlock(&_stats_lock, key);
 }
 
 const char *CANBusPort::state_to_str(enum can_state state)
@@ -298,6 +792,12 @@ void canbus_rx_thread(void *arg1, void *arg2, void *arg3)
 	canbus.rx_thread();
 }
 
+void canbus_rx_isr(struct zcan_frame *frame, void *arg)
+{
+	CANBusPort *port = static_cast<CANBusPort *>(arg);
+	port->rx_isr(frame);
+}
+
 void canbus_tx_thread(void *arg1, void *arg2, void *arg3) 
 {
 	ARG_UNUSED(arg1);
@@ -315,3 +815,35 @@ void canbus_poll_state_thread(void *arg1, void *arg2, void *arg3)
 
 	canbus.poll_state_thread();
 }
+
+// Shell
+
+static int cmd_swcan(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+
+	if (canbus.getMode() != MODE_SW_CAN) {
+		shell_error(sh, "Not in SW-CAN mode");
+		return -EINVAL;
+	}
+
+	if (!strcmp(argv[1], "wakeup")) {
+		if (!canbus.wakeupSWCAN()) {
+			shell_error(sh, "Wakeup not sent");
+			return -EIO;
+		}
+	} else if (!strcmp(argv[1], "normal")) {
+		canbus.setSWCANMode(SWCAN_NORMAL);
+	} else if (!strcmp(argv[1], "hs")) {
+		canbus.setSWCANMode(SWCAN_HIGH_SPEED);
+	} else if (!strcmp(argv[1], "sleep")) {
+		canbus.setSWCANMode(SWCAN_SLEEP);
+	} else {
+		shell_error(sh, "Mode is wakeup, normal, hs or sleep");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+SHELL_CMD_ARG_REGISTER(swcan, NULL, "SW-CAN transceiver: swcan <wakeup|normal|hs|sleep>", cmd_swcan, 2, 0);
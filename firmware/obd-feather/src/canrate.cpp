@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 2023 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <drivers/can.h>
+#include <stdlib.h>
+#include <string.h>
+#include <shell/shell.h>
+
+#include "obd2.h"
+#include "cantraffic.h"
+#include "canrate.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(canrate, 3);
+
+CANRateLimit canrate;
+
+void CANRateLimit::setGlobal(uint8_t percent)
+{
+	k_spinlock_key_t key = k_spin_lock(&_lock);
+	_global.percent = MIN(percent, 100);
+	fill(&_global, obd_timestamp());
+	k_spin_unlock(&_lock, key);
+}
+
+bool CANRateLimit::setLimit(uint32_t id, bool ext, uint8_t percent)
+{
+	uint32_t frame_key = id | (ext ? CANTRAFFIC_KEY_EXT : 0);
+	k_spinlock_key_t key = k_spin_lock(&_lock);
+
+	canrate_bucket_t *bucket = find(frame_key);
+	if (!bucket && percent) {
+		bucket = find(CANTRAFFIC_KEY_EMPTY);
+	}
+
+	if (bucket) {
+		bucket->key = percent ? frame_key : CANTRAFFIC_KEY_EMPTY;
+		bucket->percent = MIN(percent, 100);
+		fill(bucket, obd_timestamp());
+	}
+
+	k_spin_unlock(&_lock, key);
+	return bucket || !percent;
+}
+
+void CANRateLimit::reset(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&_lock);
+
+	for (int i = 0; i < CANRATE_MAX_LIMITS; i++) {
+		_limits[i].key = CANTRAFFIC_KEY_EMPTY;
+		_limits[i].percent = 0;
+	}
+	fill(&_global, 0);
+
+	k_spin_unlock(&_lock, key);
+}
+
+canrate_bucket_t *CANRateLimit::find(uint32_t key)
+{
+	for (int i = 0; i < CANRATE_MAX_LIMITS; i++) {
+		if (_limits[i].key == key) {
+			return &_limits[i];
+		}
+	}
+
+	return 0;
+}
+
+uint64_t CANRateLimit::capacity(const canrate_bucket_t *bucket)
+{
+	uint64_t burst = (uint64_t)CANRATE_BURST_US * _bitrate * bucket->percent;
+	return MAX(burst, CANRATE_MAX_FRAME_BITS * CANRATE_SCALE);
+}
+
+void CANRateLimit::fill(canrate_bucket_t *bucket, uint32_t now)
+{
+	bucket->tokens = capacity(bucket);
+	bucket->updated = now;
+}
+
+void CANRateLimit::refill(canrate_bucket_t *bucket, uint32_t now)
+{
+	uint64_t limit = capacity(bucket);
+	uint32_t elapsed = now - bucket->updated;
+
+	bucket->updated = now;
+	bucket->tokens += (uint64_t)elapsed * _bitrate * bucket->percent;
+	if (bucket->tokens > limit) {
+		bucket->tokens = limit;
+	}
+}
+
+// us until the bucket covers the cost, 0 if it already does
+uint32_t CANRateLimit::deficit(const canrate_bucket_t *bucket, uint64_t cost)
+{
+	if (bucket->tokens >= cost) {
+		return 0;
+	}
+
+	uint64_t rate = (uint64_t)_bitrate * bucket->percent;
+	return (cost - bucket->tokens + rate - 1) / rate;
+}
+
+// Called by the TX thread before each frame.  Returns how long to wait
+// before asking again; on 0 the frame's bits are taken from its own bucket
+// and the global one together.  shared is set when the global bucket is
+// short, which holds up every frame rather than just this ID.
+uint32_t CANRateLimit::acquire(const struct zcan_frame *frame, uint32_t bitrate, bool *shared)
+{
+	if (shared) {
+		*shared = false;
+	}
+
+	if (!bitrate) {
+		return 0;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&_lock);
+	uint32_t now = obd_timestamp();
+
+	if (bitrate != _bitrate) {
+		_bitrate = bitrate;
+		fill(&_global, now);
+		for (int i = 0; i < CANRATE_MAX_LIMITS; i++) {
+			fill(&_limits[i], now);
+		}
+	}
+
+	canrate_bucket_t *limit = find(cantraffic_key(frame));
+	uint64_t cost = canrate_frame_bits(frame) * CANRATE_SCALE;
+	uint32_t delay = 0;
+
+	if (_global.percent) {
+		refill(&_global, now);
+		delay = deficit(&_global, cost);
+		if (shared) {
+			*shared = delay != 0;
+		}
+	}
+
+	if (limit) {
+		refill(limit, now);
+		delay = MAX(delay, deficit(limit, cost));
+	}
+
+	if (!delay) {
+		if (_global.percent) {
+			_global.tokens -= cost;
+		}
+		if (limit) {
+			limit->tokens -= cost;
+		}
+	}
+
+	k_spin_unlock(&_lock, key);
+	return delay;
+}
+
+void CANRateLimit::report(canrate_bucket_t *bucket, canrate_budget_t *budget)
+{
+	if (_bitrate && bucket->percent) {
+		refill(bucket, obd_timestamp());
+	}
+
+	budget->percent = bucket->percent;
+	budget->available = bucket->tokens / CANRATE_SCALE;
+	budget->capacity = capacity(bucket) / CANRATE_SCALE;
+}
+
+void CANRateLimit::getBudget(canrate_budget_t *budget)
+{
+	k_spinlock_key_t key = k_spin_lock(&_lock);
+	report(&_global, budget);
+	k_spin_unlock(&_lock, key);
+}
+
+bool CANRateLimit::getBudget(uint32_t id, bool ext, canrate_budget_t *budget)
+{
+	k_spinlock_key_t key = k_spin_lock(&_lock);
+
+	canrate_bucket_t *bucket = find(id | (ext ? CANTRAFFIC_KEY_EXT : 0));
+	if (bucket) {
+		report(bucket, budget);
+	}
+
+	k_spin_unlock(&_lock, key);
+	return bucket != 0;
+}
+
+// Shell
+
+static int cmd_canrate_global(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(sh);
+	ARG_UNUSED(argc);
+
+	canrate.setGlobal(strtoul(argv[1], NULL, 10));
+	return 0;
+}
+
+static int cmd_canrate_limit(const struct shell *sh, size_t argc, char **argv)
+{
+	uint32_t id = strtoul(argv[1], NULL, 16);
+	bool ext = argc > 3 && !strcmp(argv[3], "ext");
+
+	if (!canrate.setLimit(id, ext, strtoul(argv[2], NULL, 10))) {
+		shell_error(sh, "No room for another limit");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static int cmd_canrate_show(const struct shell *sh, size_t argc, char **argv)
+{
+	canrate_budget_t budget;
+
+	if (argc > 1) {
+		bool ext = argc > 2 && !strcmp(argv[2], "ext");
+
+		if (!canrate.getBudget(strtoul(argv[1], NULL, 16), ext, &budget)) {
+			shell_error(sh, "No limit on %s", argv[1]);
+			return -EINVAL;
+		}
+	} else {
+		canrate.getBudget(&budget);
+	}
+
+	shell_print(sh, "%u%% of the bus, %u of %u bit times available",
+		    budget.percent, budget.available, budget.capacity);
+	return 0;
+}
+
+static int cmd_canrate_reset(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(sh);
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	canrate.reset();
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_canrate,
+	SHELL_CMD_ARG(global, NULL, "Bus-wide TX limit: global <percent>, 0 for none", cmd_canrate_global, 2, 0),
+	SHELL_CMD_ARG(limit, NULL, "Per-ID TX limit: limit <hex id> <percent> [ext]", cmd_canrate_limit, 3, 1),
+	SHELL_CMD_ARG(show, NULL, "TX budget: show [<hex id> [ext]]", cmd_canrate_show, 1, 2),
+	SHELL_CMD(reset, NULL, "Drop the per-ID limits", cmd_canrate_reset),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(canrate, &sub_canrate, "CAN TX rate limits", NULL);
@@ -0,0 +1,404 @@
+/*
+ * Copyright (c) 2023 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <drivers/can.h>
+#include <string.h>
+#include <stdlib.h>
+#include <shell/shell.h>
+
+#include "obd2.h"
+#include "canbus.h"
+#include "cantraffic.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(cantraffic, 3);
+
+CANTraffic cantraffic;
+
+// Valid bytes for each dlc, frame data is little endian in the word
+static const uint64_t cantraffic_masks[CAN_MAX_DLC + 1] = {
+	0x0000000000000000ULL,
+	0x00000000000000FFULL,
+	0x000000000000FFFFULL,
+	0x0000000000FFFFFFULL,
+	0x00000000FFFFFFFFULL,
+	0x000000FFFFFFFFFFULL,
+	0x0000FFFFFFFFFFFFULL,
+	0x00FFFFFFFFFFFFFFULL,
+	0xFFFFFFFFFFFFFFFFULL,
+};
+
+// Starts the change-only filter afresh, every ID's next frame goes out.
+// The cycle times learned so far are kept.
+void CANTraffic::enable(uint32_t heartbeat_ms)
+{
+	k_spinlock_key_t key = k_spin_lock(&_lock);
+
+	for (int i = 0; i < CANTRAFFIC_TABLE_SIZE; i++) {
+		_table[i].dlc = 0xFF;
+		_table[i].last_forward = 0;
+	}
+	_forwarded = 0;
+	_suppressed = 0;
+
+	_heartbeat = heartbeat_ms * 1000;
+	_enabled = true;
+
+	k_spin_unlock(&_lock, key);
+}
+
+void CANTraffic::disable(void)
+{
+	_enabled = false;
+}
+
+void CANTraffic::reset(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&_lock);
+
+	for (int i = 0; i < CANTRAFFIC_TABLE_SIZE; i++) {
+		_table[i].key = CANTRAFFIC_KEY_EMPTY;
+	}
+	_forwarded = 0;
+	_suppressed = 0;
+	_anomalies = 0;
+
+	k_spin_unlock(&_lock, key);
+}
+
+cantraffic_entry_t *CANTraffic::lookup(uint32_t key)
+{
+	uint32_t index = (key * 2654435761U) >> (32 - CANTRAFFIC_TABLE_BITS);
+
+	for (int i = 0; i < CANTRAFFIC_MAX_PROBE; i++) {
+		cantraffic_entry_t *entry = &_table[(index + i) & (CANTRAFFIC_TABLE_SIZE - 1)];
+
+		if (entry->key == key) {
+			return entry;
+		}
+
+		if (entry->key == CANTRAFFIC_KEY_EMPTY) {
+			entry->key = key;
+			entry->heartbeat = 0;
+			entry->dlc = 0xFF;		// never matches, so the first copy goes out
+			entry->payload = 0;
+			entry->rtr = 0;
+			entry->last_forward = 0;
+			entry->last_seen = 0;
+			entry->period8 = 0;
+			entry->jitter4 = 0;
+			entry->samples = 0;
+			entry->flags = 0;
+			return entry;
+		}
+	}
+
+	return 0;
+}
+
+bool CANTraffic::setHeartbeat(uint32_t id, bool ext, uint32_t heartbeat_ms)
+{
+	k_spinlock_key_t key = k_spin_lock(&_lock);
+
+	cantraffic_entry_t *entry = lookup(id | (ext ? CANTRAFFIC_KEY_EXT : 0));
+	if (entry) {
+		entry->heartbeat = heartbeat_ms * 1000;
+	}
+
+	k_spin_unlock(&_lock, key);
+
+	return entry != 0;
+}
+
+static inline bool cantraffic_jittery(const cantraffic_entry_t *entry, uint32_t percent)
+{
+	// jitter > period * percent / 100, both sides scaled to period * 8
+	return (uint64_t)entry->jitter4 * 200 > (uint64_t)entry->period8 * percent;
+}
+
+// One inter-arrival sample into the running estimates.  Returns the flags
+// that newly came on or went off, with the lock held, for the caller to
+// report afterwards.
+uint8_t CANTraffic::track(cantraffic_entry_t *entry, uint32_t timestamp)
+{
+	uint8_t flags = entry->flags;
+	uint32_t delta = timestamp - entry->last_seen;
+
+	entry->last_seen = timestamp;
+
+	if (flags & CANTRAFFIC_MISSING) {
+		// The gap is the outage, not a cycle time
+		entry->flags &= ~CANTRAFFIC_MISSING;
+		return CANTRAFFIC_MISSING;
+	}
+
+	if (entry->samples == 0) {
+		// First frame, nothing to measure from yet
+		entry->samples = 1;
+		return 0;
+	}
+
+	if (entry->samples == 1) {
+		entry->period8 = delta * 8;
+		entry->jitter4 = delta * 2;
+	} else {
+		int32_t err = (int32_t)(delta - (entry->period8 >> 3));
+
+		entry->period8 += err;
+		if (err < 0) {
+			err = -err;
+		}
+		entry->jitter4 += err - (entry->jitter4 >> 2);
+	}
+
+	if (entry->samples < UINT8_MAX) {
+		entry->samples++;
+	}
+
+	if (entry->samples >= CANTRAFFIC_MIN_SAMPLES && !(flags & CANTRAFFIC_PERIODIC) &&
+		!cantraffic_jittery(entry, CANTRAFFIC_PERIODIC_MAX_JITTER)) {
+		entry->flags |= CANTRAFFIC_PERIODIC;
+	}
+
+	if (entry->flags & CANTRAFFIC_PERIODIC) {
+		if (cantraffic_jittery(entry, _jitter_limit)) {
+			entry->flags |= CANTRAFFIC_JITTER;
+		} else {
+			entry->flags &= ~CANTRAFFIC_JITTER;
+		}
+	}
+
+	return (flags ^ entry->flags) & CANTRAFFIC_JITTER;
+}
+
+static void cantraffic_report(uint32_t key, uint8_t changed, uint8_t flags, uint32_t period, uint32_t jitter)
+{
+	uint32_t id = key & ~(CANTRAFFIC_KEY_EXT | CANTRAFFIC_KEY_CHANNEL);
+	int channel = (key & CANTRAFFIC_KEY_CHANNEL) ? 1 : 0;
+
+	if (changed & CANTRAFFIC_MISSING) {
+		if (flags & CANTRAFFIC_MISSING) {
+			LOG_WRN("ID %X/%d missing, period %u us", id, channel, period);
+		} else {
+			LOG_INF("ID %X/%d back", id, channel);
+		}
+	}
+
+	if (changed & CANTRAFFIC_JITTER) {
+		if (flags & CANTRAFFIC_JITTER) {
+			LOG_WRN("ID %X/%d jitter %u us on period %u us", id, channel, jitter, period);
+		} else {
+			LOG_INF("ID %X/%d jitter back in range", id, channel);
+		}
+	}
+}
+
+// Looks for periodic IDs that have gone quiet.  Rate limited, so it can be
+// called on every pass of the RX thread.
+void CANTraffic::check(uint32_t now)
+{
+	if (!_tracking || (uint32_t)(now - _last_check) < CANTRAFFIC_CHECK_INTERVAL_US) {
+		return;
+	}
+	_last_check = now;
+
+	for (int i = 0; i < CANTRAFFIC_TABLE_SIZE; i++) {
+		k_spinlock_key_t key = k_spin_lock(&_lock);
+
+		cantraffic_entry_t *entry = &_table[i];
+		uint32_t frame_key = entry->key;
+		uint32_t period = entry->period8 >> 3;
+		bool missing = frame_key != CANTRAFFIC_KEY_EMPTY &&
+			(entry->flags & (CANTRAFFIC_PERIODIC | CANTRAFFIC_MISSING)) == CANTRAFFIC_PERIODIC &&
+			(uint64_t)(uint32_t)(now - entry->last_seen) > (uint64_t)period * _missing_periods;
+
+		if (missing) {
+			entry->flags |= CANTRAFFIC_MISSING;
+			_anomalies++;
+		}
+
+		k_spin_unlock(&_lock, key);
+
+		if (missing) {
+			cantraffic_report(frame_key, CANTRAFFIC_MISSING, CANTRAFFIC_MISSING, period, 0);
+		}
+	}
+}
+
+bool CANTraffic::getTiming(uint32_t id, bool ext, uint32_t now, cantraffic_timing_t *timing, uint8_t channel)
+{
+	uint32_t frame_key = id | (ext ? CANTRAFFIC_KEY_EXT : 0) | (channel ? CANTRAFFIC_KEY_CHANNEL : 0);
+	uint32_t index = (frame_key * 2654435761U) >> (32 - CANTRAFFIC_TABLE_BITS);
+	bool found = false;
+
+	k_spinlock_key_t key = k_spin_lock(&_lock);
+
+	// Not lookup(), asking shouldn't take a slot
+	for (int i = 0; i < CANTRAFFIC_MAX_PROBE; i++) {
+		const cantraffic_entry_t *entry = &_table[(index + i) & (CANTRAFFIC_TABLE_SIZE - 1)];
+
+		if (entry->key == frame_key) {
+			timing->period = entry->period8 >> 3;
+			timing->jitter = entry->jitter4 >> 2;
+			timing->age = now - entry->last_seen;
+			timing->samples = entry->samples;
+			timing->flags = entry->flags;
+			found = true;
+			break;
+		}
+
+		if (entry->key == CANTRAFFIC_KEY_EMPTY) {
+			break;
+		}
+	}
+
+	k_spin_unlock(&_lock, key);
+
+	return found;
+}
+
+// Called for every received frame, tracks cycle times and decides whether
+// the change-only filter lets the frame through to the host.  The same ID
+// on the two controllers is two different frames.
+bool CANTraffic::forward(const struct zcan_frame *frame, uint32_t timestamp, uint8_t channel)
+{
+	if (!_enabled && !_tracking) {
+		return true;
+	}
+
+	uint8_t dlc = MIN(frame->dlc, CAN_MAX_DLC);
+	uint64_t payload;
+
+	memcpy(&payload, frame->data, sizeof(payload));
+	payload &= cantraffic_masks[frame->rtr ? 0 : dlc];
+
+	k_spinlock_key_t key = k_spin_lock(&_lock);
+
+	cantraffic_entry_t *entry = lookup(cantraffic_key(frame) | (channel ? CANTRAFFIC_KEY_CHANNEL : 0));
+	cantraffic_entry_t snapshot;
+	uint8_t changed = 0;
+	bool pass;
+
+	if (entry && _tracking) {
+		changed = track(entry, timestamp);
+		if (changed & entry->flags) {
+			_anomalies++;
+		}
+		snapshot = *entry;
+	}
+
+	if (!_enabled) {
+		pass = true;
+	} else if (!entry) {
+		// Table is full around this ID, don't hide anything
+		pass = true;
+	} else {
+		uint32_t heartbeat = entry->heartbeat ? entry->heartbeat : _heartbeat;
+
+		pass = entry->payload != payload || entry->dlc != dlc || entry->rtr != frame->rtr ||
+			   (uint32_t)(timestamp - entry->last_forward) >= heartbeat;
+
+		if (pass) {
+			entry->payload = payload;
+			entry->dlc = dlc;
+			entry->rtr = frame->rtr;
+			entry->last_forward = timestamp;
+		}
+	}
+
+	if (_enabled) {
+		if (pass) {
+			_forwarded++;
+		} else {
+			_suppressed++;
+		}
+	}
+
+	k_spin_unlock(&_lock, key);
+
+	if (changed) {
+		cantraffic_report(snapshot.key, changed, snapshot.flags, snapshot.period8 >> 3, snapshot.jitter4 >> 2);
+	}
+
+	return pass;
+}
+
+// Shell
+
+static int cmd_cantraffic_timing(const struct shell *sh, size_t argc, char **argv)
+{
+	uint32_t id = strtoul(argv[1], NULL, 16);
+	bool ext = false;
+	uint8_t channel = CAN_CHANNEL_CAN1;
+	cantraffic_timing_t timing;
+
+	for (size_t i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "ext")) {
+			ext = true;
+		} else if (!strcmp(argv[i], "mcp2515")) {
+			channel = CAN_CHANNEL_MCP2515;
+		} else {
+			shell_error(sh, "Unknown option %s", argv[i]);
+			return -EINVAL;
+		}
+	}
+
+	if (!cantraffic.getTiming(id, ext, obd_timestamp(), &timing, channel)) {
+		shell_error(sh, "ID %X/%d not seen", id, channel);
+		return -EINVAL;
+	}
+
+	shell_print(sh, "ID %X/%d: period %u us, jitter %u us, last %u us ago, %u samples%s%s%s", id, channel,
+		    timing.period, timing.jitter, timing.age, timing.samples,
+		    (timing.flags & CANTRAFFIC_PERIODIC) ? ", periodic" : "",
+		    (timing.flags & CANTRAFFIC_MISSING) ? ", missing" : "",
+		    (timing.flags & CANTRAFFIC_JITTER) ? ", jittery" : "");
+	shell_print(sh, "%u anomalies", cantraffic.getAnomalies());
+	return 0;
+}
+
+static int cmd_cantraffic_jitter(const struct shell *sh, size_t argc, char **argv)
+{
+	if (argc > 1) {
+		int percent = atoi(argv[1]);
+
+		if (percent <= 0 || percent > UINT8_MAX) {
+			shell_error(sh, "Jitter limit is 1-%d %% of the period", UINT8_MAX);
+			return -EINVAL;
+		}
+		cantraffic.setJitterLimit(percent);
+	}
+
+	shell_print(sh, "Jitter limit %u %% of the period", cantraffic.getJitterLimit());
+	return 0;
+}
+
+static int cmd_cantraffic_missing(const struct shell *sh, size_t argc, char **argv)
+{
+	if (argc > 1) {
+		int periods = atoi(argv[1]);
+
+		if (periods <= 0 || periods > UINT8_MAX) {
+			shell_error(sh, "Missing after 1-%d periods", UINT8_MAX);
+			return -EINVAL;
+		}
+		cantraffic.setMissingPeriods(periods);
+	}
+
+	shell_print(sh, "Missing after %u periods", cantraffic.getMissingPeriods());
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_cantraffic,
+	SHELL_CMD_ARG(timing, NULL, "Cycle time of one ID: timing <hex id> [ext] [mcp2515]", cmd_cantraffic_timing, 2, 2),
+	SHELL_CMD_ARG(jitter, NULL, "Show or set the jitter limit: jitter [percent of period]", cmd_cantraffic_jitter, 1, 1),
+	SHELL_CMD_ARG(missing, NULL, "Show or set when an ID is missing: missing [periods]", cmd_cantraffic_missing, 1, 1),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(cantraffic, &sub_cantraffic, "CAN cycle time tracking", NULL);
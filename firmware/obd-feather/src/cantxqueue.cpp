@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2023 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdint.h>
+
+#include "cantxqueue.h"
+
+void CANTxQueue::reset(void)
+{
+	_count = 0;
+	_seq = 0;
+
+	for (int i = 0; i < CAN_TX_QUEUE_SIZE; i++) {
+		_free[i] = CAN_TX_QUEUE_SIZE - 1 - i;
+	}
+}
+
+bool CANTxQueue::before(const can_tx_order_t *a, const can_tx_order_t *b)
+{
+	if (a->key != b->key) {
+		return a->key < b->key;
+	}
+	return (int32_t)(a->seq - b->seq) < 0;
+}
+
+void CANTxQueue::swap(int a, int b)
+{
+	can_tx_order_t tmp = _heap[a];
+	_heap[a] = _heap[b];
+	_heap[b] = tmp;
+}
+
+int CANTxQueue::push(uint32_t key)
+{
+	if (_count >= CAN_TX_QUEUE_SIZE) {
+		return -1;
+	}
+
+	int i = _count;
+	uint8_t slot = _free[CAN_TX_QUEUE_SIZE - 1 - _count];
+	_count++;
+
+	_heap[i].key = key;
+	_heap[i].seq = _seq++;
+	_heap[i].slot = slot;
+
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (!before(&_heap[i], &_heap[parent])) {
+			break;
+		}
+
+		swap(i, parent);
+		i = parent;
+	}
+
+	return slot;
+}
+
+int CANTxQueue::pop(void)
+{
+	if (!_count) {
+		return -1;
+	}
+
+	uint8_t slot = _heap[0].slot;
+	int count = --_count;
+	int i = 0;
+
+	_free[CAN_TX_QUEUE_SIZE - 1 - count] = slot;
+	_heap[0] = _heap[count];
+
+	while (1) {
+		int child = 2 * i + 1;
+		if (child >= count) {
+			break;
+		}
+		if (child + 1 < count && before(&_heap[child + 1], &_heap[child])) {
+			child++;
+		}
+		if (!before(&_heap[child], &_heap[i])) {
+			break;
+		}
+
+		swap(i, child);
+		i = child;
+	}
+
+	return slot;
+}
@@ -0,0 +1,631 @@
+/*
+ * Copyright (c) 2023 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <sys/printk.h>
+#include <drivers/can.h>
+#include <fs/fs.h>
+#include <string.h>
+#include <stdlib.h>
+#include <shell/shell.h>
+
+#include "canbus.h"
+#include "mcp2515.h"
+#include "capture.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(capture, 3);
+
+Capture capture;
+
+K_THREAD_STACK_DEFINE(capture_io_thread_stack, CAPTURE_IO_THREAD_STACK_SIZE);
+K_THREAD_STACK_DEFINE(capture_play_thread_stack, CAPTURE_PLAY_THREAD_STACK_SIZE);
+
+// Free blocks, and blocks full of records on their way to the card or the
+// bus.  The extra full slot is for an end marker when no block is open.
+K_MSGQ_DEFINE(capture_free_msgq, sizeof(capture_block_t), CAPTURE_BLOCK_COUNT, 4);
+K_MSGQ_DEFINE(capture_full_msgq, sizeof(capture_block_t), CAPTURE_BLOCK_COUNT + 1, 4);
+
+static uint8_t capture_buffers[CAPTURE_BLOCK_COUNT][CAPTURE_BLOCK_SIZE] __aligned(4);
+
+void Capture::begin(void)
+{
+	k_mutex_init(&_mutex);
+	k_sem_init(&_io_sem, 0, 1);
+	k_sem_init(&_play_sem, 0, 1);
+	k_sem_init(&_done_sem, 0, 2);
+
+	_io_tid = k_thread_create(&_io_thread_data, capture_io_thread_stack,
+				    K_THREAD_STACK_SIZEOF(capture_io_thread_stack),
+				    capture_io_thread, NULL, NULL, NULL,
+				    CAPTURE_IO_THREAD_PRIORITY, 0, K_NO_WAIT);
+	if (!_io_tid) {
+		printk("ERROR spawning capture io thread\n");
+	}
+
+	_play_tid = k_thread_create(&_play_thread_data, capture_play_thread_stack,
+				    K_THREAD_STACK_SIZEOF(capture_play_thread_stack),
+				    capture_play_thread, NULL, NULL, NULL,
+				    CAPTURE_PLAY_THREAD_PRIORITY, 0, K_NO_WAIT);
+	if (!_play_tid) {
+		printk("ERROR spawning capture play thread\n");
+	}
+}
+
+bool Capture::openFile(const char *path, bool write)
+{
+	fs_file_t_init(&_file);
+
+	if (fs_open(&_file, path, write ? FS_O_CREATE | FS_O_WRITE : FS_O_READ) < 0) {
+		LOG_WRN("Can't open %s", log_strdup(path));
+		return false;
+	}
+
+	if (write && fs_truncate(&_file, 0) < 0) {
+		fs_close(&_file);
+		return false;
+	}
+
+	return true;
+}
+
+void Capture::resetBlocks(void)
+{
+	capture_block_t block = {};
+
+	k_msgq_purge(&capture_free_msgq);
+	k_msgq_purge(&capture_full_msgq);
+
+	for (int i = 0; i < CAPTURE_BLOCK_COUNT; i++) {
+		block.index = i;
+		k_msgq_put(&capture_free_msgq, &block, K_NO_WAIT);
+	}
+
+	_active = -1;
+	_active_len = 0;
+}
+
+bool Capture::startRecording(const char *path)
+{
+	capture_header_t header = {
+		.magic = CAPTURE_MAGIC,
+		.version = CAPTURE_VERSION,
+		.record_header = sizeof(capture_record_t),
+	};
+
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	if (_state != CAPTURE_IDLE || !openFile(path, true)) {
+		k_mutex_unlock(&_mutex);
+		return false;
+	}
+
+	if (fs_write(&_file, &header, sizeof(header)) != sizeof(header)) {
+		LOG_ERR("Can't write header to %s", log_strdup(path));
+		fs_close(&_file);
+		k_mutex_unlock(&_mutex);
+		return false;
+	}
+
+	resetBlocks();
+	k_sem_reset(&_done_sem);
+	_dropped = 0;
+	_io_mode = CAPTURE_RECORDING;
+	_state = CAPTURE_RECORDING;
+	k_sem_give(&_io_sem);
+
+	k_mutex_unlock(&_mutex);
+	return true;
+}
+
+// From the CAN RX thread.  Records go into the open block, which is handed
+// to the IO thread once another might not fit; with both blocks still on
+// their way to the card the frame is dropped rather than holding up
+// reception.
+void Capture::record(const struct zcan_frame *frame, uint32_t timestamp, uint8_t channel)
+{
+	if (_state != CAPTURE_RECORDING) {
+		return;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&_lock);
+
+	capture_record_t *record = reserve();
+	if (record) {
+		record->timestamp = timestamp;
+		record->id = frame->id | (frame->id_type == CAN_EXTENDED_IDENTIFIER ? CAPTURE_ID_EXT : 0) |
+			(frame->rtr == CAN_REMOTEREQUEST ? CAPTURE_ID_RTR : 0);
+		record->dlc = (frame->dlc & CAPTURE_DLC_MASK) | (channel << CAPTURE_CHANNEL_SHIFT);
+		memcpy(record->data, frame->data, capture_data_len(record->id, record->dlc));
+		commit(record);
+	}
+
+	k_spin_unlock(&_lock, key);
+}
+
+// From the K-line RX thread while sniffing, same rules as CAN frames
+void Capture::recordKLine(uint8_t byte, uint8_t flags, uint32_t timestamp)
+{
+	if (_state != CAPTURE_RECORDING) {
+		return;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&_lock);
+
+	capture_record_t *record = reserve();
+	if (record) {
+		record->timestamp = timestamp;
+		record->id = CAPTURE_ID_KLINE | flags;
+		record->dlc = 1;
+		record->data[0] = byte;
+		commit(record);
+	}
+
+	k_spin_unlock(&_lock, key);
+}
+
+// Both with _lock held
+capture_record_t *Capture::reserve(void)
+{
+	if (_state != CAPTURE_RECORDING) {
+		return NULL;
+	}
+
+	capture_block_t block;
+
+	if (_active < 0) {
+		if (k_msgq_get(&capture_free_msgq, &block, K_NO_WAIT) != 0) {
+			_dropped++;
+			return NULL;
+		}
+		_active = block.index;
+		_active_len = 0;
+	}
+
+	return (capture_record_t *)&capture_buffers[_active][_active_len];
+}
+
+void Capture::commit(capture_record_t *record)
+{
+	_active_len += capture_record_len(record);
+
+	if (_active_len > CAPTURE_BLOCK_SIZE - CAPTURE_RECORD_MAX) {
+		capture_block_t block;
+		block.index = _active;
+		block.flags = 0;
+		block.len = _active_len;
+		k_msgq_put(&capture_full_msgq, &block, K_NO_WAIT);
+		_active = -1;
+	}
+}
+
+void Capture::writer(void)
+{
+	capture_block_t block;
+
+	while (1) {
+		k_msgq_get(&capture_full_msgq, &block, K_FOREVER);
+
+		if (block.len && fs_write(&_file, capture_buffers[block.index], block.len) != block.len) {
+			LOG_ERR("Write failed, %u bytes lost", block.len);
+		}
+
+		if (block.index < CAPTURE_BLOCK_COUNT) {
+			k_msgq_put(&capture_free_msgq, &block, K_NO_WAIT);
+		}
+
+		if (block.flags & CAPTURE_BLOCK_LAST) {
+			break;
+		}
+	}
+
+	fs_close(&_file);
+	k_sem_give(&_done_sem);
+}
+
+bool Capture::startReplay(const char *path, const capture_replay_opts_t *opts)
+{
+	capture_header_t header;
+
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	if (_state != CAPTURE_IDLE || !openFile(path, false)) {
+		k_mutex_unlock(&_mutex);
+		return false;
+	}
+
+	if (fs_read(&_file, &header, sizeof(header)) != sizeof(header) ||
+		header.magic != CAPTURE_MAGIC || header.version < CAPTURE_VERSION_MIN || header.version > CAPTURE_VERSION ||
+		header.record_header != sizeof(capture_record_t)) {
+		LOG_WRN("Not a capture file: %s", log_strdup(path));
+		fs_close(&_file);
+		k_mutex_unlock(&_mutex);
+		return false;
+	}
+
+	memset(&_opts, 0, sizeof(_opts));
+	if (opts) {
+		_opts = *opts;
+	}
+	if (!_opts.speed) {
+		_opts.speed = CAPTURE_SPEED_REALTIME;
+	}
+	_opts.filter_count = MIN(_opts.filter_count, CAPTURE_MAX_FILTERS);
+
+	resetBlocks();
+	k_sem_reset(&_done_sem);
+	_carry_len = 0;
+	_io_mode = CAPTURE_REPLAYING;
+	_state = CAPTURE_REPLAYING;
+	k_sem_give(&_io_sem);
+	k_sem_give(&_play_sem);
+
+	k_mutex_unlock(&_mutex);
+	return true;
+}
+
+// Length of the whole records at the start of buf
+static uint16_t capture_complete(const uint8_t *buf, size_t len)
+{
+	size_t pos = 0;
+
+	while (len - pos >= sizeof(capture_record_t)) {
+		size_t next = pos + capture_record_len((const capture_record_t *)&buf[pos]);
+		if (next > len) {
+			break;
+		}
+		pos = next;
+	}
+
+	return pos;
+}
+
+// Keeps the player a block ahead.  Records run across the file's read
+// boundaries, so a partial one at the end of a read is carried over to the
+// start of the next block.  The file is closed before the last block is
+// handed over, so the player finishing means the card is free again.
+void Capture::reader(void)
+{
+	capture_block_t block;
+	uint8_t flags = 0;
+
+	while (_state == CAPTURE_REPLAYING) {
+		if (k_msgq_get(&capture_free_msgq, &block, K_MSEC(100)) != 0) {
+			continue;
+		}
+
+		uint8_t *buf = capture_buffers[block.index];
+		size_t want = CAPTURE_BLOCK_SIZE - _carry_len;
+
+		memcpy(buf, _carry, _carry_len);
+
+		ssize_t count = fs_read(&_file, &buf[_carry_len], want);
+		if (count < 0) {
+			LOG_ERR("Read failed: %d", (int)count);
+			count = 0;
+		}
+
+		size_t total = _carry_len + count;
+		block.len = capture_complete(buf, total);
+		block.flags = flags;
+		flags = 0;
+
+		_carry_len = total - block.len;
+		memcpy(_carry, &buf[block.len], _carry_len);
+
+		if (count < (ssize_t)want) {
+			// Whatever is left over at the end of the file is a torn record
+			_carry_len = 0;
+
+			// Looping an empty file would never end
+			bool empty = block.len == 0 && (block.flags & CAPTURE_BLOCK_REWIND);
+
+			if (_opts.loop && !empty &&
+				fs_seek(&_file, sizeof(capture_header_t), FS_SEEK_SET) == 0) {
+				flags = CAPTURE_BLOCK_REWIND;
+			} else {
+				fs_close(&_file);
+				block.flags |= CAPTURE_BLOCK_LAST;
+				k_msgq_put(&capture_full_msgq, &block, K_NO_WAIT);
+				k_sem_give(&_done_sem);
+				return;
+			}
+		}
+
+		k_msgq_put(&capture_full_msgq, &block, K_NO_WAIT);
+	}
+
+	fs_close(&_file);
+	k_sem_give(&_done_sem);
+}
+
+void Capture::io_thread(void)
+{
+	while (1) {
+		k_sem_take(&_io_sem, K_FOREVER);
+
+		if (_io_mode == CAPTURE_RECORDING) {
+			writer();
+		} else if (_io_mode == CAPTURE_REPLAYING) {
+			reader();
+		}
+	}
+}
+
+int64_t Capture::now(void)
+{
+	return k_ticks_to_us_floor64(k_uptime_ticks());
+}
+
+// Sleep most of the way, then spin the last stretch so the wakeup latency
+// doesn't land on the bus.  False if the replay was stopped meanwhile.
+bool Capture::waitUntil(int64_t target)
+{
+	int64_t remaining;
+
+	while ((remaining = target - now()) > CAPTURE_SPIN_US) {
+		if (_state != CAPTURE_REPLAYING) {
+			return false;
+		}
+		k_sleep(K_USEC(MIN(remaining - CAPTURE_SPIN_US, CAPTURE_SLEEP_SLICE_US)));
+	}
+
+	while (now() < target) {
+	}
+
+	return _state == CAPTURE_REPLAYING;
+}
+
+bool Capture::filter(uint32_t id)
+{
+	if (!_opts.filter_count) {
+		return true;
+	}
+
+	uint32_t key = id & (CAPTURE_ID_EXT | CAPTURE_ID_MASK);
+
+	for (int i = 0; i < _opts.filter_count; i++) {
+		if (((key ^ _opts.filters[i].id) & _opts.filters[i].mask) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Send times come from the total capture time since the first record, not
+// frame to frame, so neither rounding at other speeds nor a late frame
+// accumulates into drift.
+void Capture::play_thread(void)
+{
+	while (1) {
+		k_sem_take(&_play_sem, K_FOREVER);
+
+		capture_block_t block;
+		bool first = true;
+		uint32_t previous = 0;
+		uint64_t elapsed = 0;
+		int64_t base = 0;
+		bool last = false;
+
+		while (_state == CAPTURE_REPLAYING && !last) {
+			if (k_msgq_get(&capture_full_msgq, &block, K_MSEC(100)) != 0) {
+				continue;
+			}
+
+			if (block.flags & CAPTURE_BLOCK_REWIND) {
+				first = true;
+			}
+
+			const uint8_t *pos = capture_buffers[block.index];
+			const uint8_t *end = pos + block.len;
+
+			for (; pos < end && _state == CAPTURE_REPLAYING; pos += capture_record_len((const capture_record_t *)pos)) {
+				const capture_record_t *record = (const capture_record_t *)pos;
+
+				if (first) {
+					base = now();
+					elapsed = 0;
+					first = false;
+				} else {
+					elapsed += (uint32_t)(record->timestamp - previous);
+				}
+				previous = record->timestamp;
+
+				// K-line bytes are only there to be read back off the card
+				if ((record->id & CAPTURE_ID_KLINE) || !filter(record->id)) {
+					continue;
+				}
+
+				struct zcan_frame frame = {};
+				frame.id = record->id & CAPTURE_ID_MASK;
+				frame.id_type = (record->id & CAPTURE_ID_EXT) ? CAN_EXTENDED_IDENTIFIER : CAN_STANDARD_IDENTIFIER;
+				frame.rtr = (record->id & CAPTURE_ID_RTR) ? CAN_REMOTEREQUEST : CAN_DATAFRAME;
+				frame.dlc = MIN(record->dlc & CAPTURE_DLC_MASK, CAN_MAX_DLC);
+				memcpy(frame.data, record->data, capture_data_len(record->id, record->dlc));
+
+				if (!waitUntil(base + (int64_t)(elapsed * CAPTURE_SPEED_REALTIME / _opts.speed))) {
+					break;
+				}
+
+				// Back out on the controller it came in on, if that one is running
+				if ((record->dlc >> CAPTURE_CHANNEL_SHIFT) == CAN_CHANNEL_MCP2515) {
+					mcp2515.sendFrame(&frame, K_NO_WAIT);
+				} else {
+					canbus.sendFrame(&frame);
+				}
+			}
+
+			k_msgq_put(&capture_free_msgq, &block, K_NO_WAIT);
+
+			last = block.flags & CAPTURE_BLOCK_LAST;
+		}
+
+		// Checked in before going idle, so a new replay can't see it
+		k_sem_give(&_done_sem);
+		if (last) {
+			_state = CAPTURE_IDLE;
+		}
+	}
+}
+
+void Capture::stop(void)
+{
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	capture_state_t state = _state;
+
+	if (state == CAPTURE_RECORDING) {
+		k_spinlock_key_t key = k_spin_lock(&_lock);
+
+		// Flush whatever is in the open block, or send a bare end marker
+		capture_block_t block = {
+			.index = (uint8_t)(_active < 0 ? CAPTURE_BLOCK_COUNT : _active),
+			.flags = CAPTURE_BLOCK_LAST,
+			.len = (uint16_t)(_active < 0 ? 0 : _active_len),
+		};
+		k_msgq_put(&capture_full_msgq, &block, K_NO_WAIT);
+
+		_active = -1;
+		_state = CAPTURE_IDLE;
+		k_spin_unlock(&_lock, key);
+
+		k_sem_take(&_done_sem, K_FOREVER);
+
+		if (_dropped) {
+			LOG_WRN("Recording dropped %u frames", _dropped);
+		}
+	} else if (state == CAPTURE_REPLAYING) {
+		_state = CAPTURE_IDLE;
+		k_wakeup(_play_tid);
+
+		// Reader and player each check in once they've let go
+		k_sem_take(&_done_sem, K_FOREVER);
+		k_sem_take(&_done_sem, K_FOREVER);
+	}
+
+	k_mutex_unlock(&_mutex);
+}
+
+// Helpers
+
+void capture_init(void)
+{
+	capture.begin();
+}
+
+void capture_io_thread(void *arg1, void *arg2, void *arg3)
+{
+	ARG_UNUSED(arg1);
+	ARG_UNUSED(arg2);
+	ARG_UNUSED(arg3);
+
+	capture.io_thread();
+}
+
+void capture_play_thread(void *arg1, void *arg2, void *arg3)
+{
+	ARG_UNUSED(arg1);
+	ARG_UNUSED(arg2);
+	ARG_UNUSED(arg3);
+
+	capture.play_thread();
+}
+
+// Shell
+
+static int cmd_capture_record(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+
+	if (!capture.startRecording(argv[1])) {
+		shell_error(sh, "Can't record to %s", argv[1]);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+// Each "id <hex>[/<hex mask>] [ext]" adds a filter.  The mask only covers
+// the ID bits, standard and extended frames never match each other.
+static int cmd_capture_replay(const struct shell *sh, size_t argc, char **argv)
+{
+	capture_replay_opts_t opts = {};
+
+	for (size_t i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "loop")) {
+			opts.loop = true;
+		} else if (!strcmp(argv[i], "id")) {
+			if (++i >= argc) {
+				shell_error(sh, "id needs <hex id>[/<hex mask>]");
+				return -EINVAL;
+			}
+
+			if (opts.filter_count >= CAPTURE_MAX_FILTERS) {
+				shell_error(sh, "At most %d filters", CAPTURE_MAX_FILTERS);
+				return -EINVAL;
+			}
+
+			capture_filter_t *filter = &opts.filters[opts.filter_count++];
+			char *p;
+
+			filter->id = strtoul(argv[i], &p, 16) & CAPTURE_ID_MASK;
+			filter->mask = CAPTURE_ID_EXT | (*p == '/' ? strtoul(p + 1, NULL, 16) & CAPTURE_ID_MASK : CAPTURE_ID_MASK);
+
+			if (i + 1 < argc && !strcmp(argv[i + 1], "ext")) {
+				filter->id |= CAPTURE_ID_EXT;
+				i++;
+			}
+		} else {
+			opts.speed = strtoul(argv[i], NULL, 10);
+			if (!opts.speed) {
+				shell_error(sh, "Speed is a percentage of real time");
+				return -EINVAL;
+			}
+		}
+	}
+
+	if (!capture.startReplay(argv[1], &opts)) {
+		shell_error(sh, "Can't replay %s", argv[1]);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int cmd_capture_stop(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	capture.stop();
+	shell_print(sh, "Stopped, %u frames dropped", capture.getDropped());
+	return 0;
+}
+
+static int cmd_capture_status(const struct shell *sh, size_t argc, char **argv)
+{
+	static const char *const states[] = { "idle", "recording", "replaying" };
+
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	shell_print(sh, "%s, %u frames dropped", states[capture.getState()],
+		    capture.getDropped());
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_capture,
+	SHELL_CMD_ARG(record, NULL, "Record CAN traffic: record <path>", cmd_capture_record, 2, 0),
+	SHELL_CMD_ARG(replay, NULL, "Replay onto the bus: replay <path> [speed %] [loop] [id <hex>[/<mask>] [ext]]...",
+		      cmd_capture_replay, 2, 2 + 3 * CAPTURE_MAX_FILTERS),
+	SHELL_CMD(stop, NULL, "Stop recording or replay", cmd_capture_stop),
+	SHELL_CMD(status, NULL, "Show capture state", cmd_capture_status),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(capture, &sub_capture, "CAN capture to SD", NULL);
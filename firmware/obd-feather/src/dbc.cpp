@@ -0,0 +1,489 @@
+/*
+ * Copyright (c) 2023 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <sys/byteorder.h>
+#include <drivers/can.h>
+#include <fs/fs.h>
+#include <string.h>
+
+#include "cantraffic.h"
+#include "valuestore.h"
+#include "dbc.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(dbc, 3);
+
+DBC dbc;
+
+// Only used while loading, kept off the caller's stack
+static char dbc_line[DBC_LINE_SIZE];
+static uint8_t dbc_read_buf[DBC_READ_SIZE];
+
+static const int64_t dbc_pow10[DBC_MAX_DECIMALS + 1] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000,
+};
+
+static inline bool is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static inline bool is_name(char c)
+{
+	return is_digit(c) || c == '_' || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+static const char *skip_spaces(const char *p)
+{
+	while (*p == ' ' || *p == '\t') {
+		p++;
+	}
+	return p;
+}
+
+static bool expect(const char **pp, char c)
+{
+	const char *p = skip_spaces(*pp);
+
+	if (*p != c) {
+		return false;
+	}
+	*pp = p + 1;
+	return true;
+}
+
+static bool parse_uint(const char **pp, uint32_t *value)
+{
+	const char *p = skip_spaces(*pp);
+	uint32_t v = 0;
+
+	if (!is_digit(*p)) {
+		return false;
+	}
+
+	while (is_digit(*p)) {
+		v = v * 10 + (*p++ - '0');
+	}
+
+	*value = v;
+	*pp = p;
+	return true;
+}
+
+static bool parse_name(const char **pp, char *name, size_t size)
+{
+	const char *p = skip_spaces(*pp);
+	size_t len = 0;
+
+	while (is_name(*p)) {
+		if (len >= size - 1) {
+			return false;
+		}
+		name[len++] = *p++;
+	}
+
+	name[len] = '\0';
+	*pp = p;
+	return len != 0;
+}
+
+// Decimal text to mantissa * 10^-decimals, without going through floating
+// point.  Accepts the exponent forms some tools write ("1E-005").
+static bool parse_decimal(const char **pp, int64_t *mantissa, int *decimals)
+{
+	const char *p = skip_spaces(*pp);
+	bool negative = false;
+	bool seen = false;
+	int64_t m = 0;
+	int d = 0;
+
+	if (*p == '+' || *p == '-') {
+		negative = *p++ == '-';
+	}
+
+	for (; is_digit(*p); p++, seen = true) {
+		if (m < DBC_MANTISSA_LIMIT) {
+			m = m * 10 + (*p - '0');
+		} else {
+			d--;
+		}
+	}
+
+	if (*p == '.') {
+		for (p++; is_digit(*p); p++, seen = true) {
+			if (m < DBC_MANTISSA_LIMIT) {
+				m = m * 10 + (*p - '0');
+				d++;
+			}
+		}
+	}
+
+	if (!seen) {
+		return false;
+	}
+
+	if (*p == 'e' || *p == 'E') {
+		bool exp_negative = false;
+		int exp = 0;
+
+		p++;
+		if (*p == '+' || *p == '-') {
+			exp_negative = *p++ == '-';
+		}
+		while (is_digit(*p)) {
+			exp = exp * 10 + (*p++ - '0');
+		}
+		d += exp_negative ? exp : -exp;
+	}
+
+	while (d > 0 && m % 10 == 0) {
+		m /= 10;
+		d--;
+	}
+
+	while (d < 0 && m < DBC_MANTISSA_LIMIT) {
+		m *= 10;
+		d++;
+	}
+
+	if (d < 0) {
+		// Too big for the mantissa, "1E+20" is not 1E+17
+		return false;
+	}
+
+	*mantissa = negative ? -m : m;
+	*decimals = d < 0 ? 0 : d;
+	*pp = p;
+	return true;
+}
+
+// Bring a mantissa from one decimal exponent to another, rounding when
+// precision has to be dropped.  False if it no longer fits.
+static bool rescale(int64_t mantissa, int from, int to, int64_t *result)
+{
+	if (to >= from) {
+		int64_t mul = dbc_pow10[to - from];
+
+		if (mantissa > INT64_MAX / mul || mantissa < -(INT64_MAX / mul)) {
+			return false;
+		}
+		*result = mantissa * mul;
+		return true;
+	}
+
+	// Parsed mantissas are under 10^18, any more digits than that leave
+	// nothing
+	if (from - to > 18) {
+		*result = 0;
+		return true;
+	}
+
+	int64_t div = 1;
+	for (int i = to; i < from; i++) {
+		div *= 10;
+	}
+
+	int64_t half = mantissa < 0 ? -div / 2 : div / 2;
+	*result = (mantissa + half) / div;
+	return true;
+}
+
+// The widest raw value times the scale, plus the offset, as decode() works
+// it out.  A full 64 bit raw value only fits unscaled, so those are out.
+static bool fits(int64_t scale, int64_t offset, uint32_t length, bool is_signed)
+{
+	uint64_t raw = is_signed ? 1ULL << (length - 1) : (length == 64 ? UINT64_MAX : (1ULL << length) - 1);
+	uint64_t abs_scale = scale < 0 ? -(uint64_t)scale : scale;
+	uint64_t abs_offset = offset < 0 ? -(uint64_t)offset : offset;
+
+	if (abs_offset > INT64_MAX || raw > INT64_MAX) {
+		return false;
+	}
+
+	return !abs_scale || raw <= (INT64_MAX - abs_offset) / abs_scale;
+}
+
+bool DBC::load(const char *path)
+{
+	struct fs_file_t file;
+	ssize_t count;
+	int len = 0;
+	bool skipping = false;
+	int skipped = 0;
+
+	fs_file_t_init(&file);
+
+	if (fs_open(&file, path, FS_O_READ) < 0) {
+		LOG_WRN("No DBC at %s", log_strdup(path));
+		return false;
+	}
+
+	_ready = false;
+	_message_count = 0;
+	_signal_count = 0;
+	_collecting = false;
+
+	while ((count = fs_read(&file, dbc_read_buf, sizeof(dbc_read_buf))) > 0) {
+		for (ssize_t i = 0; i < count; i++) {
+			char c = dbc_read_buf[i];
+
+			if (c == '\n') {
+				if (!skipping) {
+					dbc_line[len] = '\0';
+					parseLine(dbc_line);
+				}
+				len = 0;
+				skipping = false;
+			} else if (c == '\r') {
+				continue;
+			} else if (len < DBC_LINE_SIZE - 1) {
+				dbc_line[len++] = c;
+			} else if (!skipping) {
+				skipping = true;
+				skipped++;
+			}
+		}
+	}
+
+	if (len && !skipping) {
+		dbc_line[len] = '\0';
+		parseLine(dbc_line);
+	}
+
+	fs_close(&file);
+
+	sort();
+
+	if (skipped) {
+		LOG_WRN("Skipped %d overlong lines", skipped);
+	}
+	LOG_INF("Loaded %u messages, %u signals", _message_count, _signal_count);
+
+	_ready = _message_count != 0;
+	return _ready;
+}
+
+void DBC::parseLine(const char *line)
+{
+	const char *p = skip_spaces(line);
+
+	if (!strncmp(p, "BO_ ", 4)) {
+		_collecting = parseMessage(p + 4);
+	} else if (!strncmp(p, "SG_ ", 4) && _collecting) {
+		parseSignal(p + 4);
+	}
+}
+
+bool DBC::parseMessage(const char *p)
+{
+	uint32_t id;
+	uint32_t dlc;
+	char name[DBC_LINE_SIZE / 4];
+
+	if (!parse_uint(&p, &id) || !parse_name(&p, name, sizeof(name)) ||
+		!expect(&p, ':') || !parse_uint(&p, &dlc)) {
+		return false;
+	}
+
+	// Skips VECTOR__INDEPENDENT_SIG_MSG and other pseudo messages
+	if ((id & ~DBC_ID_EXT) > CAN_EXT_ID_MASK || dlc > CAN_MAX_DLC) {
+		return false;
+	}
+
+	if (_message_count >= DBC_MAX_MESSAGES) {
+		LOG_WRN("Message table full at %s", log_strdup(name));
+		return false;
+	}
+
+	dbc_message_t *message = &_messages[_message_count++];
+	message->key = id;
+	message->first_signal = _signal_count;
+	message->signal_count = 0;
+	message->dlc = dlc;
+	strcpy(_message_name, name);
+
+	return true;
+}
+
+bool DBC::parseSignal(const char *p)
+{
+	char name[DBC_LINE_SIZE / 4];
+	uint32_t start;
+	uint32_t length;
+	int64_t scale;
+	int64_t offset;
+	int scale_decimals;
+	int offset_decimals;
+
+	if (!parse_name(&p, name, sizeof(name))) {
+		return false;
+	}
+
+	p = skip_spaces(p);
+	if (*p == 'm') {
+		// Multiplexed signals depend on the switch value, not decoded
+		return false;
+	}
+	if (*p == 'M') {
+		p++;
+	}
+
+	if (!expect(&p, ':') || !parse_uint(&p, &start) || !expect(&p, '|') ||
+		!parse_uint(&p, &length) || !expect(&p, '@')) {
+		return false;
+	}
+
+	bool motorola = *p == '0';
+	bool is_signed = p[1] == '-';
+	p += 2;
+
+	if (!expect(&p, '(') || !parse_decimal(&p, &scale, &scale_decimals) ||
+		!expect(&p, ',') || !parse_decimal(&p, &offset, &offset_decimals) ||
+		!expect(&p, ')')) {
+		return false;
+	}
+
+	if (length == 0 || length > 64 || start > 63) {
+		return false;
+	}
+
+	int lsb;
+	if (motorola) {
+		// DBC gives the MSB in byte-sawtooth numbering, find the LSB as a
+		// bit position in the payload read big endian.
+		int msb = 63 - ((start / 8) * 8 + 7 - (start % 8));
+		lsb = msb - (int)(length - 1);
+	} else {
+		lsb = start;
+		if (lsb + length > 64) {
+			lsb = -1;
+		}
+	}
+
+	if (lsb < 0) {
+		LOG_WRN("Bad layout for %s", log_strdup(name));
+		return false;
+	}
+
+	if (_signal_count >= DBC_MAX_SIGNALS) {
+		LOG_WRN("Signal table full at %s", log_strdup(name));
+		return false;
+	}
+
+	dbc_message_t *message = &_messages[_message_count - 1];
+	if (message->signal_count == UINT8_MAX) {
+		return false;
+	}
+
+	int decimals = MIN(MAX(scale_decimals, offset_decimals), DBC_MAX_DECIMALS);
+	int64_t signal_scale;
+	int64_t signal_offset;
+
+	if (!rescale(scale, scale_decimals, decimals, &signal_scale) ||
+		!rescale(offset, offset_decimals, decimals, &signal_offset) ||
+		!fits(signal_scale, signal_offset, length, is_signed)) {
+		LOG_WRN("Scale or offset too big for %s", log_strdup(name));
+		return false;
+	}
+
+	uint16_t index = valuestore.allocate(_message_name, name, decimals);
+	if (index == VALUESTORE_INVALID) {
+		return false;
+	}
+
+	// Reloading gets the old slot back, but two signals in one file must
+	// not share one
+	for (uint16_t i = 0; i < _signal_count; i++) {
+		if (_signals[i].value_index == index) {
+			LOG_WRN("Duplicate signal %s.%s", log_strdup(_message_name), log_strdup(name));
+			return false;
+		}
+	}
+
+	dbc_signal_t *signal = &_signals[_signal_count++];
+	signal->mask = length == 64 ? UINT64_MAX : (1ULL << length) - 1;
+	signal->scale = signal_scale;
+	signal->offset = signal_offset;
+	signal->value_index = index;
+	signal->shift = lsb;
+	signal->length = length;
+	signal->flags = (motorola ? DBC_SIGNAL_MOTOROLA : 0) | (is_signed ? DBC_SIGNAL_SIGNED : 0);
+
+	message->signal_count++;
+
+	return true;
+}
+
+void DBC::sort(void)
+{
+	for (int i = 1; i < _message_count; i++) {
+		dbc_message_t message = _messages[i];
+		int j = i - 1;
+
+		while (j >= 0 && _messages[j].key > message.key) {
+			_messages[j + 1] = _messages[j];
+			j--;
+		}
+		_messages[j + 1] = message;
+	}
+}
+
+const dbc_message_t *DBC::findMessage(uint32_t key)
+{
+	int low = 0;
+	int high = _message_count - 1;
+
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		uint32_t mid_key = _messages[mid].key;
+
+		if (mid_key == key) {
+			return &_messages[mid];
+		}
+
+		if (mid_key < key) {
+			low = mid + 1;
+		} else {
+			high = mid - 1;
+		}
+	}
+
+	return 0;
+}
+
+void DBC::decode(const struct zcan_frame *frame, uint32_t timestamp)
+{
+	if (!_ready || frame->rtr) {
+		return;
+	}
+
+	const dbc_message_t *message = findMessage(cantraffic_key(frame));
+	if (!message || frame->dlc < message->dlc) {
+		return;
+	}
+
+	uint64_t intel = sys_get_le64(frame->data);
+	uint64_t motorola = sys_get_be64(frame->data);
+
+	const dbc_signal_t *signal = &_signals[message->first_signal];
+	for (int i = 0; i < message->signal_count; i++, signal++) {
+		uint64_t word = (signal->flags & DBC_SIGNAL_MOTOROLA) ? motorola : intel;
+		uint64_t raw = (word >> signal->shift) & signal->mask;
+		uint64_t sign = (signal->flags & DBC_SIGNAL_SIGNED) ? (signal->mask >> 1) + 1 : 0;
+
+		int64_t value = (int64_t)((raw ^ sign) - sign) * signal->scale + signal->offset;
+		valuestore.set(signal->value_index, value, timestamp);
+	}
+}
+
+// Helpers
+
+void dbc_init(void)
+{
+	dbc.load(DBC_FILE_PATH);
+}
@@ -4,6 +4,7 @@
 
 #include "gpio_map.h"
 #include "j1850.h"
+#include "mcp2515.h"
 
 
 struct gpio_dt_spec gpio_input_specs[] = {
@@ -12,6 +13,11 @@ struct gpio_dt_spec gpio_input_specs[] = {
         .pin = 11,
         .dt_flags = GPIO_ACTIVE_HIGH,
     },
+    {   // MCP2515_INT (Feather A5)
+        .port = DEVICE_DT_GET(DT_NODELABEL(gpioc)),
+        .pin = 5,
+        .dt_flags = GPIO_ACTIVE_LOW,
+    },
 };
 
 const int gpio_input_count = sizeof(gpio_input_specs) / sizeof(gpio_input_specs[0]);
@@ -19,6 +25,7 @@ const int gpio_input_count = sizeof(gpio_input_specs) / sizeof(gpio_input_specs[
 struct gpio_callback *gpio_input_callbacks;
 gpio_callback_handler_t gpio_input_handlers[] = {
     j1850_rx_callback,
+    mcp2515_int_callback,
 };
 
 struct gpio_dt_spec gpio_output_specs[] = {
@@ -77,6 +84,11 @@ struct gpio_dt_spec gpio_output_specs[] = {
         .pin = 0,
         .dt_flags = GPIO_ACTIVE_HIGH,
     },
+    {   // MCP2515_CS (Feather D12)
+        .port = DEVICE_DT_GET(DT_NODELABEL(gpioc)),
+        .pin = 2,
+        .dt_flags = GPIO_ACTIVE_LOW,
+    },
 };
 
 const int gpio_output_count = sizeof(gpio_output_specs) / sizeof(gpio_output_specs[0]);
@@ -129,6 +129,9 @@ void J1850Port::rx_thread(void)
 			packet.c = length >= 5 ? buffer.data[7] : 0x00;
 			packet.d = length >= 6 ? buffer.data[8] : 0x00;
 			packet.unused = length >= 7 ? buffer.data[9] : 0x00;
+			packet.dlc = MIN(length + 1, 8);
+			packet.flags = 0;
+			packet.timestamp = obd_timestamp();
 
 			obd2.receive(&packet);
 		}
@@ -0,0 +1,617 @@
+/*
+ * Copyright (c) 2023 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <sys/printk.h>
+#include <sys/byteorder.h>
+#include <drivers/can.h>
+#include <shell/shell.h>
+#include <stdlib.h>
+
+#include "canbus.h"
+#include "j1939.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(j1939, 3);
+
+J1939 j1939;
+
+K_MSGQ_DEFINE(j1939_rx_msgq, sizeof(j1939_message_t), J1939_RX_QUEUE_SIZE, 4);
+
+K_MEM_SLAB_DEFINE(j1939_small_slab, J1939_TP_SMALL_SIZE, J1939_TP_SMALL_COUNT, 4);
+K_MEM_SLAB_DEFINE(j1939_large_slab, J1939_TP_LARGE_SIZE, J1939_TP_LARGE_COUNT, 4);
+
+void J1939::begin(void)
+{
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	_enabled = false;
+	_address = J1939_ADDR_NULL;
+	_claim_state = J1939_CLAIM_IDLE;
+	_last_poll = k_uptime_get();
+
+	for (int i = 0; i < J1939_TP_SESSION_COUNT; i++) {
+		_sessions[i].active = false;
+		_sessions[i].buffer = 0;
+	}
+
+	k_mutex_unlock(&_mutex);
+}
+
+void J1939::start(uint8_t address, uint64_t name)
+{
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	_enabled = true;
+	_address = address;
+	_name = name;
+	_claim_state = J1939_CLAIM_PENDING;
+	_claim_deadline = k_uptime_get() + J1939_CLAIM_TIMEOUT;
+	_claim_moves = 0;
+	sendAddressClaim();
+
+	k_mutex_unlock(&_mutex);
+}
+
+void J1939::stop(void)
+{
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	_enabled = false;
+	_claim_state = J1939_CLAIM_IDLE;
+
+	// Sessions we were acknowledging can't continue without an address
+	for (int i = 0; i < J1939_TP_SESSION_COUNT; i++) {
+		j1939_session_t *session = &_sessions[i];
+		if (session->active && session->respond) {
+			closeSession(session, true);
+		}
+	}
+
+	k_mutex_unlock(&_mutex);
+}
+
+bool J1939::send(uint32_t pgn, uint8_t priority, uint8_t dst, const uint8_t *data, uint8_t len)
+{
+	if (!data || len > 8) {
+		return false;
+	}
+
+	if (!_enabled || _claim_state != J1939_CLAIM_DONE) {
+		return false;
+	}
+
+	struct zcan_frame frame = {
+		.id = j1939_id(priority, pgn, dst, _address),
+		.fd = 0,
+		.rtr = CAN_DATAFRAME,
+		.id_type = CAN_EXTENDED_IDENTIFIER,
+		.dlc = len,
+	};
+	memcpy(frame.data, data, len);
+
+	return canbus.sendFrame(&frame);
+}
+
+void J1939::receive(const struct zcan_frame *frame)
+{
+	if (!frame || frame->id_type != CAN_EXTENDED_IDENTIFIER || frame->rtr) {
+		return;
+	}
+
+	uint32_t pgn = j1939_pgn(frame->id);
+
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	switch (pgn) {
+		case J1939_PGN_TP_CM:
+			handleConnection(frame);
+			break;
+
+		case J1939_PGN_TP_DT:
+			handleData(frame);
+			break;
+
+		case J1939_PGN_REQUEST:
+			handleRequest(frame);
+			deliver(pgn, j1939_priority(frame->id), j1939_source(frame->id),
+					j1939_dest(frame->id), frame->dlc, 0, frame->data);
+			break;
+
+		case J1939_PGN_ADDRESS_CLAIMED:
+			handleAddressClaim(frame);
+			deliver(pgn, j1939_priority(frame->id), j1939_source(frame->id),
+					j1939_dest(frame->id), frame->dlc, 0, frame->data);
+			break;
+
+		default:
+			deliver(pgn, j1939_priority(frame->id), j1939_source(frame->id),
+					j1939_dest(frame->id), frame->dlc, 0, frame->data);
+			break;
+	}
+
+	k_mutex_unlock(&_mutex);
+}
+
+void J1939::poll(void)
+{
+	int64_t now = k_uptime_get();
+
+	if (now - _last_poll < J1939_POLL_INTERVAL) {
+		return;
+	}
+
+	k_mutex_lock(&_mutex, K_FOREVER);
+	_last_poll = now;
+
+	for (int i = 0; i < J1939_TP_SESSION_COUNT; i++) {
+		j1939_session_t *session = &_sessions[i];
+
+		if (!session->active || now < session->deadline) {
+			continue;
+		}
+
+		LOG_INF("TP session %02X->%02X PGN %05X timed out", session->src, session->dst, session->pgn);
+		if (session->respond) {
+			sendAbort(session->src, session->pgn, 3);
+		}
+		closeSession(session, true);
+	}
+
+	if (_claim_state == J1939_CLAIM_PENDING && now >= _claim_deadline) {
+		// Nobody contended within 250ms, the address is ours.
+		_claim_state = J1939_CLAIM_DONE;
+		LOG_INF("Claimed address %02X", _address);
+	}
+
+	k_mutex_unlock(&_mutex);
+}
+
+bool J1939::read(j1939_message_t *msg, k_timeout_t timeout)
+{
+	if (!msg) {
+		return false;
+	}
+
+	return k_msgq_get(&j1939_rx_msgq, msg, timeout) == 0;
+}
+
+void J1939::release(j1939_message_t *msg)
+{
+	if (!msg || !msg->buffer) {
+		return;
+	}
+
+	freeBuffer(msg->buffer, msg->length);
+	msg->buffer = 0;
+}
+
+void J1939::deliver(uint32_t pgn, uint8_t priority, uint8_t src, uint8_t dst, uint16_t len, uint8_t *buffer, const uint8_t *data)
+{
+	j1939_message_t msg = {
+		.pgn = pgn,
+		.priority = priority,
+		.src = src,
+		.dst = dst,
+		.length = len,
+		.buffer = buffer,
+	};
+
+	if (!buffer) {
+		memcpy(msg.data, data, MIN(len, 8));
+	}
+
+	if (k_msgq_put(&j1939_rx_msgq, &msg, K_NO_WAIT) != 0 && buffer) {
+		// Nobody is draining the queue, don't leak the pool
+		freeBuffer(buffer, len);
+	}
+}
+
+void J1939::handleRequest(const struct zcan_frame *frame)
+{
+	if (frame->dlc < 3 || !_enabled || _claim_state == J1939_CLAIM_IDLE) {
+		return;
+	}
+
+	uint32_t requested = frame->data[0] | (frame->data[1] << 8) | (frame->data[2] << 16);
+	uint8_t dst = j1939_dest(frame->id);
+
+	if (requested == J1939_PGN_ADDRESS_CLAIMED && (dst == J1939_ADDR_GLOBAL || dst == _address)) {
+		sendAddressClaim();
+	}
+}
+
+void J1939::handleAddressClaim(const struct zcan_frame *frame)
+{
+	if (frame->dlc < 8 || !_enabled) {
+		return;
+	}
+
+	if (_claim_state != J1939_CLAIM_PENDING && _claim_state != J1939_CLAIM_DONE) {
+		return;
+	}
+
+	if (j1939_source(frame->id) != _address) {
+		return;
+	}
+
+	uint64_t name = sys_get_le64(frame->data);
+
+	if (name > _name) {
+		// We win, tell them so.
+		sendAddressClaim();
+		return;
+	}
+
+	if (name == _name) {
+		return;
+	}
+
+	// We lose.  Move if we're allowed to pick our own address, otherwise give
+	// up.  Once every dynamic address has been lost as well, it's Cannot
+	// Claim from the null address (J1939-81).
+	if ((_name & J1939_NAME_ARBITRARY_ADDRESS) && ++_claim_moves <= J1939_ADDR_DYNAMIC_COUNT) {
+		_address = (_address >= J1939_ADDR_DYNAMIC_FIRST && _address < J1939_ADDR_DYNAMIC_LAST) ?
+			_address + 1 : J1939_ADDR_DYNAMIC_FIRST;
+		_claim_state = J1939_CLAIM_PENDING;
+		_claim_deadline = k_uptime_get() + J1939_CLAIM_TIMEOUT;
+	} else {
+		_claim_state = J1939_CLAIM_FAILED;
+		LOG_ERR("Lost address %02X, cannot claim", _address);
+	}
+
+	sendAddressClaim();
+}
+
+void J1939::handleConnection(const struct zcan_frame *frame)
+{
+	if (frame->dlc < 8) {
+		return;
+	}
+
+	const uint8_t *data = frame->data;
+	uint8_t src = j1939_source(frame->id);
+	uint8_t dst = j1939_dest(frame->id);
+	uint32_t pgn = data[5] | (data[6] << 8) | (data[7] << 16);
+	j1939_session_t *session;
+
+	switch (data[0]) {
+		case J1939_TP_CM_RTS:
+		case J1939_TP_CM_BAM: {
+			bool bam = data[0] == J1939_TP_CM_BAM;
+			bool respond = !bam && _enabled && _claim_state == J1939_CLAIM_DONE && dst == _address;
+			uint16_t size = sys_get_le16(&data[1]);
+			uint8_t packets = data[3];
+
+			if (bam) {
+				dst = J1939_ADDR_GLOBAL;
+			}
+
+			if (size < 9 || size > J1939_TP_MAX_SIZE || packets != (size + 6) / 7) {
+				if (respond) {
+					sendAbort(src, pgn, 254);
+				}
+				return;
+			}
+
+			// A new announcement from the same pair replaces any session in progress
+			session = findSession(src, dst);
+			if (session) {
+				closeSession(session, true);
+			}
+
+			session = openSession(src, dst, size);
+			if (!session) {
+				if (respond) {
+					sendAbort(src, pgn, 1);
+				}
+				return;
+			}
+
+			session->bam = bam;
+			session->respond = respond;
+			session->pgn = pgn;
+			session->packets = packets;
+			session->next_seq = 1;
+			session->window_end = packets;
+			session->max_window = bam ? 0xFF : data[4];
+			session->deadline = k_uptime_get() + (bam ? J1939_TIMEOUT_T1 : J1939_TIMEOUT_T2);
+
+			if (respond) {
+				sendClearToSend(session);
+			}
+			break;
+		}
+
+		case J1939_TP_CM_CTS:
+			// Someone else's connection, just keep our passive copy alive.
+			session = findSession(dst, src);
+			if (session && !session->respond) {
+				session->deadline = k_uptime_get() + J1939_TIMEOUT_T2;
+			}
+			break;
+
+		case J1939_TP_CM_EOM_ACK:
+			session = findSession(dst, src);
+			if (session && !session->respond) {
+				closeSession(session, true);
+			}
+			break;
+
+		case J1939_TP_CM_ABORT:
+			session = findSession(src, dst);
+			if (!session) {
+				session = findSession(dst, src);
+			}
+			if (session) {
+				closeSession(session, true);
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+void J1939::handleData(const struct zcan_frame *frame)
+{
+	if (frame->dlc < 8) {
+		return;
+	}
+
+	uint8_t src = j1939_source(frame->id);
+	uint8_t dst = j1939_dest(frame->id);
+	j1939_session_t *session = findSession(src, dst);
+
+	if (!session) {
+		return;
+	}
+
+	uint8_t seq = frame->data[0];
+	if (seq == 0 || seq > session->packets) {
+		return;
+	}
+
+	// Retransmitted packets land in the same spot, so no need to track a bitmap
+	uint16_t offset = (seq - 1) * 7;
+	memcpy(&session->buffer[offset], &frame->data[1], MIN(7, session->size - offset));
+
+	if (seq == session->next_seq) {
+		session->next_seq++;
+	}
+	session->deadline = k_uptime_get() + J1939_TIMEOUT_T1;
+
+	if (session->next_seq > session->packets) {
+		if (session->respond) {
+			uint8_t ack[8] = {
+				J1939_TP_CM_EOM_ACK,
+				(uint8_t)(session->size & 0xFF),
+				(uint8_t)(session->size >> 8),
+				session->packets,
+				0xFF,
+				(uint8_t)(session->pgn & 0xFF),
+				(uint8_t)((session->pgn >> 8) & 0xFF),
+				(uint8_t)((session->pgn >> 16) & 0xFF),
+			};
+			sendConnection(session->src, ack);
+		}
+
+		// The buffer now belongs to whoever reads the message
+		deliver(session->pgn, j1939_priority(frame->id), session->src, session->dst,
+				session->size, session->buffer, 0);
+		closeSession(session, false);
+	} else if (session->respond && session->next_seq > session->window_end) {
+		sendClearToSend(session);
+	}
+}
+
+j1939_session_t *J1939::findSession(uint8_t src, uint8_t dst)
+{
+	for (int i = 0; i < J1939_TP_SESSION_COUNT; i++) {
+		j1939_session_t *session = &_sessions[i];
+		if (session->active && session->src == src && session->dst == dst) {
+			return session;
+		}
+	}
+	return 0;
+}
+
+j1939_session_t *J1939::openSession(uint8_t src, uint8_t dst, uint16_t size)
+{
+	for (int i = 0; i < J1939_TP_SESSION_COUNT; i++) {
+		j1939_session_t *session = &_sessions[i];
+		if (session->active) {
+			continue;
+		}
+
+		session->buffer = allocBuffer(size);
+		if (!session->buffer) {
+			return 0;
+		}
+
+		session->active = true;
+		session->src = src;
+		session->dst = dst;
+		session->size = size;
+		return session;
+	}
+	return 0;
+}
+
+void J1939::closeSession(j1939_session_t *session, bool free_buffer)
+{
+	if (free_buffer && session->buffer) {
+		freeBuffer(session->buffer, session->size);
+	}
+	session->buffer = 0;
+	session->active = false;
+}
+
+void J1939::sendConnection(uint8_t dst, const uint8_t *data)
+{
+	struct zcan_frame frame = {
+		.id = j1939_id(7, J1939_PGN_TP_CM, dst, _address),
+		.fd = 0,
+		.rtr = CAN_DATAFRAME,
+		.id_type = CAN_EXTENDED_IDENTIFIER,
+		.dlc = 8,
+	};
+	memcpy(frame.data, data, 8);
+
+	// Called from the CAN RX path, so never block on a full TX queue
+	canbus.sendFrame(&frame, K_NO_WAIT);
+}
+
+void J1939::sendClearToSend(j1939_session_t *session)
+{
+	uint8_t remaining = session->packets - session->next_seq + 1;
+	uint8_t count = MIN(remaining, session->max_window);
+
+	session->window_end = session->next_seq + count - 1;
+	session->deadline = k_uptime_get() + J1939_TIMEOUT_T2;
+
+	uint8_t cts[8] = {
+		J1939_TP_CM_CTS,
+		count,
+		session->next_seq,
+		0xFF,
+		0xFF,
+		(uint8_t)(session->pgn & 0xFF),
+		(uint8_t)((session->pgn >> 8) & 0xFF),
+		(uint8_t)((session->pgn >> 16) & 0xFF),
+	};
+	sendConnection(session->src, cts);
+}
+
+void J1939::sendAbort(uint8_t dst, uint32_t pgn, uint8_t reason)
+{
+	if (_claim_state != J1939_CLAIM_DONE) {
+		return;
+	}
+
+	uint8_t abort[8] = {
+		J1939_TP_CM_ABORT,
+		reason,
+		0xFF,
+		0xFF,
+		0xFF,
+		(uint8_t)(pgn & 0xFF),
+		(uint8_t)((pgn >> 8) & 0xFF),
+		(uint8_t)((pgn >> 16) & 0xFF),
+	};
+	sendConnection(dst, abort);
+}
+
+void J1939::sendAddressClaim(void)
+{
+	uint8_t src = _claim_state == J1939_CLAIM_FAILED ? J1939_ADDR_NULL : _address;
+
+	struct zcan_frame frame = {
+		.id = j1939_id(6, J1939_PGN_ADDRESS_CLAIMED, J1939_ADDR_GLOBAL, src),
+		.fd = 0,
+		.rtr = CAN_DATAFRAME,
+		.id_type = CAN_EXTENDED_IDENTIFIER,
+		.dlc = 8,
+	};
+
+	for (int i = 0; i < 8; i++) {
+		frame.data[i] = (uint8_t)(_name >> (8 * i));
+	}
+
+	canbus.sendFrame(&frame, K_NO_WAIT);
+}
+
+uint8_t *J1939::allocBuffer(uint16_t size)
+{
+	struct k_mem_slab *slab = size <= J1939_TP_SMALL_SIZE ? &j1939_small_slab : &j1939_large_slab;
+	void *buffer;
+
+	if (k_mem_slab_alloc(slab, &buffer, K_NO_WAIT) != 0) {
+		return 0;
+	}
+	return static_cast<uint8_t *>(buffer);
+}
+
+void J1939::freeBuffer(uint8_t *buffer, uint16_t size)
+{
+	struct k_mem_slab *slab = size <= J1939_TP_SMALL_SIZE ? &j1939_small_slab : &j1939_large_slab;
+	void *block = buffer;
+
+	k_mem_slab_free(slab, &block);
+}
+
+
+// Helpers
+
+void j1939_init(void)
+{
+	j1939.begin();
+}
+
+// Shell
+
+static int cmd_j1939_start(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+
+	uint8_t address = strtoul(argv[1], NULL, 16);
+	uint64_t name = strtoull(argv[2], NULL, 16);
+
+	j1939.start(address, name);
+	shell_print(sh, "Claiming %02X", address);
+	return 0;
+}
+
+static int cmd_j1939_stop(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(sh);
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	j1939.stop();
+	return 0;
+}
+
+static int cmd_j1939_status(const struct shell *sh, size_t argc, char **argv)
+{
+	static const char *states[] = { "idle", "pending", "claimed", "cannot claim" };
+
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	shell_print(sh, "Address %02X, %s", j1939.getAddress(), states[j1939.getClaimState()]);
+	return 0;
+}
+
+// Empties the receive queue, one line per message
+static int cmd_j1939_read(const struct shell *sh, size_t argc, char **argv)
+{
+	j1939_message_t msg;
+
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	while (j1939.read(&msg, K_NO_WAIT)) {
+		const uint8_t *data = j1939_payload(&msg);
+
+		shell_print(sh, "PGN %05X %02X->%02X prio %u len %u: %02X %02X %02X %02X...", msg.pgn,
+			    msg.src, msg.dst, msg.priority, msg.length, data[0], data[1], data[2], data[3]);
+		j1939.release(&msg);
+	}
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_j1939,
+	SHELL_CMD_ARG(start, NULL, "Claim an address: start <address> <name>, both hex", cmd_j1939_start, 3, 0),
+	SHELL_CMD(stop, NULL, "Give up the address", cmd_j1939_stop),
+	SHELL_CMD(status, NULL, "Show the claimed address", cmd_j1939_status),
+	SHELL_CMD(read, NULL, "Print and drop received messages", cmd_j1939_read),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(j1939, &sub_j1939, "J1939 node", NULL);
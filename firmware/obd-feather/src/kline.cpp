@@ -9,9 +9,18 @@
 #include <sys/printk.h>
 #include <device.h>
 #include <drivers/uart.h>
+#include <drivers/gpio.h>
+#include <fs/fs.h>
+#include <stm32_ll_gpio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <shell/shell.h>
 
 #include "gpio_map.h"
 #include "modes.h"
+#include "capture.h"
+#include "slcan.h"
 #include "kline.h"
 
 #include <logging/log.h>
@@ -19,16 +28,17 @@ LOG_MODULE_REGISTER(kline, 3);
 
 KLinePort kline;
 
-typedef struct {
-	uint8_t length;
-	uint8_t data[KLINE_BUFFER_SIZE];
-} kline_buf_t;
-
 K_THREAD_STACK_DEFINE(kline_rx_thread_stack, KLINE_RX_THREAD_STACK_SIZE);
 K_THREAD_STACK_DEFINE(kline_tx_thread_stack, KLINE_TX_THREAD_STACK_SIZE);
 
-K_MSGQ_DEFINE(kline_rx_msgq, sizeof(kline_buf_t), 32, 4);
-K_MSGQ_DEFINE(kline_tx_msgq, sizeof(kline_buf_t), 32, 4);
+K_MSGQ_DEFINE(kline_rx_msgq, sizeof(kline_chunk_t), 16, 4);
+K_MSGQ_DEFINE(kline_tx_msgq, sizeof(kline_buf_t *), KLINE_TX_QUEUE_SIZE, 4);
+K_MSGQ_DEFINE(kline_resp_msgq, sizeof(kline_buf_t *), KLINE_RESP_QUEUE_SIZE, 4);
+
+K_MEM_SLAB_DEFINE(kline_pool, sizeof(kline_buf_t), KLINE_POOL_COUNT, 4);
+
+// Rates older ECUs are known to answer at, slowest first
+static const uint32_t kline_bauds[4] = { 2400, 4800, 9600, 10400 };
 
 bool KLinePort::configure(uint32_t baud)
 {
@@ -40,7 +50,12 @@ bool KLinePort::configure(uint32_t baud)
 		.flow_ctrl = UART_CFG_FLOW_CTRL_NONE,
 	};
 
-	return uart_configure(_dev, &config) == 0;
+	if (uart_configure(_dev, &config) != 0) {
+		return false;
+	}
+
+	_byte_us = 10 * 1000000 / baud;
+	return true;
 }
 
 void KLinePort::begin(void)
@@ -58,7 +73,21 @@ void KLinePort::begin(void)
 	setMode(MODE_IDLE);
 
 	k_sem_init(&_tx_done_sem, 0, 1);
-	k_sem_init(&_rx_rdy_sem, 0, 1);
+	k_sem_init(&_resp_sem, 0, 1);
+	k_sem_init(&_echo_sem, 0, 1);
+	k_work_init_delayable(&_keepalive_work, kline_keepalive_handler);
+	k_sem_init(&_sync_sem, 0, 1);
+	k_work_init(&_cache_work, kline_cache_handler);
+
+	_rx_port = DEVICE_DT_GET(DT_NODELABEL(gpioc));
+	if (device_is_ready(_rx_port)) {
+		gpio_init_callback(&_edge_cb, kline_edge_callback, BIT(KLINE_RX_PIN));
+		gpio_add_callback(_rx_port, &_edge_cb);
+	} else {
+		_rx_port = NULL;
+	}
+
+	loadCache();
 
 	_rx_tid = k_thread_create(&_rx_thread_data, kline_rx_thread_stack,
 				    K_THREAD_STACK_SIZEOF(kline_rx_thread_stack),
@@ -85,12 +114,17 @@ void KLinePort::setMode(operation_mode_t mode)
 		return;
 	}
 
+	// A session or going idle both take the port back from the sniffer
+	stopSniffing();
+
 	_mode = mode;
 
 	if (MODE_IS_KLINE(_mode)) {
 		gpio_output_set(GPIO_KLINE_EN, true);
 		gpio_output_set(GPIO_ISO_K, true);
 
+		// Nothing is known about the bus before the transceiver was on
+		_last_activity = obd_timestamp();
 		init();
 
 		if (!_initialized) {
@@ -109,148 +143,575 @@ void KLinePort::setMode(operation_mode_t mode)
 void KLinePort::init(void)
 {
 	_initialized = false;
-	k_sleep(K_MSEC(3000));
+	_kb1 = 0;
+	_kb2 = 0;
+
+	// Fast init is always 10400, a 5-baud ECU likely answers as it did last
+	if (_mode == MODE_ISO14230_FAST_INIT || !_cache_baud) {
+		_baud = KLINE_BAUD_DEFAULT;
+	} else {
+		_baud = _cache_baud;
+	}
+
+	waitIdle();
+
+	bool ok = false;
 
 	switch (_mode) {
 		case MODE_ISO9141_5BAUD_INIT:
         case MODE_ISO14230_5BAUD_INIT:
-			init_5baud();
+			ok = init_5baud();
 			break;
 
         case MODE_ISO14230_FAST_INIT:
-			init_fast();
+			ok = init_fast();
 			break;
 
 		default:
 			break;
 	}
+
+	if (ok) {
+		// RX has been running all along, the framer starts from here
+		flushRx();
+		resetFrame();
+		_echo_len = 0;
+		_initialized = true;
+
+		if (_mode != MODE_ISO14230_FAST_INIT) {
+			LOG_INF("5-baud init at %u baud, key bytes %02X %02X", _baud, _kb1, _kb2);
+
+			if (_baud != _cache_baud || _kb1 != _cache_kb1 || _kb2 != _cache_kb2) {
+				_cache_baud = _baud;
+				_cache_kb1 = _kb1;
+				_cache_kb2 = _kb2;
+				k_work_submit(&_cache_work);
+			}
+		}
+
+		defaultTiming();
+		_tx_flags = 0;
+		k_work_reschedule(&_keepalive_work, K_MSEC(keepaliveDelay()));
+
+		if (!MODE_IS_ISO9141(_mode)) {
+			// See how fast the ECU is willing to go, the answer comes back
+			// through the RX thread.
+			requestTiming(KWP_TPI_READ_LIMITS, NULL);
+		}
+	}
 }
 
-void KLinePort::init_5baud(void)
+void KLinePort::defaultTiming(void)
 {
-	int status;
+	if (_kb2 == KWP_KB2 && (_kb1 & KWP_KB1_TP_MASK) == KWP_KB1_TP_EXTENDED) {
+		_p2max_ms = KLINE_P2MAX_EXTENDED_MS;
+		_p3min_us = 0;
+		_p4min_us = 0;
+	} else {
+		_p2max_ms = KLINE_P2MAX_NORMAL_MS;
+		_p3min_us = KLINE_P3MIN_NORMAL_US;
+		_p4min_us = KLINE_P4MIN_NORMAL_US;
+	}
 
-	_initialized = false;
+	_p3max_ms = KLINE_P3MAX_MS;
+}
 
-	if (!configure(5)) {
-		return;
+bool KLinePort::requestTiming(uint8_t tpi, const kwp_timing_t *timing)
+{
+	obd_packet_t packet = {};
+	packet.mode = _mode;
+	packet.count = timing ? 7 : 2;
+	packet.service = KWP_SID_ACCESS_TIMING_PARAMETERS;
+	packet.pid = tpi;
+
+	if (timing) {
+		packet.a = timing->p2min;
+		packet.b = timing->p2max;
+		packet.c = timing->p3min;
+		packet.d = timing->p3max;
+		packet.unused = timing->p4min;
 	}
 
+	return queue(&packet, K_NO_WAIT, 0);
+}
+
+bool KLinePort::timingResponse(uint8_t *data, int length)
+{
+	if (length >= 3 && data[0] == KWP_SID_NEGATIVE_RESPONSE && data[1] == KWP_SID_ACCESS_TIMING_PARAMETERS) {
+		LOG_INF("AccessTimingParameters refused (0x%02X), keeping defaults", data[2]);
+		return true;
+	}
+
+	if (length < 2 || data[0] != (KWP_SID_ACCESS_TIMING_PARAMETERS | KWP_POSITIVE_RESPONSE)) {
+		return false;
+	}
+
+	if (data[1] == KWP_TPI_READ_LIMITS && length >= 7) {
+		const kwp_timing_t *limits = (const kwp_timing_t *)&data[2];
+
+		// Only the minimum gaps are worth shortening.  The maxima are how
+		// long we'd wait on a silent ECU, so they stay where they are
+		// unless the ECU wants them tighter still.  P2max above 0xF0 has
+		// its own scale, which we never ask for.
+		_timing_request.p2min = limits->p2min;
+		_timing_request.p2max = MIN((_p2max_ms + 24) / 25, limits->p2max ? MIN(limits->p2max, 0xF0) : 0xF0);
+		_timing_request.p3min = limits->p3min;
+		_timing_request.p3max = MIN(_p3max_ms / 250, limits->p3max ? limits->p3max : 0xFF);
+		_timing_request.p4min = limits->p4min;
+		requestTiming(KWP_TPI_SET_VALUES, &_timing_request);
+	} else if (data[1] == KWP_TPI_SET_VALUES) {
+		// Some ECUs echo what they took, otherwise it's what we asked for
+		const kwp_timing_t *set = length >= 7 ? (const kwp_timing_t *)&data[2] : &_timing_request;
+
+		if (set->p2max) {
+			_p2max_ms = MIN(set->p2max, 0xF0) * 25;
+		}
+		_p3min_us = set->p3min * 500;
+		_p4min_us = set->p4min * 500;
+		if (set->p3max) {
+			_p3max_ms = set->p3max * 250;
+		}
+
+		LOG_INF("Timing set: P2max %ums P3min %uus P3max %ums", _p2max_ms, _p3min_us, _p3max_ms);
+		k_work_reschedule(&_keepalive_work, K_MSEC(keepaliveDelay()));
+	}
+
+	return true;
+}
+
+uint32_t KLinePort::keepaliveDelay(void)
+{
+	if (_p3max_ms > 2 * KLINE_KEEPALIVE_MARGIN_MS) {
+		return _p3max_ms - KLINE_KEEPALIVE_MARGIN_MS;
+	}
+
+	return _p3max_ms / 2;
+}
+
+void KLinePort::waitIdle(void)
+{
+	// Listen at the expected rate while waiting, so a tester or ECU that is
+	// still talking pushes the deadline out.  RX stays on from here, right
+	// through the init and the session.
+	uart_rx_disable(_dev);
+	configure(_baud);
+
+	_listening = true;
 	enable();
 
-	uint8_t cmd = 0x33;
-	uart_tx(_dev, &cmd, 1, SYS_FOREVER_MS);
-	status = k_sem_take(&_tx_done_sem, K_MSEC(3000));
-	if (status != 0) {
-		return;
+	waitQuiet(KLINE_W5_MS * 1000);
+
+	_listening = false;
+	flushRx();
+}
+
+void KLinePort::waitQuiet(uint32_t quiet_us)
+{
+	while (1) {
+		uint32_t idle = obd_timestamp() - _last_activity;
+		if (idle >= quiet_us) {
+			break;
+		}
+
+		k_sleep(K_USEC(quiet_us - idle));
 	}
+}
 
-	configure(10400);
-	uint8_t response = 0x00;
-	uart_rx_enable(_dev, &response, 1, 500);
-	status = k_sem_take(&_rx_rdy_sem, K_MSEC(500));
+bool KLinePort::init_5baud(void)
+{
+	int status;
 
-	if (response != 0x55 || status != 0) {
-		return;
+	// Our own address byte would only come back as breaks, keep RX out of it
+	uart_rx_disable(_dev);
+	if (!sendAddress(KLINE_5BAUD_ADDRESS)) {
+		enable();
+		return false;
 	}
 
-	uint8_t v1 = 0x00;
-	uart_rx_enable(_dev, &v1, 1, 20);
-	status = k_sem_take(&_rx_rdy_sem, K_MSEC(20));
-	if (status != 0) {
-		return;
+	// The sync byte is read at the rate we expect and timed as well, in
+	// case it isn't.
+	flushRx();
+	enable();
+
+	uint32_t baud = 0;
+	if (armSync()) {
+		if (k_sem_take(&_sync_sem, K_MSEC(KLINE_SYNC_TIMEOUT_MS)) == 0) {
+			baud = measureSync();
+		}
+
+		gpio_pin_interrupt_configure(_rx_port, KLINE_RX_PIN, GPIO_INT_DISABLE);
+		_sync_edges = KLINE_SYNC_EDGES;
 	}
 
+	if (baud && baud != _baud) {
+		// The sync byte came in garbled, or as a framing error that stopped
+		// RX.  Start over at the new rate, W2 leaves 5 ms before key byte 1.
+		LOG_INF("Sync byte at %u baud, expected %u", baud, _baud);
+		_baud = baud;
+		uart_rx_disable(_dev);
+		configure(_baud);
+		flushRx();
+		enable();
+	} else {
+		uint8_t response = 0x00;
+		if (!readBytes(&response, 1, K_MSEC(KLINE_SYNC_TIMEOUT_MS)) || response != 0x55) {
+			return false;
+		}
+	}
+
+	uint8_t v1 = 0x00;
 	uint8_t v2 = 0x00;
-	uart_rx_enable(_dev, &v2, 1, 20);
-	status = k_sem_take(&_rx_rdy_sem, K_MSEC(20));
-	if (status != 0) {
-		return;
+	// W2 and W3 are up to 20 ms, and RX_RDY only comes once the line is quiet
+	if (!readBytes(&v1, 1, K_MSEC(20 + KLINE_RX_TIMEOUT_MS)) || !readBytes(&v2, 1, K_MSEC(20 + KLINE_RX_TIMEOUT_MS))) {
+		return false;
 	}
 
 	if (_mode == MODE_ISO9141_5BAUD_INIT && v1 != v2) {
-		return;
+		return false;
 	}
 
+	_kb1 = v1;
+	_kb2 = v2;
+
 	k_sleep(K_MSEC(30));
 
 	v2 = ~v2;
 	uart_tx(_dev, &v2, 1, SYS_FOREVER_MS);
 	status = k_sem_take(&_tx_done_sem, K_MSEC(50));
 	if (status != 0) {
-		return;
+		return false;
 	}
 
-	uart_rx_enable(_dev, &response, 1, 50);
-	status = k_sem_take(&_rx_rdy_sem, K_MSEC(50));
-	if (response != 0xCC || status != 0) {
-		return;
+	// Our own byte comes back first, then the inverted address
+	uint8_t reply[2];
+	if (!readBytes(reply, 2, K_MSEC(50)) || reply[0] != v2 || reply[1] != 0xCC) {
+		return false;
 	}
 
 	k_sleep(K_MSEC(50));
-	_initialized = true;
+	return true;
 }
 
-void KLinePort::init_fast(void)
+bool KLinePort::init_fast(void)
 {
 	int status;
 
-	_initialized = false;
-
-	// send 25ms low/25ms high - so 50ms at 10bit/symbol = 0x0F at 200baud.
-	configure(200);
-	uint8_t cmd = 0x0F;
-	uart_tx(_dev, &cmd, 1, SYS_FOREVER_MS);
-	status = k_sem_take(&_tx_done_sem, K_MSEC(60));
-	if (status != 0) {
-		return;
+	// A 25 ms low reads as a break at 10400, keep RX out of it
+	uart_rx_disable(_dev);
+	if (!wakeup()) {
+		enable();
+		return false;
 	}
 
-	configure(10400);
-
+	// StartCommunication goes right at the end of TWuP
 	uint8_t msg[5] = {0xC1, 0x33, 0xF1, 0x81, 0x66};
+	flushRx();
+	enable();
 	uart_tx(_dev, msg, 5, SYS_FOREVER_MS);
 	status = k_sem_take(&_tx_done_sem, K_MSEC(10));
 	if (status != 0) {
+		return false;
+	}
+
+	// The echo of StartCommunication, then the answer with the key bytes
+	uint8_t response[sizeof(msg) + 7];
+	uint8_t *answer = &response[sizeof(msg)];
+	if (!readBytes(response, sizeof(response), K_MSEC(50))) {
+		return false;
+	}
+
+	if (answer[3] != 0xC1 || checksum(answer, 6) != answer[6]) {
+		return false;
+	}
+
+	_kb1 = answer[4];
+	_kb2 = answer[5];
+
+	return true;
+}
+
+bool KLinePort::armSync(void)
+{
+	if (!_rx_port) {
+		return false;
+	}
+
+	k_sem_reset(&_sync_sem);
+	_sync_edges = 0;
+
+	// Only the EXTI line is set up, the pin stays in its alternate function
+	if (gpio_pin_interrupt_configure(_rx_port, KLINE_RX_PIN, GPIO_INT_EDGE_BOTH) != 0) {
+		_sync_edges = KLINE_SYNC_EDGES;
+		return false;
+	}
+
+	return true;
+}
+
+uint32_t KLinePort::measureSync(void)
+{
+	uint32_t span = _sync_times[KLINE_SYNC_EDGES - 1] - _sync_times[0];
+	uint32_t bit = span / (KLINE_SYNC_EDGES - 1);
+
+	if (!bit) {
+		return 0;
+	}
+
+	// 0x55 toggles every bit, so anything else on the line shows up here
+	for (int i = 1; i < KLINE_SYNC_EDGES; i++) {
+		uint32_t gap = _sync_times[i] - _sync_times[i - 1];
+		if (gap < bit - bit / 4 || gap > bit + bit / 4) {
+			LOG_WRN("Sync byte edge %d is %uus off a %uus bit", i, gap, bit);
+			return 0;
+		}
+	}
+
+	uint32_t baud = (1000000 * (KLINE_SYNC_EDGES - 1) + span / 2) / span;
+	if (baud < KLINE_BAUD_MIN || baud > KLINE_BAUD_MAX) {
+		LOG_WRN("Sync byte at %u baud is out of range", baud);
+		return 0;
+	}
+
+	for (int i = 0; i < (int)ARRAY_SIZE(kline_bauds); i++) {
+		uint32_t diff = baud > kline_bauds[i] ? baud - kline_bauds[i] : kline_bauds[i] - baud;
+		if (diff * 100 <= kline_bauds[i] * KLINE_BAUD_SNAP_PERCENT) {
+			return kline_bauds[i];
+		}
+	}
+
+	return baud;
+}
+
+void KLinePort::edge_callback(void)
+{
+	uint32_t now = obd_timestamp();
+
+	if (_sniffing) {
+		if (now - _sniff_last_start < _sniff_min_start_us) {
+			return;
+		}
+
+		_sniff_last_start = now;
+
+		int next = (_sniff_head + 1) % KLINE_SNIFF_STARTS;
+		if (next != _sniff_tail) {
+			_sniff_starts[_sniff_head] = now;
+			_sniff_head = next;
+		}
 		return;
 	}
 
-	uint8_t response[6];
-	uart_rx_enable(_dev, response, 6, 10);
-	status = k_sem_take(&_rx_rdy_sem, K_MSEC(50));
-	if (response[3] != 0xC1 || status != 0) {
+	if (_sync_edges >= KLINE_SYNC_EDGES) {
 		return;
 	}
 
-	_initialized = true;
+	_sync_times[_sync_edges++] = now;
+
+	if (_sync_edges == KLINE_SYNC_EDGES) {
+		k_sem_give(&_sync_sem);
+	}
+}
+
+void KLinePort::loadCache(void)
+{
+	struct fs_file_t file;
+	char buf[KLINE_CACHE_SIZE];
+	ssize_t count;
+
+	fs_file_t_init(&file);
+
+	if (fs_open(&file, KLINE_CACHE_PATH, FS_O_READ) < 0) {
+		LOG_INF("No K-line cache at %s", log_strdup(KLINE_CACHE_PATH));
+		return;
+	}
+
+	count = fs_read(&file, buf, sizeof(buf) - 1);
+	fs_close(&file);
+
+	if (count <= 0) {
+		return;
+	}
+
+	buf[count] = '\0';
+
+	char *p;
+	uint32_t baud = strtoul(buf, &p, 10);
+	uint8_t kb1 = strtoul(p, &p, 16);
+	uint8_t kb2 = strtoul(p, &p, 16);
+
+	if (baud < KLINE_BAUD_MIN || baud > KLINE_BAUD_MAX) {
+		LOG_WRN("Bad K-line cache at %s", log_strdup(KLINE_CACHE_PATH));
+		return;
+	}
+
+	_cache_baud = baud;
+	_cache_kb1 = kb1;
+	_cache_kb2 = kb2;
+
+	LOG_INF("Cached 5-baud rate %u, key bytes %02X %02X", baud, kb1, kb2);
+}
+
+void KLinePort::saveCache(void)
+{
+	struct fs_file_t file;
+	char buf[KLINE_CACHE_SIZE];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%u %02X %02X\n", _cache_baud, _cache_kb1, _cache_kb2);
+
+	fs_file_t_init(&file);
+
+	if (fs_open(&file, KLINE_CACHE_PATH, FS_O_CREATE | FS_O_WRITE) < 0) {
+		LOG_WRN("Can't open %s", log_strdup(KLINE_CACHE_PATH));
+		return;
+	}
+
+	if (fs_truncate(&file, 0) < 0 || fs_write(&file, buf, len) != len) {
+		LOG_WRN("Can't write %s", log_strdup(KLINE_CACHE_PATH));
+	}
+
+	fs_close(&file);
+}
+
+bool KLinePort::wakeup(void)
+{
+	const struct device *port = takeTxPin();
+
+	if (!port) {
+		return false;
+	}
+
+	uint32_t start = obd_timestamp();
+	edgeAt(port, start, 0);
+	edgeAt(port, start + KLINE_TINIL_US, 1);
+	edgeAt(port, start + KLINE_TWUP_US, 1);
+
+	returnTxPin();
+	return true;
+}
+
+// Start bit, eight data bits LSB first and the stop bit, 200ms each.  The
+// pin goes back to the UART at the start of the stop bit, which is idle
+// anyway, so the sync byte can come right after it.
+bool KLinePort::sendAddress(uint8_t address)
+{
+	const struct device *port = takeTxPin();
+
+	if (!port) {
+		return false;
+	}
+
+	uint16_t bits = (address << 1) | 0x200;
+	uint32_t start = obd_timestamp();
+	for (int i = 0; i < 10; i++) {
+		edgeAt(port, start + i * KLINE_5BAUD_BIT_US, (bits >> i) & 1);
+	}
+
+	returnTxPin();
+	return true;
+}
+
+// Take the pin from the UART at its idle level, so nothing moves yet.  The
+// output type stays as the pinmux had it.
+const struct device *KLinePort::takeTxPin(void)
+{
+	const struct device *port = DEVICE_DT_GET(DT_NODELABEL(gpioc));
+
+	if (!device_is_ready(port)) {
+		return NULL;
+	}
+
+	_tx_pin.otype = LL_GPIO_GetPinOutputType(GPIOC, LL_GPIO_PIN_6);
+	_tx_pin.pull = LL_GPIO_GetPinPull(GPIOC, LL_GPIO_PIN_6);
+	_tx_pin.speed = LL_GPIO_GetPinSpeed(GPIOC, LL_GPIO_PIN_6);
+	_tx_pin.af = LL_GPIO_GetAFPin_0_7(GPIOC, LL_GPIO_PIN_6);
+
+	gpio_flags_t flags = GPIO_OUTPUT_HIGH;
+	if (_tx_pin.otype == LL_GPIO_OUTPUT_OPENDRAIN) {
+		flags |= GPIO_OPEN_DRAIN;
+	}
+
+	if (gpio_pin_configure(port, KLINE_TX_PIN, flags) != 0) {
+		returnTxPin();
+		return NULL;
+	}
+
+	return port;
+}
+
+// Everything gpio_pin_configure() touched goes back before the mode, so the
+// UART gets the pin back exactly as the pinmux left it.
+void KLinePort::returnTxPin(void)
+{
+	LL_GPIO_SetAFPin_0_7(GPIOC, LL_GPIO_PIN_6, _tx_pin.af);
+	LL_GPIO_SetPinOutputType(GPIOC, LL_GPIO_PIN_6, _tx_pin.otype);
+	LL_GPIO_SetPinPull(GPIOC, LL_GPIO_PIN_6, _tx_pin.pull);
+	LL_GPIO_SetPinSpeed(GPIOC, LL_GPIO_PIN_6, _tx_pin.speed);
+	LL_GPIO_SetPinMode(GPIOC, LL_GPIO_PIN_6, LL_GPIO_MODE_ALTERNATE);
+	_last_activity = obd_timestamp();
+}
+
+void KLinePort::edgeAt(const struct device *port, uint32_t target, int value)
+{
+	int32_t remaining = target - obd_timestamp();
+
+	if (remaining > KLINE_SPIN_US) {
+		k_sleep(K_USEC(remaining - KLINE_SPIN_US));
+	}
+
+	unsigned int key = irq_lock();
+	while ((int32_t)(target - obd_timestamp()) > 0) {
+	}
+
+	gpio_pin_set_raw(port, KLINE_TX_PIN, value);
+	irq_unlock(key);
+}
+
+bool KLinePort::readBytes(uint8_t *buf, int count, k_timeout_t timeout)
+{
+	while (count) {
+		if (_chunk_pos >= _chunk.length) {
+			if (k_msgq_get(&kline_rx_msgq, &_chunk, timeout) != 0) {
+				return false;
+			}
+
+			_chunk_pos = 0;
+			continue;
+		}
+
+		*(buf++) = _chunk.data[_chunk_pos++];
+		count--;
+	}
+
+	return true;
+}
+
+void KLinePort::flushRx(void)
+{
+	k_msgq_purge(&kline_rx_msgq);
+	_chunk.length = 0;
+	_chunk_pos = 0;
 }
 
 void KLinePort::disable(void)
 {
+	k_work_cancel_delayable(&_keepalive_work);
 	uart_tx_abort(_dev);
 	uart_rx_disable(_dev);
-
-	uart_irq_err_disable(_dev);
-	uart_irq_rx_disable(_dev);
-	uart_irq_tx_disable(_dev);
 	_initialized = false;
 }
 
 void KLinePort::enable(void)
 {
 	_rx_index = 0;
-	uart_rx_enable(_dev, _rx_buffers[_rx_index], KLINE_BUFFER_SIZE, 15);
-
-	uart_irq_rx_enable(_dev);
-	uart_irq_tx_enable(_dev);
-	uart_irq_err_enable(_dev);
+	uart_rx_enable(_dev, _rx_buffers[_rx_index], KLINE_DMA_BUFFER_SIZE, KLINE_RX_TIMEOUT_MS);
 }
 
 
-uint8_t KLinePort::checksum(uint8_t *buffer, uint8_t len)
+uint8_t KLinePort::checksum(uint8_t *buffer, int len)
 {
 	uint8_t sum = 0;
-	for (uint8_t i = 0; i < len; i++) {
+	for (int i = 0; i < len; i++) {
 		sum += *(buffer++);
 	}
 	return sum;
@@ -258,73 +719,414 @@ uint8_t KLinePort::checksum(uint8_t *buffer, uint8_t len)
 
 void KLinePort::rx_thread(void)
 {
-	kline_buf_t buffer;
-	obd_packet_t packet;
+	kline_chunk_t chunk;
 	int status;
-	int length;
-	uint8_t sum;
 
 	while (1) {
-		status = k_msgq_get(&kline_rx_msgq, &buffer, K_MSEC(100));
+		if (_rx_stopped) {
+			// The driver has turned RX off, start the session over
+			_rx_stopped = false;
+
+			if (_sniffing) {
+				sniffBreak();
+			} else if (MODE_IS_KLINE(_mode)) {
+				_reinits++;
+				LOG_INF("Session lost, re-init (%u keep-alives sent so far)", _keepalives);
+				init();
+			}
+			continue;
+		}
+
+		if (_rx_relisten) {
+			// Stopped during waitIdle(), which has to go on hearing the
+			// line.  The break already pushed its deadline out.
+			_rx_relisten = false;
+			enable();
+			continue;
+		}
+
+		if (_sniffing) {
+			sniff();
+			continue;
+		}
 
-		if (status == 0 && MODE_IS_KLINE(_mode) && _initialized) {
-			sum = checksum(buffer.data, buffer.length);
-			if (sum != buffer.data[buffer.length]) {
-				// Bad checksum.  Chuck it.
-				continue;
+		if (_sniff_count) {
+			// Stopped with a frame still open
+			sniffEnd();
+			continue;
+		}
+
+		if (!MODE_IS_KLINE(_mode) || !_initialized) {
+			// The init owns the byte stream until the session is up
+			k_sleep(K_MSEC(10));
+			continue;
+		}
+
+		// Mid-frame, wake up in time to close it on the inter-byte gap
+		k_timeout_t timeout = K_MSEC(100);
+		uint32_t wait = frameWait();
+		if (_framer.isOpen()) {
+			uint32_t age = obd_timestamp() - _framer.getLast();
+			timeout = age >= wait ? K_NO_WAIT : K_USEC(wait - age + 1);
+		}
+
+		status = k_msgq_get(&kline_rx_msgq, &chunk, timeout);
+
+		if (status == 0) {
+			// Bytes in one chunk came less than the RX timeout apart, so
+			// they're taken as back to back up to its last
+			for (int i = 0; i < chunk.length; i++) {
+				uint32_t end = chunk.end - (chunk.length - 1 - i) * _byte_us;
+
+				if (!cancelEcho(chunk.data[i], end)) {
+					_framer.feed(chunk.data[i], end);
+				}
 			}
+		} else if (_framer.isOpen() && obd_timestamp() - _framer.getLast() >= wait) {
+			_framer.close();
+		}
+	}
+}
+
+bool KLinePort::startSniffing(uint32_t baud)
+{
+	stopSniffing();
+
+	if (MODE_IS_KLINE(_mode) || !_rx_port || baud < KLINE_BAUD_MIN || baud > KLINE_BAUD_MAX) {
+		return false;
+	}
+
+	gpio_output_set(GPIO_KLINE_EN, true);
+	gpio_output_set(GPIO_ISO_K, true);
+
+	uart_rx_disable(_dev);
+	if (!configure(baud)) {
+		gpio_output_set(GPIO_KLINE_EN, false);
+		gpio_output_set(GPIO_ISO_K, false);
+		return false;
+	}
+
+	_baud = baud;
+	_sniff_byte_us = 10 * 1000000 / baud;
+	_sniff_min_start_us = 95 * 100000 / baud;
+	_sniff_last_start = obd_timestamp() - _sniff_min_start_us;
+	_sniff_head = 0;
+	_sniff_tail = 0;
+	_sniff_bytes = 0;
+	_sniff_frames = 0;
+	_sniff_unmatched = 0;
+	flushRx();
+
+	_sniffing = true;
+	gpio_pin_interrupt_configure(_rx_port, KLINE_RX_PIN, GPIO_INT_EDGE_FALLING);
+	enable();
+
+	LOG_INF("Sniffing at %u baud", baud);
+	return true;
+}
+
+void KLinePort::stopSniffing(void)
+{
+	if (!_sniffing) {
+		return;
+	}
 
-			if (buffer.data[2] == 0xF1) {
-				// This is a message we just sent.  Chuck it.  Gotta love half-duplex.
-				continue;
+	_sniffing = false;
+	gpio_pin_interrupt_configure(_rx_port, KLINE_RX_PIN, GPIO_INT_DISABLE);
+	uart_rx_disable(_dev);
+
+	if (!MODE_IS_KLINE(_mode)) {
+		gpio_output_set(GPIO_KLINE_EN, false);
+		gpio_output_set(GPIO_ISO_K, false);
+	}
+
+	LOG_INF("Sniffer: %u bytes in %u frames, %u without a start bit", _sniff_bytes, _sniff_frames,
+		_sniff_unmatched);
+}
+
+void KLinePort::sniff(void)
+{
+	kline_chunk_t chunk;
+
+	// A byte inside P1max can still be waiting on the RX timeout, so the
+	// frame is only closed once that is over as well
+	uint32_t gap = KLINE_P1MAX_MS * 1000 + _sniff_byte_us + KLINE_RX_TIMEOUT_MS * 1000;
+	k_timeout_t timeout = K_MSEC(100);
+	if (_sniff_count) {
+		uint32_t age = obd_timestamp() - _sniff_held.timestamp;
+		timeout = age >= gap ? K_NO_WAIT : K_USEC(gap - age + 1);
+	}
+
+	if (k_msgq_get(&kline_rx_msgq, &chunk, timeout) != 0) {
+		if (_sniff_count && obd_timestamp() - _sniff_held.timestamp >= gap) {
+			sniffEnd();
+		}
+		return;
+	}
+
+	for (int i = 0; i < chunk.length; i++) {
+		uint32_t timestamp;
+		uint8_t flags = 0;
+
+		if (_sniff_tail != _sniff_head) {
+			timestamp = _sniff_starts[_sniff_tail];
+			_sniff_tail = (_sniff_tail + 1) % KLINE_SNIFF_STARTS;
+		} else {
+			// Back to back with the last byte, or counted back from RX_RDY
+			if (_sniff_count) {
+				timestamp = _sniff_held.timestamp + _sniff_byte_us;
+			} else {
+				timestamp = chunk.end - (chunk.length - i) * _sniff_byte_us;
 			}
+			flags = KLINE_SNIFF_ESTIMATED;
+			_sniff_unmatched++;
+		}
+
+		sniffByte(chunk.data[i], timestamp, flags);
+	}
 
-			length = buffer.length - 3;
-			packet.mode = _mode;
-			packet.count = length;
-			packet.service = buffer.data[3];
-			packet.pid = buffer.data[4];
-			packet.a = length >= 3 ? buffer.data[5] : 0x00;
-			packet.b = length >= 4 ? buffer.data[6] : 0x00;
-			packet.c = length >= 5 ? buffer.data[7] : 0x00;
-			packet.d = length >= 6 ? buffer.data[8] : 0x00;
-			packet.unused = length >= 7 ? buffer.data[9] : 0x00;
+	// Any byte still to come started after RX_RDY, give or take the one
+	// that filled a buffer.  Older edges were glitches.
+	while (_sniff_tail != _sniff_head &&
+	       (int32_t)(chunk.timestamp - _sniff_starts[_sniff_tail]) > (int32_t)(2 * _sniff_byte_us)) {
+		_sniff_tail = (_sniff_tail + 1) % KLINE_SNIFF_STARTS;
+	}
+}
 
-			obd2.receive(&packet);
+void KLinePort::sniffByte(uint8_t byte, uint32_t timestamp, uint8_t flags)
+{
+	if (_sniff_count) {
+		int32_t gap = timestamp - _sniff_held.timestamp - _sniff_byte_us;
+
+		if (gap > KLINE_P1MAX_MS * 1000) {
+			sniffEnd();
+		} else {
+			_sniff_sum += _sniff_held.byte;
+			sniffOut(&_sniff_held);
+		}
+	}
+
+	if (!_sniff_count) {
+		flags |= KLINE_SNIFF_START;
+		_sniff_sum = 0;
+		_sniff_header = 0;
+		_sniff_expected = 0;
+	}
+
+	_sniff_held.timestamp = timestamp;
+	_sniff_held.byte = byte;
+	_sniff_held.flags = flags;
+	_sniff_count++;
+
+	// KWP headers say how long the frame is, ISO 9141 ones don't
+	if (_sniff_count == 1) {
+		uint8_t address = byte & KWP_FMT_ADDRESS_MASK;
+		uint8_t len = byte & KWP_FMT_LENGTH_MASK;
+
+		if (address != KWP_FMT_CARB) {
+			_sniff_header = address ? 3 : 1;
+			if (len) {
+				_sniff_expected = _sniff_header + len + 1;
+			}
 		}
+	} else if (_sniff_header && !_sniff_expected && _sniff_count == _sniff_header + 1) {
+		_sniff_expected = _sniff_count + byte + 1;
+	}
+
+	if (_sniff_count == _sniff_expected && _sniff_sum == byte) {
+		sniffEnd();
 	}
 }
 
-void KLinePort::rx_ready_callback(uint8_t *buf, uint8_t offset, uint8_t len)
+void KLinePort::sniffBreak(void)
 {
-	if (!_initialized) {
-		k_sem_give(&_rx_rdy_sem);
+	// A fast init wakeup, a 5-baud address or a collision.  The edge that
+	// started it is the only one worth keeping.
+	sniffEnd();
+	_sniff_tail = _sniff_head;
+
+	kline_sniff_t sniffed = {
+		.timestamp = _sniff_last_start,
+		.byte = 0,
+		.flags = KLINE_SNIFF_BREAK | KLINE_SNIFF_START | KLINE_SNIFF_END,
+	};
+	sniffOut(&sniffed);
+
+	enable();
+}
+
+void KLinePort::sniffEnd(void)
+{
+	if (!_sniff_count) {
 		return;
 	}
 
-	kline_buf_t buffer;
-	buffer.length = len;
-	memcpy(buffer.data, &buf[offset], len);
-	k_msgq_put(&kline_rx_msgq, &buffer, K_NO_WAIT);
+	_sniff_held.flags |= KLINE_SNIFF_END;
+	if (_sniff_count > 1 && _sniff_sum == _sniff_held.byte) {
+		_sniff_held.flags |= KLINE_SNIFF_CHECKSUM;
+	}
 
-	if (offset + len >= KLINE_BUFFER_SIZE - 11) {
-		// Want to be sure not to receive a partial frame due to hitting the end
-		// of the buffer.  I wish zephyr would let me just invalidate the buffer
-		// itself, but alas.
-		uart_rx_disable(_dev);
-		uart_rx_enable(_dev, _rx_buffers[_rx_index], KLINE_BUFFER_SIZE, 15);
+	sniffOut(&_sniff_held);
+	_sniff_count = 0;
+	_sniff_frames++;
+}
+
+void KLinePort::sniffOut(const kline_sniff_t *sniffed)
+{
+	_sniff_bytes++;
+	capture.recordKLine(sniffed->byte, sniffed->flags, sniffed->timestamp);
+	slcan.forwardKLine(sniffed->byte, sniffed->flags, sniffed->timestamp);
+}
+
+bool KLinePort::cancelEcho(uint8_t byte, uint32_t timestamp)
+{
+	if (_echo_pos >= _echo_len || (int32_t)(timestamp - _echo_start) < 0) {
+		return false;
+	}
+
+	if (byte != _echo->data[_echo_pos]) {
+		// Collided with another sender.  What follows is garbled, so drop
+		// it up to the next gap.
+		_echo_len = 0;
+		_echo_pos = 0;
+		_echo_collision = true;
+		_collisions++;
+		_framer.skip();
+		k_sem_give(&_echo_sem);
+		return true;
+	}
+
+	if (++_echo_pos == _echo_len) {
+		_echo_len = 0;
+		_echo_pos = 0;
+		k_sem_give(&_echo_sem);
 	}
+
+	return true;
 }
 
-void KLinePort::rx_buf_request_callback(void)
+void KLinePort::resetFrame(void)
+{
+	_framer.reset();
+	_framer.setHeaderless(MODE_IS_ISO9141(_mode));
+	_framer.setTiming(_byte_us, KLINE_P1MAX_MS * 1000 + KLINE_GAP_SLACK_US);
+}
+
+// How long after the last byte an open frame can be closed.  A byte that
+// carries it on only shows up once its buffer fills or the line has been
+// idle for the RX timeout, so P1max alone would cut long frames.
+uint32_t KLinePort::frameWait(void)
+{
+	return KLINE_P1MAX_MS * 1000 + KLINE_GAP_SLACK_US + (KLINE_DMA_BUFFER_SIZE + 1) * _byte_us +
+	       KLINE_RX_TIMEOUT_MS * 1000;
+}
+
+void KLinePort::rxFrame(const uint8_t *data, int length, int header)
+{
+	kline_buf_t *frame;
+
+	if (k_mem_slab_alloc(&kline_pool, (void **)&frame, K_NO_WAIT) != 0) {
+		_rx_dropped++;
+		return;
+	}
+
+	memcpy(frame->data, data, length + 1);
+	frame->length = length;
+	frame->header = header;
+	processFrame(frame);
+}
+
+void KLinePort::processFrame(kline_buf_t *buffer)
+{
+	obd_packet_t packet;
+	uint8_t *payload = &buffer->data[buffer->header];
+	int length = buffer->length - buffer->header;
+
+	if (length < 1) {
+		release(buffer);
+		return;
+	}
+
+	_resp_pending = length >= 3 && payload[0] == KWP_SID_NEGATIVE_RESPONSE &&
+			payload[2] == KWP_NRC_RESPONSE_PENDING;
+	k_sem_give(&_resp_sem);
+
+	if ((_tx_flags & KLINE_BUF_KEEPALIVE) &&
+		(payload[0] == 0x41 || payload[0] == (KWP_SID_TESTER_PRESENT | KWP_POSITIVE_RESPONSE))) {
+		// An answer to our own keep-alive, nobody asked for it
+		release(buffer);
+		return;
+	}
+
+	if (timingResponse(payload, length)) {
+		release(buffer);
+		return;
+	}
+
+	if (_requesting && k_msgq_put(&kline_resp_msgq, &buffer, K_NO_WAIT) == 0) {
+		// request() has it now
+		return;
+	}
+
+	if (length > 7) {
+		// Too long for a packet, and nobody is waiting on it
+		LOG_DBG("Dropped %d byte response to 0x%02X", length, payload[0]);
+		release(buffer);
+		return;
+	}
+
+	// Functional requests get an answer from every ECU that has one, the
+	// source address says which is which
+	packet.mode = _mode;
+	packet.id = buffer->header >= 3 ? buffer->data[2] : 0;
+	packet.count = length;
+	packet.service = payload[0];
+	packet.pid = length >= 2 ? payload[1] : 0x00;
+	packet.a = length >= 3 ? payload[2] : 0x00;
+	packet.b = length >= 4 ? payload[3] : 0x00;
+	packet.c = length >= 5 ? payload[4] : 0x00;
+	packet.d = length >= 6 ? payload[5] : 0x00;
+	packet.unused = length >= 7 ? payload[6] : 0x00;
+	packet.dlc = MIN(length + 1, 8);
+	packet.flags = 0;
+	packet.timestamp = obd_timestamp();
+	release(buffer);
+
+	_responses++;
+	obd2.receive(&packet);
+}
+
+void KLinePort::rx_ready_callback(uint8_t *buf, uint8_t offset, uint8_t len)
 {
-	if (!_initialized) {
+	_last_activity = obd_timestamp();
+
+	if (_listening) {
 		return;
 	}
 
+	kline_chunk_t chunk;
+	chunk.timestamp = _last_activity;
+	chunk.length = len;
+
+	// Straight away when the buffer fills, otherwise once the line has been
+	// idle for a byte and then the RX timeout
+	chunk.end = chunk.timestamp;
+	if (offset + len < KLINE_DMA_BUFFER_SIZE) {
+		chunk.end -= KLINE_RX_TIMEOUT_MS * 1000 + _byte_us;
+	}
+	memcpy(chunk.data, &buf[offset], len);
+
+	if (k_msgq_put(&kline_rx_msgq, &chunk, K_NO_WAIT) != 0) {
+		_rx_dropped++;
+	}
+}
+
+void KLinePort::rx_buf_request_callback(void)
+{
+	// Always have the next buffer ready, so RX never stops between them
 	_rx_index++;
 	_rx_index %= KLINE_BUFFER_COUNT;
-	uart_rx_buf_rsp(_dev, _rx_buffers[_rx_index], KLINE_BUFFER_SIZE);
+	uart_rx_buf_rsp(_dev, _rx_buffers[_rx_index], KLINE_DMA_BUFFER_SIZE);
 }
 
 void KLinePort::rx_buf_released_callback(uint8_t *buf)
@@ -343,68 +1145,321 @@ void KLinePort::rx_stopped_callback(uint8_t *buf, uint8_t offset, uint8_t len, e
 	ARG_UNUSED(offset);
 	ARG_UNUSED(reason);
 
-	// Just start it back up if we are still supposed to be running
+	// A framing error or break is traffic as far as the idle time goes
+	_last_activity = obd_timestamp();
+
+	// Just start it back up if we are still supposed to be running.  This
+	// is interrupt context, so the RX thread does the init.
 	if (_initialized && MODE_IS_KLINE(_mode)) {
 		_initialized = false;
-		init();
+		_rx_stopped = true;
+	} else if (_sniffing) {
+		_rx_stopped = true;
+	} else if (_listening) {
+		_rx_relisten = true;
 	}
 }
 
 void KLinePort::tx_thread(void)
 {
-	kline_buf_t buffer;
+	kline_buf_t *buffer;
 	int status;
 	int sent;
 
 	while (1) {
 		status = k_msgq_get(&kline_tx_msgq, &buffer, K_MSEC(100));
+		if (status != 0) {
+			continue;
+		}
+
+		if (!MODE_IS_KLINE(_mode) || !_initialized) {
+			release(buffer);
+			continue;
+		}
+
+		_tx_flags = buffer->flags;
+		_responses = 0;
 
-		if (status == 0 && MODE_IS_KLINE(_mode) && _initialized) {
-			status = uart_tx(_dev, buffer.data, buffer.length + 1, SYS_FOREVER_MS);
+		// Only the one ECU answers a physical request
+		bool physical = !MODE_IS_ISO9141(_mode) &&
+				(buffer->data[0] & KWP_FMT_ADDRESS_MASK) == KWP_FMT_PHYSICAL;
+
+		// RX_RDY only shows up every DMA buffer or once the line goes idle
+		uint32_t buffer_ms = KLINE_DMA_BUFFER_SIZE * _byte_us / 1000 + KLINE_RX_TIMEOUT_MS;
+
+		for (int attempt = 0; attempt < KLINE_TX_ATTEMPTS; attempt++) {
+			k_sem_reset(&_resp_sem);
+			k_sem_reset(&_echo_sem);
+			_resp_pending = false;
+			_echo = buffer;
+			_echo_collision = false;
+			_echo_pos = 0;
+			_echo_start = obd_timestamp();
+			_echo_len = buffer->length + 1;
+
+			status = uart_tx(_dev, buffer->data, buffer->length + 1, SYS_FOREVER_MS);
 			k_sem_take(&_tx_done_sem, K_FOREVER);
 			sent = _tx_sent;
 
-			k_sleep(K_MSEC(30));
+			// The last of the echo comes with the RX_RDY after it.  An ECU
+			// answering straight away keeps the line busy and holds that
+			// back, so keep waiting while bytes are still arriving, up to
+			// P2max and a buffer past the end of the request.
+			int64_t deadline = k_uptime_get() + _p2max_ms + buffer_ms;
+			uint32_t echo_seen = _last_activity;
+
+			while (k_sem_take(&_echo_sem, K_MSEC(buffer_ms)) != 0) {
+				if (_last_activity == echo_seen || k_uptime_get() >= deadline) {
+					// The line went quiet, or stayed busy past P2max,
+					// without the whole echo.  No byte differed, so it
+					// isn't a collision and going again wouldn't help.
+					LOG_WRN("Echo of the request incomplete");
+					_echo_len = 0;
+					break;
+				}
+				echo_seen = _last_activity;
+			}
+
+			if (!_echo_collision) {
+				break;
+			}
+
+			// Let whoever we ran into finish before going again
+			LOG_DBG("Collision on attempt %d", attempt + 1);
+			waitQuiet(MAX(_p3min_us, KLINE_P1MAX_MS * 1000));
+		}
+
+		_echo_len = 0;
+		release(buffer);
+
+		// Any request restarts the ECU's P3max, so real traffic keeps
+		// pushing the keep-alive back and it never goes out.
+		k_work_reschedule(&_keepalive_work, K_MSEC(keepaliveDelay()));
+
+		// Each ECU that answers starts within P2max of the request or of the
+		// answer before it, so for a functional request the window stays
+		// open while answers keep coming.  A physical request is done with
+		// the first answer, unless that's a response pending, which gives
+		// the ECU until P3max.  An answer still coming in (the activity
+		// time moved on, its RX_RDY isn't due yet) holds the window open
+		// too.  The next
+		// request may go as soon as the line has then been quiet for P3min.
+		uint32_t wait_ms = _p2max_ms;
+		uint32_t seen = _last_activity;
+
+		while (1) {
+			if (k_sem_take(&_resp_sem, K_MSEC(wait_ms + buffer_ms)) == 0) {
+				if (_resp_pending) {
+					wait_ms = _p3max_ms;
+				} else if (physical) {
+					break;
+				} else {
+					wait_ms = _p2max_ms;
+				}
+			} else if (_last_activity != seen) {
+				wait_ms = KLINE_P1MAX_MS;
+			} else {
+				break;
+			}
+			seen = _last_activity;
+		}
+
+		if (_tx_flags & KLINE_BUF_NOTIFY) {
+			obd2.complete(_responses);
 		}
+
+		_tx_flags = 0;
+		waitQuiet(_p3min_us);
 	}
 }
 
 void KLinePort::tx_done_callback(int sent)
 {
 	_tx_sent = sent;
+	_last_activity = obd_timestamp();
 	k_sem_give(&_tx_done_sem);
 }
 
 bool KLinePort::send(obd_packet_t *packet)
 {
-	kline_buf_t buffer;
-	int length;
-
 	if (!packet) {
 		return false;
 	}
 
-	length = packet->count;
+	return queue(packet, K_FOREVER, KLINE_BUF_NOTIFY);
+}
+
+bool KLinePort::queue(obd_packet_t *packet, k_timeout_t timeout, uint8_t flags)
+{
+	kline_buf_t *buffer;
+	int length = packet->count;
 
 	if (length > 7) {
 		return false;
 	}
 
-	buffer.length = length + 3;
-	buffer.data[0] = MODE_IS_ISO9141(_mode) ? 0x68 : (0xC0 | (length & 0x07));
-	buffer.data[1] = MODE_IS_ISO9141(_mode) ? 0x6A : 0x33;
-	buffer.data[2] = 0xF1;
-	buffer.data[3] = packet->service;
-	buffer.data[4] = packet->pid;
-	buffer.data[5] = length >= 3 ? packet->a : 0x00;
-	buffer.data[6] = length >= 4 ? packet->b : 0x00;
-	buffer.data[7] = length >= 5 ? packet->c : 0x00;
-	buffer.data[8] = length >= 6 ? packet->d : 0x00;
-	buffer.data[9] = length >= 7 ? packet->unused : 0x00;
-	buffer.data[buffer.length] = checksum(buffer.data, buffer.length);
+	if (k_mem_slab_alloc(&kline_pool, (void **)&buffer, timeout) != 0) {
+		return false;
+	}
+
+	uint8_t payload[7] = {
+		packet->service, packet->pid, packet->a, packet->b, packet->c, packet->d, packet->unused,
+	};
+
+	buffer->flags = flags;
 
-	int status = k_msgq_put(&kline_tx_msgq, &buffer, K_FOREVER);
-	return status == 0;
+	uint8_t target = MODE_IS_ISO9141(_mode) ? 0x6A : KWP_FUNCTIONAL_ADDRESS;
+	if (!build(buffer, target, payload, length) || k_msgq_put(&kline_tx_msgq, &buffer, timeout) != 0) {
+		release(buffer);
+		return false;
+	}
+
+	return true;
+}
+
+// Header, payload and checksum.  KWP2000 takes the length in the format byte
+// when it fits, a separate length byte when it doesn't, or always if the key
+// bytes say that's all the ECU understands.
+bool KLinePort::build(kline_buf_t *buffer, uint8_t target, const uint8_t *payload, int len)
+{
+	int pos = 0;
+
+	if (len < 1 || len > KLINE_MAX_PAYLOAD) {
+		return false;
+	}
+
+	if (MODE_IS_ISO9141(_mode)) {
+		if (len > 7) {
+			return false;
+		}
+
+		buffer->data[pos++] = 0x68;
+		buffer->data[pos++] = 0x6A;
+		buffer->data[pos++] = KLINE_TESTER_ADDRESS;
+	} else {
+		bool kwp = _kb2 == KWP_KB2;
+		bool length_byte = len > KWP_FMT_LENGTH_MASK || (kwp && !(_kb1 & KWP_KB1_AL0));
+
+		if (length_byte && kwp && !(_kb1 & KWP_KB1_AL1)) {
+			return false;
+		}
+
+		uint8_t format = target == KWP_FUNCTIONAL_ADDRESS ? KWP_FMT_FUNCTIONAL : KWP_FMT_PHYSICAL;
+		buffer->data[pos++] = format | (length_byte ? 0 : len);
+		buffer->data[pos++] = target;
+		buffer->data[pos++] = KLINE_TESTER_ADDRESS;
+		if (length_byte) {
+			buffer->data[pos++] = len;
+		}
+	}
+
+	buffer->header = pos;
+	memcpy(&buffer->data[pos], payload, len);
+	buffer->length = pos + len;
+	buffer->data[buffer->length] = checksum(buffer->data, buffer->length);
+	return true;
+}
+
+void KLinePort::release(kline_buf_t *buffer)
+{
+	if (buffer) {
+		k_mem_slab_free(&kline_pool, (void **)&buffer);
+	}
+}
+
+int KLinePort::request(uint8_t target, const uint8_t *req, int len, uint8_t *resp, int size)
+{
+	kline_buf_t *buffer;
+	int result = KLINE_ERR_TIMEOUT;
+
+	if (!_initialized || !MODE_IS_KLINE(_mode)) {
+		return KLINE_ERR_NOT_READY;
+	}
+
+	k_mutex_lock(&_request_mutex, K_FOREVER);
+
+	if (k_mem_slab_alloc(&kline_pool, (void **)&buffer, K_MSEC(100)) != 0) {
+		k_mutex_unlock(&_request_mutex);
+		return KLINE_ERR_NO_BUFFER;
+	}
+
+	if (!build(buffer, target, req, len)) {
+		release(buffer);
+		k_mutex_unlock(&_request_mutex);
+		return KLINE_ERR_LENGTH;
+	}
+
+	buffer->flags = 0;
+	_requesting = true;
+
+	if (k_msgq_put(&kline_tx_msgq, &buffer, K_FOREVER) != 0) {
+		release(buffer);
+		_requesting = false;
+		k_mutex_unlock(&_request_mutex);
+		return KLINE_ERR_NOT_READY;
+	}
+
+	// Queueing, sending and P2 all fit in P3max, past that the session is
+	// gone anyway.  A response pending answer starts the wait over.
+	kline_buf_t *answer;
+	while (k_msgq_get(&kline_resp_msgq, &answer, K_MSEC(_p3max_ms)) == 0) {
+		uint8_t *payload = &answer->data[answer->header];
+		int length = answer->length - answer->header;
+
+		if (length >= 3 && payload[0] == KWP_SID_NEGATIVE_RESPONSE && payload[1] == req[0] &&
+			payload[2] == KWP_NRC_RESPONSE_PENDING) {
+			release(answer);
+			continue;
+		}
+
+		result = MIN(length, size);
+		memcpy(resp, payload, result);
+		release(answer);
+		break;
+	}
+
+	_requesting = false;
+
+	// Late arrivals don't belong to anyone now
+	while (k_msgq_get(&kline_resp_msgq, &answer, K_NO_WAIT) == 0) {
+		release(answer);
+	}
+
+	k_mutex_unlock(&_request_mutex);
+	return result;
+}
+
+void KLinePort::keepalive(void)
+{
+	if (!_initialized || !MODE_IS_KLINE(_mode)) {
+		return;
+	}
+
+	if (k_msgq_num_used_get(&kline_tx_msgq) != 0) {
+		// Requests are already on their way, they'll do the job
+		k_work_reschedule(&_keepalive_work, K_MSEC(KLINE_KEEPALIVE_RETRY_MS));
+		return;
+	}
+
+	// ISO 9141-2 has no TesterPresent, the usual stand-in is 01 00
+	obd_packet_t packet = {};
+	packet.mode = _mode;
+	packet.count = 2;
+	if (MODE_IS_ISO9141(_mode)) {
+		packet.service = 0x01;
+		packet.pid = 0x00;
+	} else {
+		packet.service = KWP_SID_TESTER_PRESENT;
+		packet.pid = KWP_NO_RESPONSE_REQUIRED;
+	}
+
+	if (!queue(&packet, K_NO_WAIT, KLINE_BUF_KEEPALIVE)) {
+		k_work_reschedule(&_keepalive_work, K_MSEC(KLINE_KEEPALIVE_RETRY_MS));
+		return;
+	}
+
+	_keepalives++;
+	LOG_DBG("Keep-alive %u", _keepalives);
 }
 
 
@@ -433,6 +1488,36 @@ void kline_tx_thread(void *arg1, void *arg2, void *arg3)
 	kline.tx_thread();
 }
 
+void kline_keepalive_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+
+	kline.keepalive();
+}
+
+void kline_cache_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+
+	kline.saveCache();
+}
+
+void kline_edge_callback(const struct device *port, struct gpio_callback *cb, gpio_port_pins_t pins)
+{
+	ARG_UNUSED(port);
+	ARG_UNUSED(cb);
+	ARG_UNUSED(pins);
+
+	kline.edge_callback();
+}
+
+void kline_frame_callback(const uint8_t *data, int length, int header, void *user_data)
+{
+	KLinePort *port = static_cast<KLinePort *>(user_data);
+
+	port->rxFrame(data, length, header);
+}
+
 void kline_uart_callback(const struct device *dev, struct uart_event *evt, void *user_data)
 {
 	if (!evt || !user_data) {
@@ -470,3 +1555,78 @@ void kline_uart_callback(const struct device *dev, struct uart_event *evt, void
 			break;
 	}
 }
+
+// Shell
+
+static uint8_t kline_shell_req[KLINE_MAX_PAYLOAD];
+static uint8_t kline_shell_resp[KLINE_MAX_PAYLOAD];
+
+static int cmd_kline_request(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+
+	uint8_t target = strtoul(argv[1], NULL, 16);
+	size_t len = hex2bin(argv[2], strlen(argv[2]), kline_shell_req, sizeof(kline_shell_req));
+
+	if (!len) {
+		shell_error(sh, "Request is hex bytes, e.g. 2101");
+		return -EINVAL;
+	}
+
+	int result = kline.request(target, kline_shell_req, len, kline_shell_resp, sizeof(kline_shell_resp));
+	if (result < 0) {
+		shell_error(sh, "No answer (%d)", result);
+		return -EIO;
+	}
+
+	shell_hexdump(sh, kline_shell_resp, result);
+	return 0;
+}
+
+static int cmd_kline_status(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	shell_print(sh, "Session %s at %u baud, key bytes %02X %02X", kline.isInitialized() ? "up" : "down",
+		    kline.getBaud(), kline.getKeyByte1(), kline.getKeyByte2());
+	shell_print(sh, "P2max %u ms, P3min %u us, P3max %u ms", kline.getP2Max(), kline.getP3Min(),
+		    kline.getP3Max());
+	shell_print(sh, "%u keep-alives, %u re-inits, %u collisions", kline.getKeepalives(), kline.getReinits(),
+		    kline.getCollisions());
+	shell_print(sh, "RX %u frames, %u errors, %u chunks dropped", kline.getRxFrames(), kline.getRxErrors(),
+		    kline.getRxDropped());
+	return 0;
+}
+
+// Listen-only, bytes go to capture and SLCAN
+static int cmd_kline_sniff(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+
+	if (!strcmp(argv[1], "stop")) {
+		kline.stopSniffing();
+		shell_print(sh, "%u bytes in %u frames, %u without a start bit", kline.getSniffBytes(),
+			    kline.getSniffFrames(), kline.getSniffUnmatched());
+		return 0;
+	}
+
+	uint32_t baud = strtoul(argv[1], NULL, 10);
+
+	if (!kline.startSniffing(baud)) {
+		shell_error(sh, "Can't sniff at %u baud, needs %u-%u and no session up", baud, KLINE_BAUD_MIN,
+			    KLINE_BAUD_MAX);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_kline,
+	SHELL_CMD_ARG(request, NULL, "One request on the open session: request <hex target> <hex bytes>", cmd_kline_request, 3, 0),
+	SHELL_CMD(status, NULL, "Session timing and counters", cmd_kline_status),
+	SHELL_CMD_ARG(sniff, NULL, "Listen only: sniff <baud> | sniff stop", cmd_kline_sniff, 2, 0),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(kline, &sub_kline, "K-line session", NULL);
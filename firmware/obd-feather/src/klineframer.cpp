@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2023 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdint.h>
+
+#include "klineframer.h"
+
+void KLineFramer::setTiming(uint32_t byte_us, uint32_t gap_us)
+{
+	_byte_us = byte_us;
+	_gap_us = gap_us;
+}
+
+void KLineFramer::reset(void)
+{
+	_pos = 0;
+	_header = 0;
+	_expected = 0;
+	_sum = 0;
+	_skip = false;
+}
+
+void KLineFramer::skip(void)
+{
+	_skip = true;
+}
+
+// One byte of the stream.  KWP2000 frames end when the length from the format
+// byte (or the separate length byte) is reached, ISO 9141 frames carry no
+// length and end on a gap longer than P1max.  Either way a gap starts over.
+void KLineFramer::feed(uint8_t byte, uint32_t end)
+{
+	if (isOpen() && (int32_t)(end - _last - _byte_us) > (int32_t)_gap_us) {
+		close();
+	}
+	_last = end;
+
+	if (_skip) {
+		return;
+	}
+
+	if (_pos >= KLINE_FRAME_SIZE) {
+		_errors++;
+		_skip = true;
+		return;
+	}
+
+	if (_headerless) {
+		_header = 3;
+	} else if (_pos == 0) {
+		int length = byte & KWP_FMT_LENGTH_MASK;
+		_header = (byte & KWP_FMT_ADDRESS_MASK) ? 3 : 1;
+		_expected = length ? _header + length + 1 : 0;
+	} else if (_pos == _header && _expected == 0) {
+		// Length 0 in the format byte, this is the length byte
+		_header++;
+		_expected = _header + byte + 1;
+	}
+
+	_data[_pos++] = byte;
+	_sum += byte;
+
+	if (_expected && _pos >= _expected) {
+		close();
+	}
+}
+
+void KLineFramer::close(void)
+{
+	if (_skip || _pos < 2) {
+		reset();
+		return;
+	}
+
+	uint8_t sum = _data[_pos - 1];
+
+	if ((_expected && _pos != _expected) || (uint8_t)(_sum - sum) != sum) {
+		// Cut short, or a bad checksum.  Chuck it.
+		_errors++;
+	} else {
+		int length = _pos - 1;
+
+		_frames++;
+		_callback(_data, length, _header < length ? _header : length, _user_data);
+	}
+
+	reset();
+}
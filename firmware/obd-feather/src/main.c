@@ -7,14 +7,22 @@
 #include "gpio_map.h"
 #include "obd2.h"
 #include "canbus.h"
+#include "j1939.h"
+#include "mcp2515.h"
+#include "slcan.h"
 #include "kline.h"
 #include "j1850.h"
 #include "display.h"
+#include "sdcard.h"
+#include "dbc.h"
+#include "uds.h"
+#include "capture.h"
+#include "xcp.h"
 
 #include <logging/log.h>
 LOG_MODULE_REGISTER(main, 3);
 
-#define STACKSIZE 256
+#define STACKSIZE 2048
 #define PRIORITY K_IDLE_PRIO
 
 /*---------------------------------------------------------------------------*/
@@ -25,8 +33,16 @@ void main_thread(void * id, void * unused1, void * unused2)
   LOG_INF("%s", __func__);
 
   gpio_init();
+  sdcard_init();
   obd2_init();
   canbus_init();
+  dbc_init();
+  capture_init();
+  uds_init();
+  xcp_init();
+  j1939_init();
+  mcp2515_init();
+  slcan_init();
   kline_init();
   j1850_init();
   display_init();
@@ -0,0 +1,568 @@
+/*
+ * Copyright (c) 2023 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <sys/printk.h>
+#include <device.h>
+#include <drivers/spi.h>
+#include <drivers/can.h>
+#include <shell/shell.h>
+#include <string.h>
+
+#include "gpio_map.h"
+#include "modes.h"
+#include "canbus.h"
+#include "mcp2515.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(mcp2515, 3);
+
+MCP2515Port mcp2515;
+
+K_THREAD_STACK_DEFINE(mcp2515_rx_thread_stack, MCP2515_RX_THREAD_STACK_SIZE);
+K_THREAD_STACK_DEFINE(mcp2515_tx_thread_stack, MCP2515_TX_THREAD_STACK_SIZE);
+
+K_MSGQ_DEFINE(mcp2515_tx_msgq, sizeof(struct zcan_frame), 32, 4);
+
+void MCP2515Port::begin(void)
+{
+	_initialized = false;
+	_dev = DEVICE_DT_GET(DT_NODELABEL(spi2));
+
+	if (!_dev) {
+		printk("MCP2515: SPI driver not found.\n");
+		return;
+	}
+
+	// Chip select is driven by hand from gpio_map so it can be held across
+	// a whole burst.
+	_spi_cfg.frequency = MCP2515_SPI_FREQ;
+	_spi_cfg.operation = SPI_WORD_SET(8) | SPI_TRANSFER_MSB | SPI_OP_MODE_MASTER;
+	_spi_cfg.slave = 0;
+	_spi_cfg.cs = NULL;
+
+	k_mutex_init(&_spi_mutex);
+	k_sem_init(&_int_sem, 0, 1);
+
+	if (reset() != 0) {
+		printk("MCP2515: Not responding.\n");
+		return;
+	}
+
+	_initialized = true;
+	setMode(MODE_IDLE);
+
+	_rx_tid = k_thread_create(&_rx_thread_data, mcp2515_rx_thread_stack,
+				    K_THREAD_STACK_SIZEOF(mcp2515_rx_thread_stack),
+				    mcp2515_rx_thread, NULL, NULL, NULL,
+				    MCP2515_RX_THREAD_PRIORITY, 0, K_NO_WAIT);
+	if (!_rx_tid) {
+		printk("ERROR spawning rx thread\n");
+	}
+
+	_tx_tid = k_thread_create(&_tx_thread_data, mcp2515_tx_thread_stack,
+				    K_THREAD_STACK_SIZEOF(mcp2515_tx_thread_stack),
+				    mcp2515_tx_thread, NULL, NULL, NULL,
+				    MCP2515_TX_THREAD_PRIORITY, 0, K_NO_WAIT);
+	if (!_tx_tid) {
+		printk("ERROR spawning tx thread\n");
+	}
+
+	printk("Finished init.\n");
+}
+
+void MCP2515Port::setMode(operation_mode_t mode)
+{
+	uint32_t bitrate;
+
+	if (mode == _mode && mode != MODE_IDLE) {
+		return;
+	}
+
+	_mode = mode;
+
+	if (!_initialized) {
+		return;
+	}
+
+	// This controller has its own transceiver, so it isn't subject to the
+	// CAN_SEL mux and can run alongside can1.
+	switch (_mode) {
+		case MODE_HS_CAN:
+			bitrate = 500000;
+			break;
+
+		case MODE_MS_CAN:
+			bitrate = 125000;
+			break;
+
+		default:
+			bitrate = 0;
+			break;
+	}
+
+	gpio_irq_disable(GPIO_MCP2515_INT);
+	setOpMode(MCP2515_MODE_CONFIG);
+	modifyRegister(MCP2515_CANINTE, 0xFF, 0x00);
+
+	if (!bitrate || !setBitrate(bitrate)) {
+		_mode = MODE_IDLE;
+		return;
+	}
+
+	// Accept everything, roll RXB0 over into RXB1 so back-to-back frames
+	// don't overrun while we're busy on the SPI bus.
+	modifyRegister(MCP2515_RXB0CTRL, 0x64, 0x64);
+	modifyRegister(MCP2515_RXB1CTRL, 0x60, 0x60);
+	modifyRegister(MCP2515_CANINTF, 0xFF, 0x00);
+	modifyRegister(MCP2515_CANINTE, MCP2515_INT_RX0 | MCP2515_INT_RX1, MCP2515_INT_RX0 | MCP2515_INT_RX1);
+
+	gpio_irq_enable(GPIO_MCP2515_INT);
+
+	if (!setOpMode(MCP2515_MODE_NORMAL)) {
+		printk("MCP2515: Could not enter normal mode\n");
+	}
+}
+
+bool MCP2515Port::send(obd_packet_t *packet)
+{
+	if (!packet) {
+		return false;
+	}
+
+	if (packet->dlc > CAN_MAX_DLC) {
+		return false;
+	}
+
+	uint32_t id = packet->id;
+	bool ext = (packet->flags & OBD_PACKET_EXT) || id >= (1 << 11);
+
+	struct zcan_frame msg = {
+		.id = id,
+		.fd = 0,
+		.rtr = (uint8_t)((packet->flags & OBD_PACKET_RTR) ? CAN_REMOTEREQUEST : CAN_DATAFRAME),
+		.id_type = (uint8_t)(ext ? CAN_EXTENDED_IDENTIFIER : CAN_STANDARD_IDENTIFIER),
+		.dlc = packet->dlc,
+		.data = {packet->count, packet->service, packet->pid, packet->a, packet->b, packet->c, packet->d, packet->unused},
+	};
+
+	if (!msg.dlc && msg.rtr == CAN_DATAFRAME) {
+		msg.dlc = OBD_CAN_DLC;
+		if (packet->count < OBD_CAN_DLC - 1) {
+			memset(&msg.data[1 + packet->count], OBD_CAN_PADDING, OBD_CAN_DLC - 1 - packet->count);
+		}
+	}
+
+	int status = k_msgq_put(&mcp2515_tx_msgq, &msg, K_FOREVER);
+	return status == 0;
+}
+
+bool MCP2515Port::sendFrame(const struct zcan_frame *frame, k_timeout_t timeout)
+{
+	if (!_initialized || !MODE_IS_CAN(_mode)) {
+		return false;
+	}
+
+	return k_msgq_put(&mcp2515_tx_msgq, frame, timeout) == 0;
+}
+
+void MCP2515Port::rx_thread(void)
+{
+	int status;
+
+	while (1) {
+		status = k_sem_take(&_int_sem, K_MSEC(100));
+
+		if (!_initialized || !MODE_IS_CAN(_mode)) {
+			continue;
+		}
+
+		// On a timeout, only go to the bus if we somehow missed the edge.
+		if (status != 0 && !gpio_input_get(GPIO_MCP2515_INT)) {
+			continue;
+		}
+
+		drain(status == 0 ? _int_timestamp : obd_timestamp());
+	}
+}
+
+void MCP2515Port::drain(uint32_t timestamp)
+{
+	uint8_t tx[2 + MCP2515_RXB_BURST_SIZE];
+	uint8_t rx[2 + MCP2515_RXB_BURST_SIZE];
+	struct zcan_frame frames[2];
+	uint8_t status;
+	int count;
+
+	while (1) {
+		count = 0;
+
+		k_mutex_lock(&_spi_mutex, K_FOREVER);
+
+		if (readStatus(&status) != 0) {
+			k_mutex_unlock(&_spi_mutex);
+			return;
+		}
+
+		status &= MCP2515_STATUS_RX0 | MCP2515_STATUS_RX1;
+
+		if (status == (MCP2515_STATUS_RX0 | MCP2515_STATUS_RX1)) {
+			// Both full: RXB0, the status/control mirrors and RXB1 are
+			// contiguous, so pull the lot in one transfer.
+			memset(tx, 0x00, sizeof(tx));
+			tx[0] = MCP2515_READ;
+			tx[1] = MCP2515_RXB0SIDH;
+			if (transfer(tx, rx, sizeof(tx)) == 0) {
+				decode(&rx[2], &frames[count++]);
+				decode(&rx[2 + MCP2515_RXB1CTRL + 1 - MCP2515_RXB0SIDH], &frames[count++]);
+			}
+			modifyRegister(MCP2515_CANINTF, MCP2515_INT_RX0 | MCP2515_INT_RX1, 0x00);
+		} else if (status) {
+			// READ RX BUFFER clears the matching flag when CS goes high
+			memset(tx, 0x00, 1 + MCP2515_RXB_SIZE);
+			tx[0] = (status & MCP2515_STATUS_RX0) ? MCP2515_READ_RX0 : MCP2515_READ_RX1;
+			if (transfer(tx, rx, 1 + MCP2515_RXB_SIZE) == 0) {
+				decode(&rx[1], &frames[count++]);
+			}
+		}
+
+		k_mutex_unlock(&_spi_mutex);
+
+		if (!status) {
+			return;
+		}
+
+		// RXB0 always fills first, so this keeps arrival order.  Same path
+		// as can1's frames, so both get captured and forwarded.
+		for (int i = 0; i < count; i++) {
+			canbus.receive(CAN_CHANNEL_MCP2515, _mode, &frames[i], timestamp);
+		}
+	}
+}
+
+void MCP2515Port::tx_thread(void)
+{
+	struct zcan_frame msg;
+	uint8_t buffer[1 + MCP2515_RXB_SIZE];
+	uint8_t status;
+	int retries;
+
+	while (1) {
+		if (k_msgq_get(&mcp2515_tx_msgq, &msg, K_MSEC(100)) != 0) {
+			continue;
+		}
+
+		if (!_initialized || !MODE_IS_CAN(_mode)) {
+			continue;
+		}
+
+		// Wait for the previous frame to clear TXB0
+		for (retries = 0; retries < 100; retries++) {
+			k_mutex_lock(&_spi_mutex, K_FOREVER);
+			int rc = readStatus(&status);
+			k_mutex_unlock(&_spi_mutex);
+
+			if (rc != 0 || !(status & MCP2515_STATUS_TX0REQ)) {
+				break;
+			}
+			k_sleep(K_MSEC(1));
+		}
+
+		buffer[0] = MCP2515_LOAD_TX0;
+		encode(&msg, &buffer[1]);
+
+		k_mutex_lock(&_spi_mutex, K_FOREVER);
+		transfer(buffer, NULL, sizeof(buffer));
+		buffer[0] = MCP2515_RTS_TX0;
+		transfer(buffer, NULL, 1);
+		k_mutex_unlock(&_spi_mutex);
+	}
+}
+
+void MCP2515Port::int_callback(void)
+{
+	if (!_initialized || !gpio_input_get(GPIO_MCP2515_INT)) {
+		return;
+	}
+
+	_int_timestamp = obd_timestamp();
+	k_sem_give(&_int_sem);
+}
+
+int MCP2515Port::transfer(const uint8_t *tx, uint8_t *rx, size_t len)
+{
+	const struct spi_buf tx_buf = {
+		.buf = (void *)tx,
+		.len = len,
+	};
+	const struct spi_buf rx_buf = {
+		.buf = rx,
+		.len = len,
+	};
+	const struct spi_buf_set tx_set = {
+		.buffers = &tx_buf,
+		.count = 1,
+	};
+	const struct spi_buf_set rx_set = {
+		.buffers = &rx_buf,
+		.count = 1,
+	};
+
+	gpio_output_set(GPIO_MCP2515_CS, true);
+	int status = spi_transceive(_dev, &_spi_cfg, &tx_set, rx ? &rx_set : NULL);
+	gpio_output_set(GPIO_MCP2515_CS, false);
+
+	return status;
+}
+
+int MCP2515Port::reset(void)
+{
+	uint8_t cmd = MCP2515_RESET;
+	uint8_t canstat;
+
+	k_mutex_lock(&_spi_mutex, K_FOREVER);
+	int status = transfer(&cmd, NULL, 1);
+	k_mutex_unlock(&_spi_mutex);
+
+	if (status != 0) {
+		return status;
+	}
+
+	// Oscillator start-up time is 128 clocks, give it plenty
+	k_sleep(K_MSEC(1));
+
+	status = readRegisters(MCP2515_CANSTAT, &canstat, 1);
+	if (status != 0) {
+		return status;
+	}
+
+	return (canstat & MCP2515_MODE_MASK) == MCP2515_MODE_CONFIG ? 0 : -EIO;
+}
+
+int MCP2515Port::readRegisters(uint8_t addr, uint8_t *data, size_t len)
+{
+	uint8_t tx[2 + MCP2515_RXB_BURST_SIZE] = {MCP2515_READ, addr};
+	uint8_t rx[2 + MCP2515_RXB_BURST_SIZE];
+
+	if (len > MCP2515_RXB_BURST_SIZE) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&_spi_mutex, K_FOREVER);
+	int status = transfer(tx, rx, len + 2);
+	k_mutex_unlock(&_spi_mutex);
+
+	if (status == 0) {
+		memcpy(data, &rx[2], len);
+	}
+	return status;
+}
+
+int MCP2515Port::writeRegisters(uint8_t addr, const uint8_t *data, size_t len)
+{
+	uint8_t tx[2 + MCP2515_RXB_BURST_SIZE] = {MCP2515_WRITE, addr};
+
+	if (len > MCP2515_RXB_BURST_SIZE) {
+		return -EINVAL;
+	}
+
+	memcpy(&tx[2], data, len);
+
+	k_mutex_lock(&_spi_mutex, K_FOREVER);
+	int status = transfer(tx, NULL, len + 2);
+	k_mutex_unlock(&_spi_mutex);
+
+	return status;
+}
+
+int MCP2515Port::modifyRegister(uint8_t addr, uint8_t mask, uint8_t value)
+{
+	uint8_t tx[4] = {MCP2515_BIT_MODIFY, addr, mask, value};
+
+	k_mutex_lock(&_spi_mutex, K_FOREVER);
+	int status = transfer(tx, NULL, sizeof(tx));
+	k_mutex_unlock(&_spi_mutex);
+
+	return status;
+}
+
+int MCP2515Port::readStatus(uint8_t *status)
+{
+	uint8_t tx[2] = {MCP2515_READ_STATUS, 0x00};
+	uint8_t rx[2];
+
+	int rc = transfer(tx, rx, sizeof(tx));
+	if (rc == 0) {
+		*status = rx[1];
+	}
+	return rc;
+}
+
+bool MCP2515Port::setOpMode(uint8_t mode)
+{
+	uint8_t canstat;
+
+	modifyRegister(MCP2515_CANCTRL, MCP2515_MODE_MASK, mode);
+
+	for (int i = 0; i < 10; i++) {
+		if (readRegisters(MCP2515_CANSTAT, &canstat, 1) == 0 &&
+			(canstat & MCP2515_MODE_MASK) == mode) {
+			return true;
+		}
+		k_sleep(K_MSEC(1));
+	}
+
+	return false;
+}
+
+bool MCP2515Port::setBitrate(uint32_t bitrate)
+{
+	// As many TQ per bit as the crystal allows, PS2 an eighth of them for
+	// a sample point around 87.5%, PS1 as long as it can be and the rest
+	// propagation.  16 TQ gives sync 1, prop 5, PS1 8, PS2 2.
+	for (uint32_t tq = MCP2515_MAX_TQ; tq >= MCP2515_MIN_TQ; tq--) {
+		uint32_t divisor = 2 * tq * bitrate;
+
+		if (MCP2515_OSC_FREQ % divisor) {
+			continue;
+		}
+
+		uint32_t brp = MCP2515_OSC_FREQ / divisor - 1;
+		if (brp > 63) {
+			continue;
+		}
+
+		uint32_t ps2 = MAX(tq / 8, 2);
+		uint32_t ps1 = MIN(tq - 2 - ps2, 8);
+		uint32_t prseg = tq - 1 - ps2 - ps1;
+
+		uint8_t cnf[3] = {
+			(uint8_t)(ps2 - 1),								// CNF3
+			(uint8_t)(0x80 | ((ps1 - 1) << 3) | (prseg - 1)),	// CNF2: BTLMODE
+			(uint8_t)brp,									// CNF1: SJW = 1
+		};
+
+		return writeRegisters(MCP2515_CNF3, cnf, sizeof(cnf)) == 0;
+	}
+
+	LOG_ERR("No bit timing for %u from a %u Hz crystal", bitrate, MCP2515_OSC_FREQ);
+	return false;
+}
+
+void MCP2515Port::decode(const uint8_t *regs, struct zcan_frame *frame)
+{
+	uint8_t sidh = regs[0];
+	uint8_t sidl = regs[1];
+
+	memset(frame, 0, sizeof(*frame));
+
+	if (sidl & 0x08) {
+		frame->id_type = CAN_EXTENDED_IDENTIFIER;
+		frame->id = ((uint32_t)sidh << 21) | ((uint32_t)(sidl & 0xE0) << 13) |
+					((uint32_t)(sidl & 0x03) << 16) | ((uint32_t)regs[2] << 8) | regs[3];
+		frame->rtr = (regs[4] & 0x40) ? CAN_REMOTEREQUEST : CAN_DATAFRAME;
+	} else {
+		frame->id_type = CAN_STANDARD_IDENTIFIER;
+		frame->id = ((uint32_t)sidh << 3) | (sidl >> 5);
+		frame->rtr = (sidl & 0x10) ? CAN_REMOTEREQUEST : CAN_DATAFRAME;
+	}
+
+	frame->dlc = MIN(regs[4] & 0x0F, 8);
+	memcpy(frame->data, &regs[5], frame->dlc);
+}
+
+void MCP2515Port::encode(const struct zcan_frame *frame, uint8_t *regs)
+{
+	uint32_t id = frame->id;
+
+	if (frame->id_type == CAN_EXTENDED_IDENTIFIER) {
+		regs[0] = (id >> 21) & 0xFF;
+		regs[1] = ((id >> 13) & 0xE0) | 0x08 | ((id >> 16) & 0x03);
+		regs[2] = (id >> 8) & 0xFF;
+		regs[3] = id & 0xFF;
+	} else {
+		regs[0] = (id >> 3) & 0xFF;
+		regs[1] = (id & 0x07) << 5;
+		regs[2] = 0x00;
+		regs[3] = 0x00;
+	}
+
+	regs[4] = (frame->dlc & 0x0F) | (frame->rtr ? 0x40 : 0x00);
+	memcpy(&regs[5], frame->data, 8);
+}
+
+
+// Helpers
+
+void mcp2515_init(void)
+{
+	mcp2515.begin();
+}
+
+void mcp2515_rx_thread(void *arg1, void *arg2, void *arg3)
+{
+	ARG_UNUSED(arg1);
+	ARG_UNUSED(arg2);
+	ARG_UNUSED(arg3);
+
+	mcp2515.rx_thread();
+}
+
+void mcp2515_tx_thread(void *arg1, void *arg2, void *arg3)
+{
+	ARG_UNUSED(arg1);
+	ARG_UNUSED(arg2);
+	ARG_UNUSED(arg3);
+
+	mcp2515.tx_thread();
+}
+
+void mcp2515_int_callback(const struct device *port, struct gpio_callback *cb, gpio_port_pins_t pins)
+{
+	mcp2515.int_callback();
+}
+
+// Shell
+
+static int cmd_mcp2515_mode(const struct shell *sh, size_t argc, char **argv)
+{
+	operation_mode_t mode;
+
+	ARG_UNUSED(argc);
+
+	if (!mcp2515.isReady()) {
+		shell_error(sh, "MCP2515 not found");
+		return -ENODEV;
+	}
+
+	if (!strcmp(argv[1], "hs")) {
+		mode = MODE_HS_CAN;
+	} else if (!strcmp(argv[1], "ms")) {
+		mode = MODE_MS_CAN;
+	} else if (!strcmp(argv[1], "off")) {
+		mode = MODE_IDLE;
+	} else {
+		shell_error(sh, "Mode is hs, ms or off");
+		return -EINVAL;
+	}
+
+	mcp2515.setMode(mode);
+
+	if (mcp2515.getMode() != mode) {
+		shell_error(sh, "Not running");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_mcp2515,
+	SHELL_CMD_ARG(mode, NULL, "Second CAN channel: mode <hs|ms|off>", cmd_mcp2515_mode, 2, 0),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(mcp2515, &sub_mcp2515, "MCP2515 CAN channel", NULL);
@@ -68,6 +68,7 @@ operation_mode_t OBD2::getMode(void)
 bool OBD2::send(obd_packet_t *packet)
 {
     if (_port) {
+        k_sem_reset(&_complete_sem);
         return k_msgq_put(&obd2_tx_msgq, packet, K_FOREVER);
     }
     return false;
@@ -78,6 +79,29 @@ bool OBD2::receive(obd_packet_t *packet)
     return k_msgq_put(&obd2_rx_msgq, packet, K_FOREVER);
 }
 
+void OBD2::complete(int responses)
+{
+    obd_packet_t packet = {};
+
+    packet.mode = _mode;
+    packet.count = responses;
+    packet.flags = OBD_PACKET_DONE;
+    packet.timestamp = obd_timestamp();
+
+    // Behind the answers themselves, so they're all through first
+    k_msgq_put(&obd2_rx_msgq, &packet, K_FOREVER);
+}
+
+// Number of answers to the last request, or -EAGAIN on timeout
+int OBD2::waitComplete(k_timeout_t timeout)
+{
+    if (k_sem_take(&_complete_sem, timeout) != 0) {
+        return -EAGAIN;
+    }
+
+    return _responses;
+}
+
 void OBD2::enable(operation_mode_t mode)
 {
     if (MODE_IS_CAN(mode)) {
@@ -155,6 +179,12 @@ void OBD2::rx_thread(void)
             continue;
         }
 
+        if (packet.flags & OBD_PACKET_DONE) {
+            _responses = packet.count;
+            k_sem_give(&_complete_sem);
+            continue;
+        }
+
         // do something
 
     }
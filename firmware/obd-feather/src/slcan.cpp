@@ -0,0 +1,680 @@
+/*
+ * Copyright (c) 2023 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <sys/printk.h>
+#include <sys/byteorder.h>
+#include <sys/ring_buffer.h>
+#include <device.h>
+#include <drivers/can.h>
+#include <drivers/uart.h>
+#include <usb/usb_device.h>
+#include <string.h>
+
+#include "modes.h"
+#include "obd2.h"
+#include "canbus.h"
+#include "mcp2515.h"
+#include "cantraffic.h"
+#include "kline.h"
+#include "slcan.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(slcan, 3);
+
+SLCAN slcan;
+
+K_THREAD_STACK_DEFINE(slcan_thread_stack, SLCAN_THREAD_STACK_SIZE);
+
+RING_BUF_DECLARE(slcan_rx_ringbuf, SLCAN_RX_BUFFER_SIZE);
+RING_BUF_DECLARE(slcan_tx_ringbuf, SLCAN_TX_BUFFER_SIZE);
+
+static const uint8_t slcan_hex_digits[16] = {
+	'0', '1', '2', '3', '4', '5', '6', '7',
+	'8', '9', 'A', 'B', 'C', 'D', 'E', 'F',
+};
+
+// Indexed by (ext << 1) | rtr
+static const uint8_t slcan_frame_types[4] = { 't', 'r', 'T', 'R' };
+
+// Indexed by the Sn digit, only the rates the transceivers are wired for
+static const operation_mode_t slcan_bitrate_modes[9] = {
+	MODE_IDLE,		// S0 10k
+	MODE_IDLE,		// S1 20k
+	MODE_IDLE,		// S2 50k
+	MODE_IDLE,		// S3 100k
+	MODE_MS_CAN,	// S4 125k
+	MODE_IDLE,		// S5 250k
+	MODE_HS_CAN,	// S6 500k
+	MODE_IDLE,		// S7 800k
+	MODE_IDLE,		// S8 1M
+};
+
+// '0'-'9' -> 0-9, 'A'-'F' and 'a'-'f' -> 10-15.  Letters have bit 6 set.
+static inline uint8_t hex_nibble(uint8_t c)
+{
+	return (c & 0x0F) + 9 * (c >> 6);
+}
+
+static inline bool hex_valid(uint8_t c)
+{
+	return ((uint8_t)(c - '0') < 10) | ((uint8_t)((c | 0x20) - 'a') < 6);
+}
+
+void SLCAN::begin(void)
+{
+	_dev = DEVICE_DT_GET(DT_NODELABEL(cdc_acm_uart1));
+
+	if (!_dev) {
+		printk("SLCAN: Device driver not found.\n");
+		return;
+	}
+
+	int status = usb_enable(NULL);
+	if (status != 0 && status != -EALREADY) {
+		printk("SLCAN: Failed to enable USB\n");
+		return;
+	}
+
+	k_sem_init(&_rx_sem, 0, 1);
+
+	uart_irq_callback_user_data_set(_dev, slcan_uart_isr, this);
+	uart_irq_rx_enable(_dev);
+
+	_tid = k_thread_create(&_thread_data, slcan_thread_stack,
+				    K_THREAD_STACK_SIZEOF(slcan_thread_stack),
+				    slcan_thread, NULL, NULL, NULL,
+				    SLCAN_THREAD_PRIORITY, 0, K_NO_WAIT);
+	if (!_tid) {
+		printk("ERROR spawning slcan thread\n");
+	}
+
+	printk("Finished init.\n");
+}
+
+void SLCAN::uart_isr(void)
+{
+	uint8_t *data;
+	uint32_t len;
+
+	while (uart_irq_update(_dev) && uart_irq_is_pending(_dev)) {
+		if (uart_irq_rx_ready(_dev)) {
+			len = ring_buf_put_claim(&slcan_rx_ringbuf, &data, SLCAN_RX_BUFFER_SIZE);
+			if (!len) {
+				// The 2.7 cdc_acm driver doesn't NAK the host when its own
+				// ring fills, it drops the packet.  Backing off here would
+				// only move the loss there, so keep draining and discard,
+				// and let the thread resync the parser on what's left.
+				uint8_t scratch[64];
+				int count = uart_fifo_read(_dev, scratch, sizeof(scratch));
+				if (count > 0) {
+					atomic_add(&_rx_dropped, count);
+					k_sem_give(&_rx_sem);
+				}
+			} else {
+				int count = uart_fifo_read(_dev, data, len);
+				ring_buf_put_finish(&slcan_rx_ringbuf, count > 0 ? count : 0);
+				if (count > 0) {
+					_rx_timestamp = obd_timestamp();
+					k_sem_give(&_rx_sem);
+				}
+			}
+		}
+
+		if (uart_irq_tx_ready(_dev)) {
+			k_spinlock_key_t key = k_spin_lock(&_tx_lock);
+
+			// Hand over everything that's contiguous, so frames queued since
+			// the last interrupt share a USB transfer.
+			len = ring_buf_get_claim(&slcan_tx_ringbuf, &data, SLCAN_TX_BUFFER_SIZE);
+			if (!len) {
+				uart_irq_tx_disable(_dev);
+			} else {
+				int count = uart_fifo_fill(_dev, data, len);
+				ring_buf_get_finish(&slcan_tx_ringbuf, count > 0 ? count : 0);
+			}
+
+			k_spin_unlock(&_tx_lock, key);
+		}
+	}
+}
+
+void SLCAN::thread(void)
+{
+	uint8_t *data;
+	uint32_t len;
+
+	while (1) {
+		k_sem_take(&_rx_sem, K_MSEC(100));
+
+		while ((len = ring_buf_get_claim(&slcan_rx_ringbuf, &data, SLCAN_RX_BUFFER_SIZE)) > 0) {
+			for (uint32_t i = 0; i < len; i++) {
+				process(data[i]);
+			}
+			ring_buf_get_finish(&slcan_rx_ringbuf, len);
+		}
+
+		uint32_t dropped = atomic_clear(&_rx_dropped);
+		if (dropped) {
+			// Commands were lost under load.  Throw away any partial
+			// record and NAK the line in progress rather than run a
+			// command stitched together from two others.
+			_rx_lost += dropped;
+			_record_len = 0;
+			_line_len = 0;
+			_overflow = true;
+		}
+	}
+}
+
+void SLCAN::process(uint8_t c)
+{
+	if (_record_len) {
+		_line[_line_len++] = c;
+
+		if (_line_len == 2) {
+			uint8_t dlc = MIN(c & SLCAN_BINARY_DLC_MASK, CAN_MAX_DLC);
+			_record_len = SLCAN_BINARY_HEADER_SIZE + ((c & SLCAN_BINARY_FLAG_RTR) ? 0 : dlc);
+		}
+
+		if (_line_len == _record_len) {
+			struct zcan_frame frame;
+			uint8_t channel;
+
+			if (parseRecord(_line, &frame, &channel)) {
+				transmit(&frame, channel);
+			}
+			_line_len = 0;
+			_record_len = 0;
+		}
+		return;
+	}
+
+	if (_binary && _line_len == 0 && c == SLCAN_BINARY_SYNC) {
+		// Long enough to collect the flags byte, then resized from it
+		_record_len = SLCAN_LINE_SIZE;
+		_line[_line_len++] = c;
+		return;
+	}
+
+	if (c == SLCAN_CR) {
+		if (_overflow) {
+			reply("\a");
+		} else {
+			command(_line, _line_len);
+		}
+		_line_len = 0;
+		_overflow = false;
+		return;
+	}
+
+	if (c == '\n') {
+		return;
+	}
+
+	if (_line_len < SLCAN_LINE_SIZE) {
+		_line[_line_len++] = c;
+	} else {
+		_overflow = true;
+	}
+}
+
+void SLCAN::command(const uint8_t *line, int len)
+{
+	struct zcan_frame frame;
+
+	if (!len) {
+		return;
+	}
+
+	switch (line[0]) {
+		case 'S':
+			if (len == 2 && !_open && setBitrate(line[1] - '0')) {
+				reply("\r");
+				return;
+			}
+			break;
+
+		case 'O':
+		case 'L':
+			if (len == 1 && !_open && _mode != MODE_IDLE) {
+				open(line[0] == 'L');
+				reply("\r");
+				return;
+			}
+			break;
+
+		case 'C':
+			if (len == 1) {
+				close();
+				reply("\r");
+				return;
+			}
+			break;
+
+		case 't':
+		case 'T':
+		case 'r':
+		case 'R':
+		{
+			bool ext = line[0] == 'T' || line[0] == 'R';
+			bool rtr = line[0] == 'r' || line[0] == 'R';
+
+			if (parseFrame(line, len, ext, rtr, &frame) && transmit(&frame, CAN_CHANNEL_CAN1)) {
+				reply(ext ? "Z\r" : "z\r");
+				return;
+			}
+			break;
+		}
+
+		case 'Z':
+			if (len == 2 && (line[1] == '0' || line[1] == '1')) {
+				_timestamps = line[1] == '1';
+				reply("\r");
+				return;
+			}
+			break;
+
+		case 'B':
+			// Extension: B1 switches both directions to binary records
+			if (len == 2 && (line[1] == '0' || line[1] == '1')) {
+				_binary = line[1] == '1';
+				reply("\r");
+				return;
+			}
+			break;
+
+		case 'D':
+			// Extension: D0 forwards everything, Dxxxx only forwards changed
+			// payloads plus one copy per xxxx (hex) ms for each ID
+			if (len == 2 && line[1] == '0') {
+				cantraffic.disable();
+				reply("\r");
+				return;
+			}
+			if (len == 5) {
+				bool valid = true;
+				uint32_t heartbeat = 0;
+
+				for (int i = 1; i < 5; i++) {
+					valid &= hex_valid(line[i]);
+					heartbeat = (heartbeat << 4) | hex_nibble(line[i]);
+				}
+
+				if (valid) {
+					cantraffic.enable(heartbeat);
+					reply("\r");
+					return;
+				}
+			}
+			break;
+
+		case 'K':
+			// Extension: K0 stops, Kxxxx sniffs the K-line at xxxx (hex)
+			// baud and sends every byte up as it is seen
+			if (len == 2 && line[1] == '0') {
+				_kline = false;
+				kline.stopSniffing();
+				reply("\r");
+				return;
+			}
+			if (len == 5) {
+				bool valid = true;
+				uint32_t baud = 0;
+
+				for (int i = 1; i < 5; i++) {
+					valid &= hex_valid(line[i]);
+					baud = (baud << 4) | hex_nibble(line[i]);
+				}
+
+				if (valid && kline.startSniffing(baud)) {
+					_kline = true;
+					reply("\r");
+					return;
+				}
+			}
+			break;
+
+		case 'F':
+			if (len == 1) {
+				reply("F00\r");
+				return;
+			}
+			break;
+
+		case 'V':
+			if (len == 1) {
+				reply("V0101\r");
+				return;
+			}
+			break;
+
+		case 'N':
+			if (len == 1) {
+				reply("N0001\r");
+				return;
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	reply("\a");
+}
+
+bool SLCAN::parseFrame(const uint8_t *line, int len, bool ext, bool rtr, struct zcan_frame *frame)
+{
+	int id_len = ext ? 8 : 3;
+
+	if (len < 1 + id_len + 1) {
+		return false;
+	}
+
+	const uint8_t *p = line + 1;
+	bool valid = true;
+	uint32_t id = 0;
+
+	for (int i = 0; i < id_len; i++, p++) {
+		valid &= hex_valid(*p);
+		id = (id << 4) | hex_nibble(*p);
+	}
+
+	valid &= hex_valid(*p);
+	uint8_t dlc = hex_nibble(*p++);
+
+	if (!valid || dlc > CAN_MAX_DLC || id > (ext ? CAN_EXT_ID_MASK : CAN_STD_ID_MASK)) {
+		return false;
+	}
+
+	if (len != 1 + id_len + 1 + (rtr ? 0 : dlc * 2)) {
+		return false;
+	}
+
+	memset(frame, 0, sizeof(*frame));
+	frame->id = id;
+	frame->id_type = ext ? CAN_EXTENDED_IDENTIFIER : CAN_STANDARD_IDENTIFIER;
+	frame->rtr = rtr ? CAN_REMOTEREQUEST : CAN_DATAFRAME;
+	frame->dlc = dlc;
+
+	if (!rtr) {
+		for (int i = 0; i < dlc; i++, p += 2) {
+			valid &= hex_valid(p[0]) & hex_valid(p[1]);
+			frame->data[i] = (hex_nibble(p[0]) << 4) | hex_nibble(p[1]);
+		}
+	}
+
+	return valid;
+}
+
+bool SLCAN::parseRecord(const uint8_t *record, struct zcan_frame *frame, uint8_t *channel)
+{
+	uint8_t flags = record[1];
+	uint32_t id = sys_get_le32(&record[2]);
+	bool ext = flags & SLCAN_BINARY_FLAG_EXT;
+	bool rtr = flags & SLCAN_BINARY_FLAG_RTR;
+	uint8_t dlc = flags & SLCAN_BINARY_DLC_MASK;
+
+	if ((flags & SLCAN_BINARY_FLAG_KLINE) || dlc > CAN_MAX_DLC || id > (ext ? CAN_EXT_ID_MASK : CAN_STD_ID_MASK)) {
+		return false;
+	}
+
+	memset(frame, 0, sizeof(*frame));
+	frame->id = id;
+	frame->id_type = ext ? CAN_EXTENDED_IDENTIFIER : CAN_STANDARD_IDENTIFIER;
+	frame->rtr = rtr ? CAN_REMOTEREQUEST : CAN_DATAFRAME;
+	frame->dlc = dlc;
+
+	if (!rtr) {
+		memcpy(frame->data, &record[SLCAN_BINARY_HEADER_SIZE], dlc);
+	}
+
+	*channel = (flags & SLCAN_BINARY_FLAG_CHANNEL) ? CAN_CHANNEL_MCP2515 : CAN_CHANNEL_CAN1;
+	return true;
+}
+
+bool SLCAN::transmit(const struct zcan_frame *frame, uint8_t channel)
+{
+	if (!_open || _listen_only) {
+		return false;
+	}
+
+	if (channel == CAN_CHANNEL_MCP2515) {
+		return mcp2515.sendFrame(frame);
+	}
+
+	// Blocking here stops the thread draining the RX ring, which throttles
+	// the host rather than dropping its frames.  The USB arrival time rides
+	// along so the TX thread can report host-to-bus latency.
+	return canbus.sendFrame(frame, K_FOREVER, _rx_timestamp);
+}
+
+bool SLCAN::setBitrate(uint8_t code)
+{
+	if (code >= ARRAY_SIZE(slcan_bitrate_modes)) {
+		return false;
+	}
+
+	operation_mode_t mode = slcan_bitrate_modes[code];
+	if (mode == MODE_IDLE) {
+		return false;
+	}
+
+	_mode = mode;
+	return true;
+}
+
+void SLCAN::open(bool listen_only)
+{
+	// The controller stays in normal mode, listen-only just refuses host
+	// frames so the bus still sees our ACKs.
+	obd2.setMode(_mode);
+	canbus.resetTxLatency();
+
+	_listen_only = listen_only;
+	_open = true;
+}
+
+void SLCAN::close(void)
+{
+	if (_kline) {
+		_kline = false;
+		kline.stopSniffing();
+	}
+
+	if (!_open) {
+		return;
+	}
+
+	_open = false;
+
+	can_latency_stats_t stats;
+	canbus.getTxLatency(&stats);
+
+	if (stats.count) {
+		LOG_INF("host->bus latency: %u frames, min %u us, avg %u us, max %u us",
+			stats.count, stats.min_us, (uint32_t)(stats.total_us / stats.count),
+			stats.max_us);
+	}
+
+	if (cantraffic.isEnabled()) {
+		LOG_INF("change filter: %u forwarded, %u suppressed",
+			cantraffic.getForwarded(), cantraffic.getSuppressed());
+	}
+
+	if (_overruns) {
+		LOG_WRN("%u frames dropped on a full USB ring", _overruns);
+	}
+
+	if (_rx_lost) {
+		LOG_WRN("%u host bytes dropped on a full RX ring", _rx_lost);
+	}
+}
+
+void SLCAN::forward(const struct zcan_frame *frame, uint32_t timestamp, uint8_t channel)
+{
+	uint8_t buf[SLCAN_LINE_SIZE];
+	int len;
+
+	if (!_open) {
+		return;
+	}
+
+	if (_binary) {
+		len = encodeBinary(frame, timestamp, channel, buf);
+	} else if (channel != CAN_CHANNEL_CAN1) {
+		return;
+	} else {
+		len = encodeASCII(frame, timestamp, buf);
+	}
+
+	if (!write(buf, len)) {
+		_overruns++;
+	}
+}
+
+// From the K-line RX thread while sniffing
+void SLCAN::forwardKLine(uint8_t byte, uint8_t flags, uint32_t timestamp)
+{
+	uint8_t buf[SLCAN_LINE_SIZE];
+
+	if (!_kline) {
+		return;
+	}
+
+	if (!write(buf, encodeKLine(byte, flags, timestamp, _binary, buf))) {
+		_overruns++;
+	}
+}
+
+int SLCAN::encodeASCII(const struct zcan_frame *frame, uint32_t timestamp, uint8_t *buf)
+{
+	bool ext = frame->id_type == CAN_EXTENDED_IDENTIFIER;
+	uint8_t dlc = MIN(frame->dlc, CAN_MAX_DLC);
+	uint8_t count = frame->rtr ? 0 : dlc;
+	uint8_t *p = buf;
+
+	*p++ = slcan_frame_types[(ext << 1) | frame->rtr];
+
+	for (int shift = ext ? 28 : 8; shift >= 0; shift -= 4) {
+		*p++ = slcan_hex_digits[(frame->id >> shift) & 0x0F];
+	}
+
+	*p++ = slcan_hex_digits[dlc];
+
+	for (int i = 0; i < count; i++) {
+		*p++ = slcan_hex_digits[frame->data[i] >> 4];
+		*p++ = slcan_hex_digits[frame->data[i] & 0x0F];
+	}
+
+	if (_timestamps) {
+		// Lawicel timestamps are ms, wrapping at 60000
+		uint16_t ms = (timestamp / 1000) % 60000;
+
+		*p++ = slcan_hex_digits[(ms >> 12) & 0x0F];
+		*p++ = slcan_hex_digits[(ms >> 8) & 0x0F];
+		*p++ = slcan_hex_digits[(ms >> 4) & 0x0F];
+		*p++ = slcan_hex_digits[ms & 0x0F];
+	}
+
+	*p++ = SLCAN_CR;
+
+	return p - buf;
+}
+
+int SLCAN::encodeBinary(const struct zcan_frame *frame, uint32_t timestamp, uint8_t channel, uint8_t *buf)
+{
+	uint8_t dlc = MIN(frame->dlc, CAN_MAX_DLC);
+	uint8_t count = frame->rtr ? 0 : dlc;
+
+	buf[0] = SLCAN_BINARY_SYNC;
+	buf[1] = (frame->id_type == CAN_EXTENDED_IDENTIFIER ? SLCAN_BINARY_FLAG_EXT : 0) |
+		 (frame->rtr ? SLCAN_BINARY_FLAG_RTR : 0) |
+		 (channel != CAN_CHANNEL_CAN1 ? SLCAN_BINARY_FLAG_CHANNEL : 0) | dlc;
+	sys_put_le32(frame->id, &buf[2]);
+	sys_put_le32(timestamp, &buf[6]);
+	memcpy(&buf[SLCAN_BINARY_HEADER_SIZE], frame->data, count);
+
+	return SLCAN_BINARY_HEADER_SIZE + count;
+}
+
+int SLCAN::encodeKLine(uint8_t byte, uint8_t flags, uint32_t timestamp, bool binary, uint8_t *buf)
+{
+	uint8_t *p = buf;
+
+	if (binary) {
+		buf[0] = SLCAN_BINARY_SYNC;
+		buf[1] = SLCAN_BINARY_FLAG_KLINE | 1;
+		sys_put_le32(flags, &buf[2]);
+		sys_put_le32(timestamp, &buf[6]);
+		buf[SLCAN_BINARY_HEADER_SIZE] = byte;
+
+		return SLCAN_BINARY_HEADER_SIZE + 1;
+	}
+
+	*p++ = SLCAN_KLINE_TYPE;
+	*p++ = slcan_hex_digits[flags >> 4];
+	*p++ = slcan_hex_digits[flags & 0x0F];
+	*p++ = slcan_hex_digits[byte >> 4];
+	*p++ = slcan_hex_digits[byte & 0x0F];
+
+	for (int shift = 28; shift >= 0; shift -= 4) {
+		*p++ = slcan_hex_digits[(timestamp >> shift) & 0x0F];
+	}
+
+	*p++ = SLCAN_CR;
+
+	return p - buf;
+}
+
+bool SLCAN::write(const uint8_t *data, int len)
+{
+	k_spinlock_key_t key = k_spin_lock(&_tx_lock);
+
+	// All or nothing, a partial record would desync the host
+	bool fits = ring_buf_space_get(&slcan_tx_ringbuf) >= (uint32_t)len;
+	if (fits) {
+		ring_buf_put(&slcan_tx_ringbuf, data, len);
+	}
+
+	k_spin_unlock(&_tx_lock, key);
+
+	if (fits) {
+		uart_irq_tx_enable(_dev);
+	}
+
+	return fits;
+}
+
+void SLCAN::reply(const char *str)
+{
+	write((const uint8_t *)str, strlen(str));
+}
+
+// Helpers
+
+void slcan_init(void)
+{
+	slcan.begin();
+}
+
+void slcan_thread(void *arg1, void *arg2, void *arg3)
+{
+	ARG_UNUSED(arg1);
+	ARG_UNUSED(arg2);
+	ARG_UNUSED(arg3);
+
+	slcan.thread();
+}
+
+void slcan_uart_isr(const struct device *dev, void *user_data)
+{
+	ARG_UNUSED(dev);
+
+	SLCAN *port = static_cast<SLCAN *>(user_data);
+	port->uart_isr();
+}
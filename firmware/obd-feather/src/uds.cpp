@@ -0,0 +1,937 @@
+/*
+ * Copyright (c) 2023 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <sys/printk.h>
+#include <sys/byteorder.h>
+#include <device.h>
+#include <drivers/can.h>
+#include <canbus/isotp.h>
+#include <string.h>
+#include <stdlib.h>
+#include <shell/shell.h>
+
+#include "obd2.h"
+#include "canbus.h"
+#include "valuestore.h"
+#include "uds.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(uds, 3);
+
+UDSClient uds;
+
+static const struct isotp_fc_opts uds_fc_opts = {
+	.bs = 0,		// no further flow control frames
+	.stmin = 0,		// and as fast as the ECU can send
+};
+
+void UDSClient::begin(void)
+{
+	_dev = DEVICE_DT_GET(DT_NODELABEL(can1));
+
+	if (!_dev) {
+		printk("UDS: Device driver not found.\n");
+		return;
+	}
+
+	k_work_init_delayable(&_tester_present_work, uds_tester_present_handler);
+	k_work_init_delayable(&_periodic_work, uds_periodic_poll_handler);
+}
+
+// The port has to be in one of the CAN modes first, ISO-TP talks to the
+// controller directly rather than through canbus' queues.  Its exact filter
+// on rx_id takes those frames away from canbus' catch-all, so they don't
+// show up in captures or on SLCAN until close().  Any periodic route goes
+// with the old binding, set it up again afterwards.
+bool UDSClient::open(uint32_t tx_id, uint32_t rx_id, bool ext)
+{
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	if (_open) {
+		unroutePeriodic();
+		isotp_unbind(&_recv_ctx);
+		_open = false;
+	}
+
+	_tx_addr.ext_id = tx_id;
+	_tx_addr.id_type = ext ? CAN_EXTENDED_IDENTIFIER : CAN_STANDARD_IDENTIFIER;
+	_tx_addr.use_ext_addr = 0;
+	_tx_addr.use_fixed_addr = 0;
+
+	_rx_addr.ext_id = rx_id;
+	_rx_addr.id_type = ext ? CAN_EXTENDED_IDENTIFIER : CAN_STANDARD_IDENTIFIER;
+	_rx_addr.use_ext_addr = 0;
+	_rx_addr.use_fixed_addr = 0;
+
+	int status = isotp_bind(&_recv_ctx, _dev, &_rx_addr, &_tx_addr, &uds_fc_opts, K_MSEC(100));
+	if (status != ISOTP_N_OK) {
+		LOG_ERR("Failed to bind ISO-TP: %d", status);
+	} else {
+		_open = true;
+		_session = UDS_SESSION_DEFAULT;
+		_p2 = UDS_P2_DEFAULT;
+		_p2_star = UDS_P2_STAR_DEFAULT;
+		_max_dids = UDS_MAX_DIDS_PER_REQUEST;
+	}
+
+	k_mutex_unlock(&_mutex);
+
+	return _open;
+}
+
+void UDSClient::close(void)
+{
+	k_work_cancel_delayable(&_tester_present_work);
+	unroutePeriodic();
+
+	k_mutex_lock(&_mutex, K_FOREVER);
+	if (_open) {
+		isotp_unbind(&_recv_ctx);
+		_open = false;
+	}
+	k_mutex_unlock(&_mutex);
+}
+
+int UDSClient::transfer(const uint8_t *req, size_t len, uint8_t *resp, size_t size)
+{
+	int retries = 0;
+
+	if (!_open) {
+		return UDS_ERR_NOT_OPEN;
+	}
+
+	// Periodic single frames on the response ID pile up in ISO-TP between
+	// polls, hand them on before they're mistaken for an answer.
+	int stale;
+	while ((stale = isotp_recv(&_recv_ctx, resp, size, K_NO_WAIT)) >= 0) {
+		periodicMessage(resp, stale, obd_timestamp());
+	}
+
+	if (isotp_send(&_send_ctx, _dev, req, len, &_tx_addr, &_rx_addr, NULL, NULL) != ISOTP_N_OK) {
+		return UDS_ERR_SEND;
+	}
+
+	// Any request keeps a non-default session alive
+	if (_session != UDS_SESSION_DEFAULT) {
+		k_work_reschedule(&_tester_present_work, K_MSEC(UDS_TESTER_PRESENT_INTERVAL));
+	}
+
+	int64_t deadline = k_uptime_get() + _p2 + UDS_P2_MARGIN;
+
+	while (1) {
+		int64_t remaining = deadline - k_uptime_get();
+		if (remaining <= 0) {
+			return UDS_ERR_TIMEOUT;
+		}
+
+		int count = isotp_recv(&_recv_ctx, resp, size, K_MSEC(remaining));
+		if (count < 0) {
+			return UDS_ERR_TIMEOUT;
+		}
+
+		// The answer to 0x2A itself is the bare SID, periodic data has a pDID
+		if (periodicMessage(resp, count, obd_timestamp())) {
+			continue;
+		}
+
+		if (count >= 3 && resp[0] == UDS_SID_NEGATIVE_RESPONSE && resp[1] == req[0]) {
+			_last_nrc = resp[2];
+
+			if (_last_nrc == UDS_NRC_RESPONSE_PENDING) {
+				deadline = k_uptime_get() + _p2_star + UDS_P2_MARGIN;
+				continue;
+			}
+
+			if (_last_nrc == UDS_NRC_BUSY_REPEAT_REQUEST && retries++ < UDS_BUSY_RETRIES) {
+				k_sleep(K_MSEC(_p2));
+				if (isotp_send(&_send_ctx, _dev, req, len, &_tx_addr, &_rx_addr, NULL, NULL) != ISOTP_N_OK) {
+					return UDS_ERR_SEND;
+				}
+				deadline = k_uptime_get() + _p2 + UDS_P2_MARGIN;
+				continue;
+			}
+
+			return UDS_ERR_NEGATIVE;
+		}
+
+		if (count >= 1 && resp[0] == (req[0] | UDS_POSITIVE_RESPONSE)) {
+			return count;
+		}
+
+		// Late answer to something we already gave up on, keep waiting
+	}
+}
+
+int UDSClient::request(const uint8_t *req, size_t len, uint8_t *resp, size_t size)
+{
+	if (!req || !len || !resp) {
+		return UDS_ERR_INVALID;
+	}
+
+	k_mutex_lock(&_mutex, K_FOREVER);
+	int status = transfer(req, len, resp, size);
+	k_mutex_unlock(&_mutex);
+
+	return status;
+}
+
+bool UDSClient::startSession(uint8_t session)
+{
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	_request[0] = UDS_SID_DIAGNOSTIC_SESSION_CONTROL;
+	_request[1] = session;
+
+	int count = transfer(_request, 2, _response, sizeof(_response));
+	if (count >= 2 && _response[1] == session) {
+		_session = session;
+
+		// P2 in ms and P2* in 10ms units follow the echoed session
+		if (count >= 6) {
+			_p2 = sys_get_be16(&_response[2]);
+			_p2_star = sys_get_be16(&_response[4]) * 10;
+		}
+	}
+
+	k_mutex_unlock(&_mutex);
+
+	if (_session != UDS_SESSION_DEFAULT) {
+		k_work_reschedule(&_tester_present_work, K_MSEC(UDS_TESTER_PRESENT_INTERVAL));
+	} else {
+		k_work_cancel_delayable(&_tester_present_work);
+	}
+
+	return count >= 2 && _session == session;
+}
+
+int UDSClient::readBatch(uds_did_t *dids, int count)
+{
+	int len = 0;
+
+	_request[len++] = UDS_SID_READ_DATA_BY_IDENTIFIER;
+	for (int i = 0; i < count; i++) {
+		sys_put_be16(dids[i].did, &_request[len]);
+		len += 2;
+	}
+
+	int resp_len = transfer(_request, len, _response, sizeof(_response));
+	if (resp_len < 0) {
+		return resp_len;
+	}
+
+	// Records come back in request order, ECUs drop the DIDs they don't
+	// support, and the lengths aren't on the wire so they come from the table.
+	uint32_t timestamp = obd_timestamp();
+	const uint8_t *p = &_response[1];
+	const uint8_t *end = &_response[resp_len];
+	int read = 0;
+	int next = 0;
+
+	while (p + 2 <= end && next < count) {
+		uint16_t did = sys_get_be16(p);
+
+		while (next < count && dids[next].did != did) {
+			next++;
+		}
+
+		if (next >= count || p + 2 + dids[next].length > end) {
+			break;
+		}
+
+		uds_did_t *entry = &dids[next++];
+		const uint8_t *data = p + 2;
+
+		if (entry->value_index != VALUESTORE_INVALID && entry->length <= sizeof(int64_t)) {
+			int64_t value = 0;
+
+			for (int i = 0; i < entry->length; i++) {
+				value = (value << 8) | data[i];
+			}
+			valuestore.set(entry->value_index, value, timestamp);
+		}
+
+		if (entry->data) {
+			memcpy(entry->data, data, entry->length);
+		}
+		entry->read = true;
+
+		p = data + entry->length;
+		read++;
+	}
+
+	return read;
+}
+
+int UDSClient::readDataByIdentifier(uds_did_t *dids, int count)
+{
+	int read = 0;
+	int index = 0;
+
+	if (!dids) {
+		return UDS_ERR_INVALID;
+	}
+
+	for (int i = 0; i < count; i++) {
+		dids[i].read = false;
+	}
+
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	while (index < count) {
+		// As many DIDs as the ECU takes and both buffers hold
+		size_t resp_len = 1;
+		int batch = 0;
+
+		while (index + batch < count && batch < _max_dids &&
+			   1 + 2 * (batch + 1) <= UDS_BUFFER_SIZE &&
+			   resp_len + 2 + dids[index + batch].length <= UDS_BUFFER_SIZE) {
+			resp_len += 2 + dids[index + batch].length;
+			batch++;
+		}
+
+		if (!batch) {
+			LOG_WRN("DID %04X too long to read", dids[index].did);
+			index++;
+			continue;
+		}
+
+		int status = readBatch(&dids[index], batch);
+
+		if (status == UDS_ERR_NEGATIVE && batch > 1 &&
+			(_last_nrc == UDS_NRC_INCORRECT_LENGTH || _last_nrc == UDS_NRC_RESPONSE_TOO_LONG)) {
+			// Over this ECU's limit, learn it and retry the same DIDs
+			_max_dids = batch / 2;
+			LOG_INF("ECU takes at most %u DIDs per request", _max_dids);
+			continue;
+		}
+
+		if (status > 0) {
+			read += status;
+		}
+		index += batch;
+	}
+
+	k_mutex_unlock(&_mutex);
+
+	return read;
+}
+
+bool UDSClient::clearDynamic(uint8_t pdid)
+{
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	k_spinlock_key_t key = k_spin_lock(&_periodic_lock);
+	uint8_t slot = _periodic_map[pdid];
+	if (slot != UDS_PERIODIC_UNUSED) {
+		_periodic[slot].count = 0;
+		_periodic_map[pdid] = UDS_PERIODIC_UNUSED;
+	}
+	k_spin_unlock(&_periodic_lock, key);
+
+	_request[0] = UDS_SID_DYNAMICALLY_DEFINE_DATA_IDENTIFIER;
+	_request[1] = UDS_DDDI_CLEAR;
+	sys_put_be16(UDS_PERIODIC_DID_BASE | pdid, &_request[2]);
+
+	int status = transfer(_request, 4, _response, sizeof(_response));
+
+	k_mutex_unlock(&_mutex);
+
+	// Clearing something the ECU never had defined is fine too
+	return status >= 0 || (status == UDS_ERR_NEGATIVE && _last_nrc == UDS_NRC_REQUEST_OUT_OF_RANGE);
+}
+
+bool UDSClient::defineDynamic(uint8_t pdid, const uds_dyn_element_t *elements, int count)
+{
+	if (!elements || count <= 0 || count > UDS_DYN_MAX_ELEMENTS) {
+		return false;
+	}
+
+	if (!clearDynamic(pdid)) {
+		return false;
+	}
+
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	uds_periodic_t *entry = 0;
+	for (int i = 0; i < UDS_PERIODIC_MAX; i++) {
+		if (!_periodic[i].count) {
+			entry = &_periodic[i];
+			break;
+		}
+	}
+
+	if (!entry) {
+		k_mutex_unlock(&_mutex);
+		LOG_WRN("No room for periodic DID %02X", pdid);
+		return false;
+	}
+
+	int len = 0;
+	_request[len++] = UDS_SID_DYNAMICALLY_DEFINE_DATA_IDENTIFIER;
+	_request[len++] = UDS_DDDI_DEFINE_BY_IDENTIFIER;
+	sys_put_be16(UDS_PERIODIC_DID_BASE | pdid, &_request[len]);
+	len += 2;
+
+	for (int i = 0; i < count; i++) {
+		sys_put_be16(elements[i].source_did, &_request[len]);
+		_request[len + 2] = elements[i].position;
+		_request[len + 3] = elements[i].size;
+		len += 4;
+	}
+
+	int status = transfer(_request, len, _response, sizeof(_response));
+
+	if (status >= 0) {
+		k_spinlock_key_t key = k_spin_lock(&_periodic_lock);
+		memcpy(entry->elements, elements, count * sizeof(*elements));
+		entry->pdid = pdid;
+		entry->count = count;
+		_periodic_map[pdid] = entry - _periodic;
+		k_spin_unlock(&_periodic_lock, key);
+	}
+
+	k_mutex_unlock(&_mutex);
+
+	return status >= 0;
+}
+
+// One-shot read of a dynamic DID through 0x22, unpacked like a periodic frame
+int UDSClient::readDynamic(uint8_t pdid)
+{
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	// Only changed under the mutex, so it holds for the whole request
+	uint8_t slot = _periodic_map[pdid];
+
+	if (slot == UDS_PERIODIC_UNUSED) {
+		k_mutex_unlock(&_mutex);
+		return UDS_ERR_INVALID;
+	}
+
+	_request[0] = UDS_SID_READ_DATA_BY_IDENTIFIER;
+	sys_put_be16(UDS_PERIODIC_DID_BASE | pdid, &_request[1]);
+
+	int status = transfer(_request, 3, _response, sizeof(_response));
+	if (status >= 3 && sys_get_be16(&_response[1]) == (UDS_PERIODIC_DID_BASE | pdid)) {
+		unpack(&_periodic[slot], &_response[3], status - 3, obd_timestamp());
+	}
+
+	k_mutex_unlock(&_mutex);
+
+	return status;
+}
+
+bool UDSClient::startPeriodic(const uint8_t *pdids, int count, uint8_t rate)
+{
+	if (!pdids || count <= 0 || count > UDS_BUFFER_SIZE - 2) {
+		return false;
+	}
+
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	_request[0] = UDS_SID_READ_DATA_BY_PERIODIC_IDENTIFIER;
+	_request[1] = rate;
+	memcpy(&_request[2], pdids, count);
+
+	int status = transfer(_request, 2 + count, _response, sizeof(_response));
+
+	k_mutex_unlock(&_mutex);
+
+	return status >= 0;
+}
+
+bool UDSClient::stopPeriodic(const uint8_t *pdids, int count)
+{
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	// No identifiers stops everything
+	_request[0] = UDS_SID_READ_DATA_BY_PERIODIC_IDENTIFIER;
+	_request[1] = UDS_RATE_STOP;
+	if (pdids && count > 0) {
+		count = MIN(count, UDS_BUFFER_SIZE - 2);
+		memcpy(&_request[2], pdids, count);
+	} else {
+		count = 0;
+	}
+
+	int status = transfer(_request, 2 + count, _response, sizeof(_response));
+
+	k_mutex_unlock(&_mutex);
+
+	return status >= 0;
+}
+
+// Frames on any other ID reach canbus' catch-all filter and come to
+// periodic() straight from the RX thread.  On the response ID, ISO-TP's
+// exact filter gets them first, so they're fetched from ISO-TP instead.
+bool UDSClient::routePeriodic(uint32_t id, bool ext, uds_periodic_format_t format)
+{
+	bool response_id = _open && id == _rx_addr.ext_id &&
+			   ext == (_rx_addr.id_type == CAN_EXTENDED_IDENTIFIER);
+
+	unroutePeriodic();
+	_periodic_format = format;
+
+	if (!response_id) {
+		return canbus.routePeriodic(id, ext);
+	}
+
+	if (format != UDS_PERIODIC_SINGLE_FRAME) {
+		LOG_WRN("UUDT periodic data can't share the response ID");
+		return false;
+	}
+
+	_periodic_isotp = true;
+	k_work_reschedule(&_periodic_work, K_NO_WAIT);
+	return true;
+}
+
+void UDSClient::unroutePeriodic(void)
+{
+	_periodic_isotp = false;
+	k_work_cancel_delayable(&_periodic_work);
+	canbus.unroutePeriodic();
+}
+
+void UDSClient::pollPeriodic(void)
+{
+	if (!_open || !_periodic_isotp) {
+		return;
+	}
+
+	// A request in flight hands them on itself
+	if (k_mutex_lock(&_mutex, K_NO_WAIT) == 0) {
+		int count;
+
+		while ((count = isotp_recv(&_recv_ctx, _response, sizeof(_response), K_NO_WAIT)) >= 0) {
+			periodicMessage(_response, count, obd_timestamp());
+		}
+		k_mutex_unlock(&_mutex);
+	}
+
+	k_work_reschedule(&_periodic_work, K_MSEC(UDS_PERIODIC_POLL_MS));
+}
+
+// A whole message out of ISO-TP: 0x6A, pDID, data
+bool UDSClient::periodicMessage(const uint8_t *data, int len, uint32_t timestamp)
+{
+	if (len < 2 || data[0] != (UDS_SID_READ_DATA_BY_PERIODIC_IDENTIFIER | UDS_POSITIVE_RESPONSE)) {
+		return false;
+	}
+
+	deliver(data[1], data + 2, len - 2, timestamp);
+	return true;
+}
+
+// Called from the CAN RX thread for every frame on the periodic ID
+void UDSClient::periodic(const struct zcan_frame *frame, uint32_t timestamp)
+{
+	const uint8_t *data = frame->data;
+	int len = MIN(frame->dlc, CAN_MAX_DLC);
+
+	if (_periodic_format == UDS_PERIODIC_SINGLE_FRAME) {
+		uint8_t sf_len = data[0] & 0x0F;
+
+		if (len < 3 || (data[0] & 0xF0) || sf_len < 2 || sf_len > len - 1 ||
+			data[1] != (UDS_SID_READ_DATA_BY_PERIODIC_IDENTIFIER | UDS_POSITIVE_RESPONSE)) {
+			return;
+		}
+		data += 2;
+		len = sf_len - 1;
+	}
+
+	if (len < 1) {
+		return;
+	}
+
+	deliver(data[0], data + 1, len - 1, timestamp);
+}
+
+void UDSClient::deliver(uint8_t pdid, const uint8_t *data, int len, uint32_t timestamp)
+{
+	// The mutex is held across whole ISO-TP transfers, far too long to
+	// wait for here, so take a copy of the entry under the spinlock.
+	uds_periodic_t entry;
+
+	k_spinlock_key_t key = k_spin_lock(&_periodic_lock);
+	uint8_t slot = _periodic_map[pdid];
+	if (slot != UDS_PERIODIC_UNUSED) {
+		entry = _periodic[slot];
+	}
+	k_spin_unlock(&_periodic_lock, key);
+
+	if (slot == UDS_PERIODIC_UNUSED) {
+		return;
+	}
+
+	unpack(&entry, data, len, timestamp);
+}
+
+bool UDSClient::getDynamic(uint8_t pdid, uds_periodic_t *entry)
+{
+	k_spinlock_key_t key = k_spin_lock(&_periodic_lock);
+	uint8_t slot = _periodic_map[pdid];
+	if (slot != UDS_PERIODIC_UNUSED) {
+		*entry = _periodic[slot];
+	}
+	k_spin_unlock(&_periodic_lock, key);
+
+	return slot != UDS_PERIODIC_UNUSED;
+}
+
+void UDSClient::unpack(const uds_periodic_t *entry, const uint8_t *data, int len, uint32_t timestamp)
+{
+	int count = entry->count;
+
+	for (int i = 0; i < count; i++) {
+		const uds_dyn_element_t *element = &entry->elements[i];
+
+		if (element->size > len) {
+			return;
+		}
+
+		if (element->value_index != VALUESTORE_INVALID && element->size <= sizeof(int64_t)) {
+			int64_t value = 0;
+
+			for (int j = 0; j < element->size; j++) {
+				value = (value << 8) | data[j];
+			}
+			valuestore.set(element->value_index, value, timestamp);
+		}
+
+		data += element->size;
+		len -= element->size;
+	}
+}
+
+void UDSClient::testerPresent(void)
+{
+	static const uint8_t tester_present[] = {
+		UDS_SID_TESTER_PRESENT, UDS_SUPPRESS_POSITIVE_RESPONSE,
+	};
+
+	if (!_open || _session == UDS_SESSION_DEFAULT) {
+		return;
+	}
+
+	// A request in flight keeps the session alive on its own
+	if (k_mutex_lock(&_mutex, K_NO_WAIT) == 0) {
+		isotp_send(&_send_ctx, _dev, tester_present, sizeof(tester_present),
+				   &_tx_addr, &_rx_addr, NULL, NULL);
+		k_mutex_unlock(&_mutex);
+	}
+
+	k_work_reschedule(&_tester_present_work, K_MSEC(UDS_TESTER_PRESENT_INTERVAL));
+}
+
+// Helpers
+
+void uds_init(void)
+{
+	uds.begin();
+}
+
+void uds_tester_present_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+
+	uds.testerPresent();
+}
+
+void uds_periodic_poll_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+
+	uds.pollPeriodic();
+}
+
+// Shell
+
+static uint8_t uds_shell_req[UDS_BUFFER_SIZE];
+static uint8_t uds_shell_resp[UDS_BUFFER_SIZE];
+static uint8_t uds_shell_data[UDS_SHELL_MAX_DIDS][UDS_SHELL_MAX_DID_LENGTH];
+
+static int cmd_uds_open(const struct shell *sh, size_t argc, char **argv)
+{
+	bool ext = argc > 3 && !strcmp(argv[3], "ext");
+
+	if (!MODE_IS_CAN(canbus.getMode())) {
+		shell_error(sh, "Put the port in a CAN mode first");
+		return -ENODEV;
+	}
+
+	if (!uds.open(strtoul(argv[1], NULL, 16), strtoul(argv[2], NULL, 16), ext)) {
+		shell_error(sh, "Can't bind ISO-TP");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int cmd_uds_close(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(sh);
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	uds.close();
+	return 0;
+}
+
+static int cmd_uds_session(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+
+	if (!uds.startSession(strtoul(argv[1], NULL, 16))) {
+		shell_error(sh, "Refused, NRC %02X", uds.getLastNRC());
+		return -EIO;
+	}
+
+	shell_print(sh, "Session %02X, P2 %u ms, P2* %u ms", uds.getSession(), uds.getP2(), uds.getP2Star());
+	return 0;
+}
+
+// <did>:<length> pairs, hex DID and decimal length, as many to a request as
+// the ECU takes
+static int cmd_uds_read(const struct shell *sh, size_t argc, char **argv)
+{
+	uds_did_t dids[UDS_SHELL_MAX_DIDS];
+	int count = argc - 1;
+
+	if (count > UDS_SHELL_MAX_DIDS) {
+		shell_error(sh, "At most %d DIDs", UDS_SHELL_MAX_DIDS);
+		return -EINVAL;
+	}
+
+	for (int i = 0; i < count; i++) {
+		char *p;
+
+		dids[i].did = strtoul(argv[i + 1], &p, 16);
+		dids[i].length = *p == ':' ? strtoul(p + 1, NULL, 10) : 0;
+		dids[i].value_index = VALUESTORE_INVALID;
+		dids[i].data = uds_shell_data[i];
+
+		if (!dids[i].length || dids[i].length > UDS_SHELL_MAX_DID_LENGTH) {
+			shell_error(sh, "DIDs are <hex did>:<length>, up to %d bytes", UDS_SHELL_MAX_DID_LENGTH);
+			return -EINVAL;
+		}
+	}
+
+	int read = uds.readDataByIdentifier(dids, count);
+	if (read < 0) {
+		shell_error(sh, "Failed (%d)", read);
+		return -EIO;
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (!dids[i].read) {
+			shell_print(sh, "%04X: no answer", dids[i].did);
+			continue;
+		}
+
+		shell_print(sh, "%04X:", dids[i].did);
+		shell_hexdump(sh, dids[i].data, dids[i].length);
+	}
+
+	shell_print(sh, "%d of %d read, %u DIDs per request", read, count, uds.getMaxDIDs());
+	return 0;
+}
+
+static int cmd_uds_request(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+
+	size_t len = hex2bin(argv[1], strlen(argv[1]), uds_shell_req, sizeof(uds_shell_req));
+	if (!len) {
+		shell_error(sh, "Request is hex bytes, e.g. 22F190");
+		return -EINVAL;
+	}
+
+	int result = uds.request(uds_shell_req, len, uds_shell_resp, sizeof(uds_shell_resp));
+	if (result == UDS_ERR_NEGATIVE) {
+		shell_error(sh, "NRC %02X", uds.getLastNRC());
+		return -EIO;
+	}
+	if (result < 0) {
+		shell_error(sh, "No answer (%d)", result);
+		return -EIO;
+	}
+
+	shell_hexdump(sh, uds_shell_resp, result);
+	return 0;
+}
+
+// <did>:<position>:<size> elements, hex DID then decimal 1-based position and
+// size, each landing in the value store as UDS.F2xx.n
+static int cmd_uds_dynamic(const struct shell *sh, size_t argc, char **argv)
+{
+	uds_dyn_element_t elements[UDS_DYN_MAX_ELEMENTS];
+	uint8_t pdid = strtoul(argv[1], NULL, 16);
+	int count = argc - 2;
+
+	if (count > UDS_DYN_MAX_ELEMENTS) {
+		shell_error(sh, "At most %d elements", UDS_DYN_MAX_ELEMENTS);
+		return -EINVAL;
+	}
+
+	for (int i = 0; i < count; i++) {
+		char *p;
+		char name[16];
+
+		elements[i].source_did = strtoul(argv[i + 2], &p, 16);
+		elements[i].position = *p == ':' ? strtoul(p + 1, &p, 10) : 0;
+		elements[i].size = *p == ':' ? strtoul(p + 1, NULL, 10) : 0;
+
+		if (!elements[i].position || !elements[i].size || elements[i].size > sizeof(int64_t)) {
+			shell_error(sh, "Elements are <hex did>:<position>:<size>, up to %d bytes", (int)sizeof(int64_t));
+			return -EINVAL;
+		}
+
+		snprintk(name, sizeof(name), "%04X.%d", UDS_PERIODIC_DID_BASE | pdid, i);
+		elements[i].value_index = valuestore.allocate("UDS", name, 0);
+	}
+
+	if (!uds.defineDynamic(pdid, elements, count)) {
+		shell_error(sh, "Refused, NRC %02X", uds.getLastNRC());
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int cmd_uds_periodic_route(const struct shell *sh, size_t argc, char **argv)
+{
+	bool ext = false;
+	uds_periodic_format_t format = UDS_PERIODIC_SINGLE_FRAME;
+
+	for (size_t i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "ext")) {
+			ext = true;
+		} else if (!strcmp(argv[i], "uudt")) {
+			format = UDS_PERIODIC_UUDT;
+		} else {
+			shell_error(sh, "Unknown option %s", argv[i]);
+			return -EINVAL;
+		}
+	}
+
+	if (!uds.routePeriodic(strtoul(argv[1], NULL, 16), ext, format)) {
+		shell_error(sh, "Can't route that ID");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int cmd_uds_periodic_start(const struct shell *sh, size_t argc, char **argv)
+{
+	static const char *rates[] = { "slow", "medium", "fast" };
+	uint8_t pdids[UDS_PERIODIC_MAX];
+	uint8_t rate = 0;
+	int count = argc - 2;
+
+	for (size_t i = 0; i < ARRAY_SIZE(rates); i++) {
+		if (!strcmp(argv[1], rates[i])) {
+			rate = UDS_RATE_SLOW + i;
+		}
+	}
+
+	if (!rate) {
+		shell_error(sh, "Rate is slow, medium or fast");
+		return -EINVAL;
+	}
+
+	if (count > UDS_PERIODIC_MAX) {
+		shell_error(sh, "At most %d pDIDs", UDS_PERIODIC_MAX);
+		return -EINVAL;
+	}
+
+	for (int i = 0; i < count; i++) {
+		pdids[i] = strtoul(argv[i + 2], NULL, 16);
+	}
+
+	if (!uds.startPeriodic(pdids, count, rate)) {
+		shell_error(sh, "Refused, NRC %02X", uds.getLastNRC());
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int cmd_uds_periodic_stop(const struct shell *sh, size_t argc, char **argv)
+{
+	uint8_t pdids[UDS_PERIODIC_MAX];
+	int count = argc - 1;
+
+	if (count > UDS_PERIODIC_MAX) {
+		shell_error(sh, "At most %d pDIDs", UDS_PERIODIC_MAX);
+		return -EINVAL;
+	}
+
+	for (int i = 0; i < count; i++) {
+		pdids[i] = strtoul(argv[i + 1], NULL, 16);
+	}
+
+	if (!uds.stopPeriodic(pdids, count)) {
+		shell_error(sh, "Refused, NRC %02X", uds.getLastNRC());
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int cmd_uds_periodic_show(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	for (int pdid = 0; pdid < 256; pdid++) {
+		uds_periodic_t entry;
+
+		if (!uds.getDynamic(pdid, &entry)) {
+			continue;
+		}
+
+		shell_print(sh, "%04X:", UDS_PERIODIC_DID_BASE | pdid);
+		for (int i = 0; i < entry.count; i++) {
+			uds_dyn_element_t *element = &entry.elements[i];
+			value_t value;
+
+			if (!valuestore.get(element->value_index, &value)) {
+				shell_print(sh, "  %04X:%u:%u", element->source_did, element->position, element->size);
+				continue;
+			}
+
+			shell_print(sh, "  %04X:%u:%u %s = %lld @ %u", element->source_did, element->position,
+				    element->size, value.name, (long long)value.value, value.timestamp);
+		}
+	}
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_uds_periodic,
+	SHELL_CMD_ARG(route, NULL, "Where periodic data arrives: route <hex id> [ext] [uudt]", cmd_uds_periodic_route, 2, 2),
+	SHELL_CMD_ARG(start, NULL, "Start periodic data: start <slow|medium|fast> <hex pdid>...", cmd_uds_periodic_start, 3, UDS_PERIODIC_MAX - 1),
+	SHELL_CMD_ARG(stop, NULL, "Stop periodic data: stop [hex pdid...], all without any", cmd_uds_periodic_stop, 1, UDS_PERIODIC_MAX),
+	SHELL_CMD(show, NULL, "Defined periodic DIDs and their latest values", cmd_uds_periodic_show),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_uds,
+	SHELL_CMD_ARG(open, NULL, "Bind ISO-TP: open <hex tx id> <hex rx id> [ext]", cmd_uds_open, 3, 1),
+	SHELL_CMD(close, NULL, "Unbind ISO-TP", cmd_uds_close),
+	SHELL_CMD_ARG(session, NULL, "DiagnosticSessionControl: session <hex session>", cmd_uds_session, 2, 0),
+	SHELL_CMD_ARG(read, NULL, "ReadDataByIdentifier: read <hex did>:<length>...", cmd_uds_read, 2, UDS_SHELL_MAX_DIDS - 1),
+	SHELL_CMD_ARG(request, NULL, "Raw request: request <hex bytes>", cmd_uds_request, 2, 0),
+	SHELL_CMD_ARG(dynamic, NULL, "Define a periodic DID: dynamic <hex pdid> <hex did>:<position>:<size>...", cmd_uds_dynamic, 3, UDS_DYN_MAX_ELEMENTS - 1),
+	SHELL_CMD(periodic, &sub_uds_periodic, "Periodic data", NULL),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(uds, &sub_uds, "UDS client", NULL);
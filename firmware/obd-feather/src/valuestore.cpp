@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2023 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <string.h>
+#include <sys/printk.h>
+
+#include "valuestore.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(valuestore, 3);
+
+ValueStore valuestore;
+
+uint16_t ValueStore::find(const char *name)
+{
+	for (uint16_t i = 0; i < _count; i++) {
+		if (!strcmp(_values[i].name, name)) {
+			return i;
+		}
+	}
+
+	return VALUESTORE_INVALID;
+}
+
+// Slots are never freed, a name that's already known gets its old slot back
+// so reloading a definition doesn't leak.
+uint16_t ValueStore::allocate(const char *name, uint8_t decimals)
+{
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	uint16_t index = find(name);
+
+	if (index == VALUESTORE_INVALID) {
+		size_t len = strlen(name) + 1;
+
+		if (_count >= VALUESTORE_SIZE || _pool_used + len > VALUESTORE_NAME_POOL_SIZE) {
+			k_mutex_unlock(&_mutex);
+			LOG_WRN("No room for %s", log_strdup(name));
+			return VALUESTORE_INVALID;
+		}
+
+		char *copy = &_pool[_pool_used];
+		memcpy(copy, name, len);
+		_pool_used += len;
+
+		index = _count;
+		_values[index].name = copy;
+		_count++;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&_lock);
+	_values[index].value = 0;
+	_values[index].timestamp = 0;
+	_values[index].decimals = decimals;
+	k_spin_unlock(&_lock, key);
+
+	k_mutex_unlock(&_mutex);
+
+	return index;
+}
+
+uint16_t ValueStore::allocate(const char *group, const char *name, uint8_t decimals)
+{
+	char key[VALUESTORE_NAME_MAX];
+
+	if (snprintk(key, sizeof(key), "%s.%s", group, name) >= (int)sizeof(key)) {
+		LOG_WRN("Name too long: %s.%s", log_strdup(group), log_strdup(name));
+		return VALUESTORE_INVALID;
+	}
+
+	return allocate(key, decimals);
+}
+
+void ValueStore::set(uint16_t index, int64_t value, uint32_t timestamp)
+{
+	if (index >= _count) {
+		return;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&_lock);
+	_values[index].value = value;
+	_values[index].timestamp = timestamp;
+	k_spin_unlock(&_lock, key);
+}
+
+bool ValueStore::get(uint16_t index, value_t *value)
+{
+	if (index >= _count || !value) {
+		return false;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&_lock);
+	*value = _values[index];
+	k_spin_unlock(&_lock, key);
+
+	return value->timestamp != 0;
+}
@@ -0,0 +1,596 @@
+/*
+ * Copyright (c) 2023 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr.h>
+#include <kernel.h>
+#include <sys/byteorder.h>
+#include <drivers/can.h>
+#include <fs/fs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <shell/shell.h>
+
+#include "canbus.h"
+#include "cantraffic.h"
+#include "valuestore.h"
+#include "xcp.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(xcp, 3);
+
+XCPMaster xcp;
+
+// Command responses handed from the CAN RX thread to whoever is waiting
+K_MSGQ_DEFINE(xcp_resp_msgq, sizeof(struct zcan_frame), 4, 4);
+
+// Only used while loading, kept off the caller's stack
+static char xcp_line[XCP_LINE_SIZE];
+static uint8_t xcp_read_buf[XCP_READ_SIZE];
+
+#define XCP_MAX_TOKENS 8
+
+static int xcp_split(char *line, char **tokens)
+{
+	int count = 0;
+
+	while (*line && count < XCP_MAX_TOKENS) {
+		while (*line == ' ' || *line == '\t') {
+			*line++ = '\0';
+		}
+		if (!*line || *line == '#') {
+			break;
+		}
+
+		tokens[count++] = line;
+		while (*line && *line != ' ' && *line != '\t') {
+			line++;
+		}
+	}
+
+	return count;
+}
+
+bool XCPMaster::load(const char *path)
+{
+	struct fs_file_t file;
+	ssize_t count;
+	int len = 0;
+	int line = 1;
+	bool ok = true;
+
+	fs_file_t_init(&file);
+
+	if (fs_open(&file, path, FS_O_READ) < 0) {
+		LOG_WRN("No XCP table at %s", log_strdup(path));
+		return false;
+	}
+
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	_ready = false;
+	_slave_key = CANTRAFFIC_KEY_EMPTY;
+	_daq_count = 0;
+	_odt_count = 0;
+	_entry_count = 0;
+
+	while (ok && (count = fs_read(&file, xcp_read_buf, sizeof(xcp_read_buf))) > 0) {
+		for (ssize_t i = 0; ok && i < count; i++) {
+			char c = xcp_read_buf[i];
+
+			if (c == '\n') {
+				xcp_line[len] = '\0';
+				ok = parseLine(xcp_line);
+				len = 0;
+				line++;
+			} else if (c != '\r' && len < XCP_LINE_SIZE - 1) {
+				xcp_line[len++] = c;
+			}
+		}
+	}
+
+	if (ok && len) {
+		xcp_line[len] = '\0';
+		ok = parseLine(xcp_line);
+	}
+
+	fs_close(&file);
+
+	if (!ok) {
+		LOG_ERR("Bad XCP table at line %d", line);
+		_slave_key = CANTRAFFIC_KEY_EMPTY;
+	} else {
+		LOG_INF("Loaded %u DAQ lists, %u ODTs, %u entries", _daq_count, _odt_count, _entry_count);
+		_ready = _slave_key != CANTRAFFIC_KEY_EMPTY && _entry_count != 0;
+	}
+
+	k_mutex_unlock(&_mutex);
+
+	return _ready;
+}
+
+bool XCPMaster::parseLine(char *line)
+{
+	char *tokens[XCP_MAX_TOKENS];
+	int count = xcp_split(line, tokens);
+
+	if (!count) {
+		return true;
+	}
+
+	if (!strcmp(tokens[0], "can") && count >= 3) {
+		_ext = count >= 4 && tokens[3][0] == 'x';
+		_master_id = strtoul(tokens[1], NULL, 16);
+		_slave_key = strtoul(tokens[2], NULL, 16) | (_ext ? CANTRAFFIC_KEY_EXT : 0);
+		return true;
+	}
+
+	if (!strcmp(tokens[0], "daq") && count >= 4) {
+		uint32_t list = strtoul(tokens[1], NULL, 10);
+
+		if (list != _daq_count || _daq_count >= XCP_MAX_DAQ) {
+			return false;
+		}
+
+		xcp_daq_t *daq = &_daqs[_daq_count++];
+		daq->event = strtoul(tokens[2], NULL, 10);
+		daq->prescaler = MAX(strtoul(tokens[3], NULL, 10), 1);
+		daq->first_odt = _odt_count;
+		daq->odt_count = 0;
+		return true;
+	}
+
+	if (!strcmp(tokens[0], "entry") && count >= 8) {
+		uint32_t list = strtoul(tokens[1], NULL, 10);
+		uint32_t odt = strtoul(tokens[2], NULL, 10);
+		uint32_t size = strtoul(tokens[5], NULL, 10);
+
+		if (list >= _daq_count || (size != 1 && size != 2 && size != 4)) {
+			return false;
+		}
+
+		xcp_daq_t *daq = &_daqs[list];
+
+		// ODTs are laid out back to back, so only the newest can grow
+		if (odt == daq->odt_count) {
+			if (!daq->odt_count) {
+				daq->first_odt = _odt_count;
+			}
+			if (_odt_count >= XCP_MAX_ODT || daq->first_odt + daq->odt_count != _odt_count) {
+				return false;
+			}
+
+			xcp_odt_t *entry_odt = &_odts[_odt_count++];
+			entry_odt->daq = list;
+			entry_odt->entry_count = 0;
+			entry_odt->first_entry = _entry_count;
+			daq->odt_count++;
+		} else if (odt + 1 != daq->odt_count || daq->first_odt + odt + 1 != _odt_count) {
+			return false;
+		}
+
+		xcp_odt_t *entry_odt = &_odts[_odt_count - 1];
+		uint8_t offset = 1;
+
+		if (entry_odt->entry_count) {
+			const xcp_entry_t *last = &_entries[_entry_count - 1];
+			offset = last->offset + last->size;
+		}
+
+		if (offset + size > XCP_MAX_DTO || _entry_count >= XCP_MAX_ENTRIES) {
+			return false;
+		}
+
+		uint16_t index = valuestore.allocate("XCP", tokens[7], 0);
+		if (index == VALUESTORE_INVALID) {
+			return false;
+		}
+
+		for (uint16_t i = 0; i < _entry_count; i++) {
+			if (_entries[i].value_index == index) {
+				LOG_WRN("Duplicate entry %s", log_strdup(tokens[7]));
+				return false;
+			}
+		}
+
+		xcp_entry_t *entry = &_entries[_entry_count++];
+		entry->ext = strtoul(tokens[3], NULL, 16);
+		entry->address = strtoul(tokens[4], NULL, 16);
+		entry->size = size;
+		entry->offset = offset;
+		entry->flags = tokens[6][0] == 's' ? XCP_ENTRY_SIGNED : 0;
+		entry->value_index = index;
+		entry_odt->entry_count++;
+		return true;
+	}
+
+	return false;
+}
+
+void XCPMaster::clearPIDs(void)
+{
+	memset(_pid_map, XCP_PID_UNUSED, sizeof(_pid_map));
+}
+
+// Multi-byte command parameters go in the slave's byte order
+void XCPMaster::putWord(uint8_t *p, uint16_t value)
+{
+	if (_motorola) {
+		sys_put_be16(value, p);
+	} else {
+		sys_put_le16(value, p);
+	}
+}
+
+uint16_t XCPMaster::getWord(const uint8_t *p)
+{
+	return _motorola ? sys_get_be16(p) : sys_get_le16(p);
+}
+
+void XCPMaster::putLong(uint8_t *p, uint32_t value)
+{
+	if (_motorola) {
+		sys_put_be32(value, p);
+	} else {
+		sys_put_le32(value, p);
+	}
+}
+
+// One CTO out, one back.  Frames are padded to 8 bytes, which some slaves
+// insist on.
+int XCPMaster::command(int len)
+{
+	struct zcan_frame frame = {};
+
+	if (_slave_key == CANTRAFFIC_KEY_EMPTY) {
+		return XCP_ERR_NOT_CONNECTED;
+	}
+
+	k_msgq_purge(&xcp_resp_msgq);
+
+	frame.id = _master_id;
+	frame.id_type = _ext ? CAN_EXTENDED_IDENTIFIER : CAN_STANDARD_IDENTIFIER;
+	frame.rtr = CAN_DATAFRAME;
+	frame.dlc = XCP_MAX_CTO;
+	memcpy(frame.data, _cmd, len);
+
+	if (!canbus.sendFrame(&frame, K_MSEC(XCP_TIMEOUT_MS))) {
+		return XCP_ERR_SEND;
+	}
+
+	if (k_msgq_get(&xcp_resp_msgq, &frame, K_MSEC(XCP_TIMEOUT_MS)) != 0) {
+		return XCP_ERR_TIMEOUT;
+	}
+
+	memcpy(_resp, frame.data, sizeof(_resp));
+
+	if (_resp[0] == XCP_PID_ERR) {
+		_last_error = _resp[1];
+		LOG_WRN("Command %02X failed: %02X", _cmd[0], _last_error);
+		return XCP_ERR_NEGATIVE;
+	}
+
+	return frame.dlc;
+}
+
+bool XCPMaster::connect(void)
+{
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	_cmd[0] = XCP_CMD_CONNECT;
+	_cmd[1] = 0x00;		// normal mode
+
+	int count = command(2);
+	if (count >= 3) {
+		_motorola = _resp[2] & XCP_COMM_MODE_MOTOROLA;
+		_connected = true;
+	}
+
+	k_mutex_unlock(&_mutex);
+
+	return _connected;
+}
+
+void XCPMaster::disconnect(void)
+{
+	stop();
+
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	if (_connected) {
+		_cmd[0] = XCP_CMD_DISCONNECT;
+		command(1);
+		_connected = false;
+	}
+
+	k_mutex_unlock(&_mutex);
+}
+
+// Dynamic DAQ setup from the table: allocate everything first, as the
+// standard requires, then fill in the entries and select each list.
+bool XCPMaster::configure(void)
+{
+	// Dynamic lists are numbered after the slave's predefined ones
+	_cmd[0] = XCP_CMD_GET_DAQ_PROCESSOR_INFO;
+	if (command(1) < 8) {
+		return false;
+	}
+
+	uint16_t max_daq = getWord(&_resp[2]);
+	_min_daq = _resp[6];
+
+	if (!(_resp[1] & XCP_DAQ_CONFIG_DYNAMIC) || _min_daq + _daq_count > max_daq) {
+		LOG_ERR("Slave can't take %u dynamic DAQ lists", _daq_count);
+		return false;
+	}
+
+	// Relative ODT numbers put the DAQ list number after the PID as well
+	if ((_resp[7] & XCP_DAQ_KEY_ID_FIELD_MASK) != XCP_DAQ_KEY_ID_ABSOLUTE) {
+		LOG_ERR("Slave uses identification field type %u, only absolute ODTs are handled",
+			(_resp[7] & XCP_DAQ_KEY_ID_FIELD_MASK) >> 6);
+		return false;
+	}
+
+	_cmd[0] = XCP_CMD_FREE_DAQ;
+	if (command(1) < 0) {
+		return false;
+	}
+
+	_cmd[0] = XCP_CMD_ALLOC_DAQ;
+	_cmd[1] = 0;
+	putWord(&_cmd[2], _daq_count);
+	if (command(4) < 0) {
+		return false;
+	}
+
+	for (int i = 0; i < _daq_count; i++) {
+		_cmd[0] = XCP_CMD_ALLOC_ODT;
+		_cmd[1] = 0;
+		putWord(&_cmd[2], _min_daq + i);
+		_cmd[4] = _daqs[i].odt_count;
+		if (command(5) < 0) {
+			return false;
+		}
+	}
+
+	for (int i = 0; i < _daq_count; i++) {
+		for (int j = 0; j < _daqs[i].odt_count; j++) {
+			_cmd[0] = XCP_CMD_ALLOC_ODT_ENTRY;
+			_cmd[1] = 0;
+			putWord(&_cmd[2], _min_daq + i);
+			_cmd[4] = j;
+			_cmd[5] = _odts[_daqs[i].first_odt + j].entry_count;
+			if (command(6) < 0) {
+				return false;
+			}
+		}
+	}
+
+	for (int i = 0; i < _daq_count; i++) {
+		for (int j = 0; j < _daqs[i].odt_count; j++) {
+			const xcp_odt_t *odt = &_odts[_daqs[i].first_odt + j];
+
+			_cmd[0] = XCP_CMD_SET_DAQ_PTR;
+			_cmd[1] = 0;
+			putWord(&_cmd[2], _min_daq + i);
+			_cmd[4] = j;
+			_cmd[5] = 0;
+			if (command(6) < 0) {
+				return false;
+			}
+
+			// The slave moves the pointer along after each write
+			for (int k = 0; k < odt->entry_count; k++) {
+				const xcp_entry_t *entry = &_entries[odt->first_entry + k];
+
+				_cmd[0] = XCP_CMD_WRITE_DAQ;
+				_cmd[1] = 0xFF;		// not a bit
+				_cmd[2] = entry->size;
+				_cmd[3] = entry->ext;
+				putLong(&_cmd[4], entry->address);
+				if (command(8) < 0) {
+					return false;
+				}
+			}
+		}
+	}
+
+	clearPIDs();
+
+	for (int i = 0; i < _daq_count; i++) {
+		const xcp_daq_t *daq = &_daqs[i];
+
+		// No slave timestamps, DTOs are stamped on arrival like all traffic
+		_cmd[0] = XCP_CMD_SET_DAQ_LIST_MODE;
+		_cmd[1] = 0;
+		putWord(&_cmd[2], _min_daq + i);
+		putWord(&_cmd[4], daq->event);
+		_cmd[6] = daq->prescaler;
+		_cmd[7] = 0;
+		if (command(8) < 0) {
+			return false;
+		}
+
+		_cmd[0] = XCP_CMD_START_STOP_DAQ_LIST;
+		_cmd[1] = XCP_DAQ_LIST_SELECT;
+		putWord(&_cmd[2], _min_daq + i);
+		if (command(4) < 2) {
+			return false;
+		}
+
+		// Absolute ODT numbers, the list's ODTs follow on from FIRST_PID
+		uint8_t first_pid = _resp[1];
+		for (int j = 0; j < daq->odt_count; j++) {
+			uint32_t pid = first_pid + j;
+
+			if (pid < XCP_PID_SERV) {
+				_pid_map[pid] = daq->first_odt + j;
+			}
+		}
+	}
+
+	return true;
+}
+
+bool XCPMaster::start(void)
+{
+	if (!_ready || (!_connected && !connect())) {
+		return false;
+	}
+
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	bool status = configure();
+	if (status) {
+		// DTOs can come before the response does
+		_running = true;
+
+		_cmd[0] = XCP_CMD_START_STOP_SYNCH;
+		_cmd[1] = XCP_SYNCH_START_SELECTED;
+		status = command(2) >= 0;
+		_running = status;
+	}
+
+	k_mutex_unlock(&_mutex);
+
+	if (!status) {
+		LOG_ERR("DAQ setup failed");
+	}
+
+	return status;
+}
+
+void XCPMaster::stop(void)
+{
+	k_mutex_lock(&_mutex, K_FOREVER);
+
+	if (_running) {
+		_cmd[0] = XCP_CMD_START_STOP_SYNCH;
+		_cmd[1] = XCP_SYNCH_STOP_ALL;
+		command(2);
+		_running = false;
+	}
+
+	k_mutex_unlock(&_mutex);
+}
+
+// Called from the CAN RX thread for every frame, takes the ones from the
+// slave.  Responses go to the waiting command, DTOs are decoded in place.
+bool XCPMaster::receive(const struct zcan_frame *frame, uint32_t timestamp)
+{
+	if (cantraffic_key(frame) != _slave_key) {
+		return false;
+	}
+
+	if (frame->dlc == 0 || frame->rtr == CAN_REMOTEREQUEST) {
+		return true;
+	}
+
+	uint8_t pid = frame->data[0];
+
+	if (pid == XCP_PID_RES || pid == XCP_PID_ERR) {
+		k_msgq_put(&xcp_resp_msgq, frame, K_NO_WAIT);
+	} else if (pid < XCP_PID_SERV && _running) {
+		decode(frame, timestamp);
+	}
+
+	return true;
+}
+
+void XCPMaster::decode(const struct zcan_frame *frame, uint32_t timestamp)
+{
+	uint8_t index = _pid_map[frame->data[0]];
+
+	if (index == XCP_PID_UNUSED) {
+		return;
+	}
+
+	const xcp_odt_t *odt = &_odts[index];
+	const xcp_entry_t *entry = &_entries[odt->first_entry];
+	uint8_t dlc = MIN(frame->dlc, CAN_MAX_DLC);
+
+	_dto_count++;
+
+	for (int i = 0; i < odt->entry_count; i++, entry++) {
+		if (entry->offset + entry->size > dlc) {
+			break;
+		}
+
+		const uint8_t *p = &frame->data[entry->offset];
+		uint32_t raw;
+
+		switch (entry->size) {
+			case 1:
+				raw = p[0];
+				break;
+
+			case 2:
+				raw = _motorola ? sys_get_be16(p) : sys_get_le16(p);
+				break;
+
+			default:
+				raw = _motorola ? sys_get_be32(p) : sys_get_le32(p);
+				break;
+		}
+
+		int64_t value = raw;
+		if (entry->flags & XCP_ENTRY_SIGNED) {
+			uint32_t sign = 1U << (entry->size * 8 - 1);
+			value = (int32_t)((raw ^ sign) - sign);
+		}
+
+		valuestore.set(entry->value_index, value, timestamp);
+	}
+}
+
+// Helpers
+
+void xcp_init(void)
+{
+	xcp.load(XCP_FILE_PATH);
+}
+
+// Shell
+
+static int cmd_xcp_start(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	if (!xcp.start()) {
+		shell_error(sh, "DAQ not started, see the log");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int cmd_xcp_stop(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(sh);
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	xcp.disconnect();
+	return 0;
+}
+
+static int cmd_xcp_status(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	shell_print(sh, "%s, %u DTOs", xcp.isRunning() ? "running" : "stopped", xcp.getDTOCount());
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_xcp,
+	SHELL_CMD(start, NULL, "Connect and start DAQ from " XCP_FILE_PATH, cmd_xcp_start),
+	SHELL_CMD(stop, NULL, "Stop DAQ and disconnect", cmd_xcp_stop),
+	SHELL_CMD(status, NULL, "Show DAQ state", cmd_xcp_status),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(xcp, &sub_xcp, "XCP on CAN DAQ", NULL);
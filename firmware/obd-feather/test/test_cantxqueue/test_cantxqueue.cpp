@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2023 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <unity.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cantxqueue.h"
+
+#define SEED 0x2545F491
+#define TICKS 20000
+#define TOP_ID 0x010        // nothing else in the mix gets below it
+
+static CANTxQueue queue;
+static uint32_t tags[CAN_TX_QUEUE_SIZE];    // what the caller keeps per slot
+static uint32_t rng;
+
+static uint32_t next_random(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+static int push(uint32_t key, uint32_t tag)
+{
+	int slot = queue.push(key);
+
+	TEST_ASSERT_TRUE(slot >= 0 && slot < CAN_TX_QUEUE_SIZE);
+	tags[slot] = tag;
+	return slot;
+}
+
+static uint32_t pop(void)
+{
+	int slot = queue.pop();
+
+	TEST_ASSERT_TRUE(slot >= 0 && slot < CAN_TX_QUEUE_SIZE);
+	return tags[slot];
+}
+
+void setUp(void)
+{
+	queue.reset();
+	memset(tags, 0, sizeof(tags));
+	rng = SEED;
+}
+
+void tearDown(void)
+{
+}
+
+// Lower wins at the first differing bit on the wire
+void test_arbitration_key_order(void)
+{
+	uint32_t std_data = CAN_ARBITRATION_KEY(0x100, false, false);
+	uint32_t std_rtr = CAN_ARBITRATION_KEY(0x100, false, true);
+	uint32_t ext_data = CAN_ARBITRATION_KEY(0x100 << 18, true, false);
+	uint32_t ext_rtr = CAN_ARBITRATION_KEY(0x100 << 18, true, true);
+
+	TEST_ASSERT_TRUE(std_data < std_rtr);
+	TEST_ASSERT_TRUE(std_rtr < ext_data);
+	TEST_ASSERT_TRUE(ext_data < ext_rtr);
+
+	// The base ID decides before IDE does
+	TEST_ASSERT_TRUE(CAN_ARBITRATION_KEY(0x0FF << 18, true, false) < std_data);
+	TEST_ASSERT_TRUE(ext_rtr < CAN_ARBITRATION_KEY(0x101, false, false));
+	TEST_ASSERT_TRUE(CAN_ARBITRATION_KEY(0x10000001, true, false) < CAN_ARBITRATION_KEY(0x10000002, true, false));
+}
+
+void test_mixed_priority_pop_order(void)
+{
+	static const struct {
+		uint32_t id;
+		bool ext;
+		bool rtr;
+	} frames[] = {
+		{ 0x7DF, false, false },
+		{ 0x18DAF110, true, false },
+		{ 0x7E0, false, false },
+		{ 0x100, false, true },
+		{ 0x7DF, false, false },
+		{ 0x100, false, false },
+		{ 0x0CF00400, true, false },
+		{ 0x7DF, false, false },
+	};
+	// Indices into frames[], equal keys in the order they were pushed.  The
+	// J1939 IDs have base IDs 0x33C and 0x636, under 0x7DF.
+	static const uint32_t expected[] = { 5, 3, 6, 1, 0, 4, 7, 2 };
+
+	for (int i = 0; i < (int)(sizeof(frames) / sizeof(frames[0])); i++) {
+		push(CAN_ARBITRATION_KEY(frames[i].id, frames[i].ext, frames[i].rtr), i);
+	}
+
+	TEST_ASSERT_EQUAL(8, queue.getCount());
+	for (int i = 0; i < 8; i++) {
+		TEST_ASSERT_EQUAL(expected[i], pop());
+	}
+	TEST_ASSERT_EQUAL(0, queue.getCount());
+}
+
+void test_full_and_empty(void)
+{
+	TEST_ASSERT_EQUAL(-1, queue.pop());
+
+	for (int i = 0; i < CAN_TX_QUEUE_SIZE; i++) {
+		push(CAN_ARBITRATION_KEY(0x700 - i, false, false), i);
+	}
+	TEST_ASSERT_EQUAL(-1, queue.push(CAN_ARBITRATION_KEY(0x000, false, false)));
+
+	// Slots come back for reuse, nothing handed out twice
+	for (int i = 0; i < CAN_TX_QUEUE_SIZE; i++) {
+		TEST_ASSERT_EQUAL(CAN_TX_QUEUE_SIZE - 1 - i, pop());
+	}
+	TEST_ASSERT_EQUAL(-1, queue.pop());
+}
+
+// One frame leaves per tick, with random mixed-priority frames arriving
+// around it and the queue often full.  Every pop has to be the lowest key
+// waiting (oldest among equals), and the top ID never waits behind
+// anything: it goes at the very next transmit slot.
+void test_highest_priority_wait(void)
+{
+	bool waiting[CAN_TX_QUEUE_SIZE] = {};
+	uint32_t keys[CAN_TX_QUEUE_SIZE];
+	uint32_t seq[CAN_TX_QUEUE_SIZE];
+	uint32_t pushed_at[CAN_TX_QUEUE_SIZE];
+	uint32_t next_seq = 0;
+	uint32_t top_key = CAN_ARBITRATION_KEY(TOP_ID, false, false);
+	uint32_t top_sent = 0;
+	uint32_t worst_wait = 0;
+	bool top_queued = false;
+	bool filled = false;
+
+	for (uint32_t tick = 0; tick < TICKS; tick++) {
+		int arrivals = next_random() % 3;
+
+		for (int i = 0; i < arrivals && queue.getCount() < CAN_TX_QUEUE_SIZE; i++) {
+			uint32_t key;
+
+			if (!top_queued && next_random() % 8 == 0) {
+				key = top_key;
+				top_queued = true;
+			} else if (next_random() % 2) {
+				key = CAN_ARBITRATION_KEY(TOP_ID + 1 + next_random() % (0x7FF - TOP_ID), false, next_random() % 16 == 0);
+			} else {
+				key = CAN_ARBITRATION_KEY(((TOP_ID + 1) << 18) + next_random() % (0x1FFFFFFF - ((TOP_ID + 1) << 18)),
+							  true, false);
+			}
+
+			int slot = push(key, 0);
+			TEST_ASSERT_FALSE(waiting[slot]);
+			waiting[slot] = true;
+			keys[slot] = key;
+			seq[slot] = next_seq++;
+			pushed_at[slot] = tick;
+		}
+		filled |= queue.getCount() == CAN_TX_QUEUE_SIZE;
+
+		if (!queue.getCount()) {
+			continue;
+		}
+
+		int best = -1;
+		for (int slot = 0; slot < CAN_TX_QUEUE_SIZE; slot++) {
+			if (waiting[slot] && (best < 0 || keys[slot] < keys[best] ||
+					      (keys[slot] == keys[best] && seq[slot] < seq[best]))) {
+				best = slot;
+			}
+		}
+
+		int slot = queue.pop();
+		TEST_ASSERT_EQUAL(best, slot);
+		waiting[slot] = false;
+
+		if (keys[slot] == top_key) {
+			uint32_t wait = tick - pushed_at[slot];
+			if (wait > worst_wait) {
+				worst_wait = wait;
+			}
+			top_sent++;
+			top_queued = false;
+		}
+	}
+
+	TEST_ASSERT_TRUE(filled);
+	TEST_ASSERT_TRUE(top_sent > TICKS / 20);
+	TEST_ASSERT_EQUAL(0, worst_wait);
+}
+
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	UNITY_BEGIN();
+	RUN_TEST(test_arbitration_key_order);
+	RUN_TEST(test_mixed_priority_pop_order);
+	RUN_TEST(test_full_and_empty);
+	RUN_TEST(test_highest_priority_wait);
+	return UNITY_END();
+}
@@ -0,0 +1,462 @@
+/*
+ * Copyright (c) 2023 Gavin Hurlbut
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <unity.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "klineframer.h"
+
+#define BYTE_US 962         // 10400 baud
+#define GAP_US (KLINE_P1MAX_MS * 1000)
+#define MAX_FRAMES 4
+
+typedef struct {
+	uint8_t data[KLINE_FRAME_SIZE];
+	int length;
+	int header;
+} frame_t;
+
+static frame_t frames[MAX_FRAMES];
+static int frame_count;
+
+static void on_frame(const uint8_t *data, int length, int header, void *user_data)
+{
+	(void)user_data;
+
+	TEST_ASSERT_LESS_THAN(MAX_FRAMES, frame_count);
+	memcpy(frames[frame_count].data, data, length);
+	frames[frame_count].length = length;
+	frames[frame_count].header = header;
+	frame_count++;
+}
+
+static KLineFramer framer(on_frame, NULL);
+static uint32_t now;
+
+// Back to back after the last byte, or after an idle gap
+static void feed(const uint8_t *data, int len, uint32_t idle_us = 0)
+{
+	now += idle_us;
+	for (int i = 0; i < len; i++) {
+		now += BYTE_US;
+		framer.feed(data[i], now);
+	}
+}
+
+static int build(uint8_t *buf, const uint8_t *header, int header_len, int payload_len)
+{
+	uint8_t sum = 0;
+	int len = 0;
+
+	for (int i = 0; i < header_len; i++) {
+		buf[len++] = header[i];
+	}
+	for (int i = 0; i < payload_len; i++) {
+		buf[len++] = (uint8_t)(0x41 + i);
+	}
+	for (int i = 0; i < len; i++) {
+		sum += buf[i];
+	}
+	buf[len++] = sum;
+
+	return len;
+}
+
+void setUp(void)
+{
+	framer = KLineFramer(on_frame, NULL);
+	framer.setTiming(BYTE_US, GAP_US);
+	frame_count = 0;
+	now = 1000000;
+}
+
+void tearDown(void)
+{
+}
+
+static void test_short_kwp_frame(void)
+{
+	static const uint8_t header[] = { KWP_FMT_PHYSICAL | 3, 0xF1, 0x10 };
+	uint8_t buf[16];
+	int len = build(buf, header, sizeof(header), 3);
+
+	feed(buf, len);
+
+	TEST_ASSERT_EQUAL(1, frame_count);
+	TEST_ASSERT_EQUAL(len - 1, frames[0].length);
+	TEST_ASSERT_EQUAL(3, frames[0].header);
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(buf, frames[0].data, len - 1);
+	TEST_ASSERT_FALSE(framer.isOpen());
+}
+
+// Far longer than one 32 byte DMA buffer, with the bytes inside P1max of
+// each other but the buffers a good 30ms apart
+static void test_long_frame_in_chunks(void)
+{
+	static const uint8_t header[] = { KWP_FMT_PHYSICAL, 0xF1, 0x10, 120 };
+	uint8_t buf[KLINE_FRAME_SIZE];
+	int len = build(buf, header, sizeof(header), 120);
+
+	for (int pos = 0; pos < len; pos += 32) {
+		int chunk = len - pos < 32 ? len - pos : 32;
+		feed(&buf[pos], chunk, pos ? 5000 : 0);
+	}
+
+	TEST_ASSERT_EQUAL(1, frame_count);
+	TEST_ASSERT_EQUAL(len - 1, frames[0].length);
+	TEST_ASSERT_EQUAL(4, frames[0].header);
+	TEST_ASSERT_EQUAL(0, framer.getErrors());
+}
+
+// The longest KWP2000 message, 255 bytes of payload behind a length byte,
+// arriving in 32 byte buffers
+static void test_max_length_frame(void)
+{
+	static const uint8_t header[] = { KWP_FMT_PHYSICAL, 0xF1, 0x10, KLINE_MAX_PAYLOAD };
+	uint8_t buf[KLINE_FRAME_SIZE];
+	int len = build(buf, header, sizeof(header), KLINE_MAX_PAYLOAD);
+
+	TEST_ASSERT_EQUAL(KLINE_FRAME_SIZE, len);
+
+	for (int pos = 0; pos < len; pos += 32) {
+		int chunk = len - pos < 32 ? len - pos : 32;
+		feed(&buf[pos], chunk);
+	}
+
+	TEST_ASSERT_EQUAL(1, frame_count);
+	TEST_ASSERT_EQUAL(KLINE_FRAME_SIZE - 1, frames[0].length);
+	TEST_ASSERT_EQUAL(KLINE_MAX_HEADER, frames[0].header);
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(buf, frames[0].data, len - 1);
+	TEST_ASSERT_FALSE(framer.isOpen());
+}
+
+// Anything past the longest frame is garbage up to the next gap
+static void test_overlong_headerless(void)
+{
+	static const uint8_t header[] = { 0x48, 0x6B, 0x10 };
+	uint8_t buf[KLINE_FRAME_SIZE + 8];
+	int len = build(buf, header, sizeof(header), KLINE_FRAME_SIZE);
+
+	framer.setHeaderless(true);
+	feed(buf, len);
+	framer.close();
+
+	TEST_ASSERT_EQUAL(0, frame_count);
+	TEST_ASSERT_EQUAL(1, framer.getErrors());
+}
+
+static void test_gap_inside_p1max_keeps_frame(void)
+{
+	static const uint8_t header[] = { 0x48, 0x6B, 0x10 };
+	uint8_t buf[16];
+	int len = build(buf, header, sizeof(header), 4);
+
+	framer.setHeaderless(true);
+	feed(buf, 3);
+	feed(&buf[3], len - 3, GAP_US - 1000);
+	TEST_ASSERT_EQUAL(0, frame_count);
+
+	framer.close();
+	TEST_ASSERT_EQUAL(1, frame_count);
+	TEST_ASSERT_EQUAL(len - 1, frames[0].length);
+}
+
+static void test_gap_over_p1max_splits_frames(void)
+{
+	static const uint8_t header[] = { 0x48, 0x6B, 0x10 };
+	uint8_t first[16];
+	uint8_t second[16];
+	int first_len = build(first, header, sizeof(header), 2);
+	int second_len = build(second, header, sizeof(header), 5);
+
+	framer.setHeaderless(true);
+	feed(first, first_len);
+	feed(second, second_len, GAP_US + 1000);
+	TEST_ASSERT_EQUAL(1, frame_count);
+	TEST_ASSERT_EQUAL(first_len - 1, frames[0].length);
+
+	framer.close();
+	TEST_ASSERT_EQUAL(2, frame_count);
+	TEST_ASSERT_EQUAL(second_len - 1, frames[1].length);
+}
+
+static void test_bad_checksum(void)
+{
+	static const uint8_t header[] = { KWP_FMT_PHYSICAL | 2, 0xF1, 0x10 };
+	uint8_t buf[16];
+	int len = build(buf, header, sizeof(header), 2);
+
+	buf[len - 1] ^= 0xFF;
+	feed(buf, len);
+
+	TEST_ASSERT_EQUAL(0, frame_count);
+	TEST_ASSERT_EQUAL(1, framer.getErrors());
+}
+
+static void test_cut_short_then_resync(void)
+{
+	static const uint8_t header[] = { KWP_FMT_PHYSICAL | 6, 0xF1, 0x10 };
+	uint8_t buf[16];
+	int len = build(buf, header, sizeof(header), 6);
+
+	feed(buf, 4);
+	feed(buf, len, GAP_US + 1000);
+
+	TEST_ASSERT_EQUAL(1, framer.getErrors());
+	TEST_ASSERT_EQUAL(1, frame_count);
+	TEST_ASSERT_EQUAL(len - 1, frames[0].length);
+}
+
+static void test_skip_until_gap(void)
+{
+	static const uint8_t header[] = { KWP_FMT_PHYSICAL | 2, 0xF1, 0x10 };
+	uint8_t buf[16];
+	int len = build(buf, header, sizeof(header), 2);
+
+	feed(buf, 2);
+	framer.skip();
+	feed(&buf[2], len - 2);
+	TEST_ASSERT_EQUAL(0, frame_count);
+	TEST_ASSERT_TRUE(framer.isOpen());
+
+	feed(buf, len, GAP_US + 1000);
+	TEST_ASSERT_EQUAL(1, frame_count);
+}
+
+// Seeded random stream: valid KWP2000 and ISO 9141 frames mixed with
+// truncated frames, bad checksums, line noise and overlong garbage, with
+// random gaps.  The truncations and garbage are built so each is exactly
+// one error, and every valid frame must come out byte-exact in order.
+#define FUZZ_SEED 0x9E3779B9
+#define FUZZ_ITEMS 5000
+#define FUZZ_PENDING 4
+
+typedef enum {
+	FUZZ_VALID = 0,
+	FUZZ_TRUNCATED,
+	FUZZ_BAD_CHECKSUM,
+	FUZZ_NOISE,
+	FUZZ_GARBAGE,
+	FUZZ_KINDS,
+} fuzz_kind_t;
+
+// Sees how far into _data the framer has got
+class ProbeFramer : public KLineFramer {
+	public:
+		ProbeFramer(kline_frame_cb_t callback, void *user_data) : KLineFramer(callback, user_data) {};
+		int getPos(void) { return _pos; };
+};
+
+static uint32_t fuzz_rng;
+static frame_t fuzz_pending[FUZZ_PENDING];
+static int fuzz_head;
+static int fuzz_tail;
+static uint32_t fuzz_matched;
+
+static uint32_t fuzz_random(void)
+{
+	fuzz_rng ^= fuzz_rng << 13;
+	fuzz_rng ^= fuzz_rng >> 17;
+	fuzz_rng ^= fuzz_rng << 5;
+	return fuzz_rng;
+}
+
+static void fuzz_expect(const uint8_t *data, int length, int header)
+{
+	int next = (fuzz_head + 1) % FUZZ_PENDING;
+
+	TEST_ASSERT_TRUE(next != fuzz_tail);
+	memcpy(fuzz_pending[fuzz_head].data, data, length);
+	fuzz_pending[fuzz_head].length = length;
+	fuzz_pending[fuzz_head].header = header;
+	fuzz_head = next;
+}
+
+static void on_fuzz_frame(const uint8_t *data, int length, int header, void *user_data)
+{
+	(void)user_data;
+
+	TEST_ASSERT_TRUE(fuzz_tail != fuzz_head);
+	TEST_ASSERT_TRUE(length > 0 && length < KLINE_FRAME_SIZE);
+
+	const frame_t *expected = &fuzz_pending[fuzz_tail];
+	TEST_ASSERT_EQUAL(expected->length, length);
+	TEST_ASSERT_EQUAL(expected->header, header);
+	TEST_ASSERT_EQUAL_UINT8_ARRAY(expected->data, data, length);
+
+	fuzz_tail = (fuzz_tail + 1) % FUZZ_PENDING;
+	fuzz_matched++;
+}
+
+// A random KWP2000 frame in any of its four header layouts.  Returns the
+// length, with the header size and the shortest prefix that's an error
+// when cut short there: two bytes, or up to the length byte.
+static int fuzz_kwp(uint8_t *buf, int *header, int *known)
+{
+	static const uint8_t modes[] = { KWP_FMT_PHYSICAL, KWP_FMT_FUNCTIONAL, KWP_FMT_CARB, 0x00 };
+	uint8_t mode = modes[fuzz_random() % sizeof(modes)];
+	bool length_byte = fuzz_random() % 2;
+	int payload = length_byte ? fuzz_random() % (KLINE_MAX_PAYLOAD + 1) : 1 + fuzz_random() % KWP_FMT_LENGTH_MASK;
+	int len = 0;
+
+	buf[len++] = mode | (length_byte ? 0 : payload);
+	if (mode) {
+		buf[len++] = fuzz_random();
+		buf[len++] = fuzz_random();
+	}
+	if (length_byte) {
+		buf[len++] = payload;
+	}
+	*header = len;
+	*known = length_byte ? len : 2;
+
+	for (int i = 0; i < payload; i++) {
+		buf[len++] = fuzz_random();
+	}
+
+	uint8_t sum = 0;
+	for (int i = 0; i < len; i++) {
+		sum += buf[i];
+	}
+	buf[len++] = sum;
+
+	return len;
+}
+
+static int fuzz_iso9141(uint8_t *buf)
+{
+	static const uint8_t header[] = { 0x48, 0x6B, 0x10 };
+
+	return build(buf, header, sizeof(header), 1 + fuzz_random() % 7);
+}
+
+static void fuzz_feed(ProbeFramer *probe, const uint8_t *data, int len, uint32_t idle_us)
+{
+	for (int i = 0; i < len; i++) {
+		now += (i ? fuzz_random() % GAP_US : idle_us) + BYTE_US;
+		probe->feed(data[i], now);
+		TEST_ASSERT_TRUE(probe->getPos() <= KLINE_FRAME_SIZE);
+	}
+}
+
+static void test_fuzz_stream(void)
+{
+	static uint8_t buf[KLINE_FRAME_SIZE + 32];
+	ProbeFramer probe(on_fuzz_frame, NULL);
+	uint32_t valid = 0;
+	uint32_t errors = 0;
+	uint32_t counts[FUZZ_KINDS] = {};
+	bool kwp_ended = false;     // the last item ended on its length, no gap needed
+
+	fuzz_rng = FUZZ_SEED;
+	fuzz_head = 0;
+	fuzz_tail = 0;
+	fuzz_matched = 0;
+	probe.setTiming(BYTE_US, GAP_US);
+
+	for (int item = 0; item < FUZZ_ITEMS; item++) {
+		fuzz_kind_t kind = (fuzz_kind_t)(fuzz_random() % FUZZ_KINDS);
+		bool iso = fuzz_random() % 3 == 0;
+		uint32_t idle = GAP_US + 1 + fuzz_random() % (4 * GAP_US);
+		int header = 3;
+		int known = 1;
+		int len;
+
+		// Length-delimited frames can follow each other inside P1max
+		if (kind == FUZZ_VALID && !iso && kwp_ended && fuzz_random() % 2) {
+			idle = fuzz_random() % GAP_US;
+		} else {
+			probe.setHeaderless(iso);
+		}
+
+		counts[kind]++;
+
+		switch (kind) {
+			case FUZZ_VALID:
+				len = iso ? fuzz_iso9141(buf) : fuzz_kwp(buf, &header, &known);
+				fuzz_expect(buf, len - 1, header < len - 1 ? header : len - 1);
+				valid++;
+				break;
+
+			case FUZZ_TRUNCATED:
+				// Past where the length is known, or a short prefix
+				// could pass its own checksum
+				iso = false;
+				probe.setHeaderless(false);
+				do {
+					len = fuzz_kwp(buf, &header, &known);
+				} while (len < known + 2);
+				len = known + fuzz_random() % (len - 1 - known);
+				errors++;
+				break;
+
+			case FUZZ_BAD_CHECKSUM:
+				len = iso ? fuzz_iso9141(buf) : fuzz_kwp(buf, &header, &known);
+				buf[len - 1] ^= 1 + fuzz_random() % 0xFF;
+				errors++;
+				break;
+
+			case FUZZ_NOISE:
+				// A lone byte is never a frame, nor an error
+				buf[0] = fuzz_random();
+				len = 1;
+				break;
+
+			default:
+				// Headerless only, KWP would take a length from it.  Too
+				// long, or with the checksum forced wrong.
+				iso = true;
+				probe.setHeaderless(true);
+				len = 2 + fuzz_random() % (sizeof(buf) - 2);
+				for (int i = 0; i < len; i++) {
+					buf[i] = fuzz_random();
+				}
+				if (len <= KLINE_FRAME_SIZE) {
+					uint8_t sum = 0;
+					for (int i = 0; i < len - 1; i++) {
+						sum += buf[i];
+					}
+					buf[len - 1] = sum + 1;
+				}
+				errors++;
+				break;
+		}
+
+		fuzz_feed(&probe, buf, len, idle);
+		kwp_ended = (kind == FUZZ_VALID && !iso);
+	}
+
+	probe.close();
+
+	for (int kind = 0; kind < FUZZ_KINDS; kind++) {
+		TEST_ASSERT_TRUE(counts[kind] > FUZZ_ITEMS / (2 * FUZZ_KINDS));
+	}
+	TEST_ASSERT_EQUAL(valid, fuzz_matched);
+	TEST_ASSERT_EQUAL(fuzz_head, fuzz_tail);
+	TEST_ASSERT_EQUAL(valid, probe.getFrames());
+	TEST_ASSERT_EQUAL(errors, probe.getErrors());
+	TEST_ASSERT_FALSE(probe.isOpen());
+}
+
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	UNITY_BEGIN();
+	RUN_TEST(test_short_kwp_frame);
+	RUN_TEST(test_long_frame_in_chunks);
+	RUN_TEST(test_max_length_frame);
+	RUN_TEST(test_overlong_headerless);
+	RUN_TEST(test_gap_inside_p1max_keeps_frame);
+	RUN_TEST(test_gap_over_p1max_splits_frames);
+	RUN_TEST(test_bad_checksum);
+	RUN_TEST(test_cut_short_then_resync);
+	RUN_TEST(test_skip_until_gap);
+	RUN_TEST(test_fuzz_stream);
+	return UNITY_END();
+}